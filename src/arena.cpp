@@ -0,0 +1,207 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "arena.hpp"
+#include <libxml/xmlmemory.h>
+#include <libxml/xmlerror.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+namespace Transfuse {
+namespace Arena {
+
+// Every block, from the heap or an arena, is preceded by this, so xmlFree() and xmlRealloc() can tell them apart no matter which thread or scope they happen in
+// It is 16 bytes, keeping the alignment that malloc() guarantees
+struct Header {
+	size_t size;
+	size_t in_arena;
+};
+
+struct Chunk {
+	Chunk* next;
+	size_t size;
+};
+
+constexpr size_t chunk_size = 1 << 20;
+
+inline size_t round_up(size_t n) {
+	return (n + 15) & ~static_cast<size_t>(15);
+}
+
+struct Pool {
+	Chunk* chunks = nullptr;
+	char* cur = nullptr;
+	char* end = nullptr;
+
+	void* alloc(size_t n);
+	void release();
+};
+
+static std::atomic<bool> is_installed{ false };
+static thread_local Pool* current = nullptr;
+// One chunk is kept per thread, so that consecutive documents don't go back to the system for memory
+struct Spare {
+	Chunk* chunk = nullptr;
+	~Spare() {
+		std::free(chunk);
+	}
+};
+static thread_local Spare spare;
+
+void* Pool::alloc(size_t n) {
+	if (static_cast<size_t>(end - cur) >= n) {
+		auto p = cur;
+		cur += n;
+		return p;
+	}
+
+	auto size = std::max(chunk_size, n + sizeof(Chunk));
+	Chunk* chunk = nullptr;
+	if (size == chunk_size && spare.chunk) {
+		std::swap(chunk, spare.chunk);
+	}
+	else {
+		chunk = static_cast<Chunk*>(std::malloc(size));
+		if (chunk == nullptr) {
+			return nullptr;
+		}
+		chunk->size = size;
+	}
+	chunk->next = chunks;
+	chunks = chunk;
+
+	auto p = reinterpret_cast<char*>(chunk + 1);
+	// Oversized blocks get a chunk to themselves, and allocation carries on in the chunk it was in
+	if (size == chunk_size) {
+		cur = p + n;
+		end = reinterpret_cast<char*>(chunk) + size;
+	}
+	return p;
+}
+
+void Pool::release() {
+	while (auto chunk = chunks) {
+		chunks = chunk->next;
+		if (spare.chunk == nullptr && chunk->size == chunk_size) {
+			spare.chunk = chunk;
+		}
+		else {
+			std::free(chunk);
+		}
+	}
+	cur = end = nullptr;
+}
+
+static void* tf_malloc(size_t n) {
+	auto total = round_up(n) + sizeof(Header);
+	Header* h = nullptr;
+	if (current) {
+		h = static_cast<Header*>(current->alloc(total));
+	}
+	else {
+		h = static_cast<Header*>(std::malloc(total));
+	}
+	if (h == nullptr) {
+		return nullptr;
+	}
+	h->size = n;
+	h->in_arena = (current != nullptr);
+	return h + 1;
+}
+
+static void tf_free(void* p) {
+	if (p == nullptr) {
+		return;
+	}
+	auto h = static_cast<Header*>(p) - 1;
+	if (!h->in_arena) {
+		std::free(h);
+	}
+}
+
+static void* tf_realloc(void* p, size_t n) {
+	if (p == nullptr) {
+		return tf_malloc(n);
+	}
+	auto h = static_cast<Header*>(p) - 1;
+	if (!h->in_arena) {
+		h = static_cast<Header*>(std::realloc(h, round_up(n) + sizeof(Header)));
+		if (h == nullptr) {
+			return nullptr;
+		}
+		h->size = n;
+		return h + 1;
+	}
+
+	// Growing the most recent block of this thread's arena can happen in place, which is the common case for libxml2's growing buffers
+	if (current && static_cast<char*>(p) + round_up(h->size) == current->cur && static_cast<size_t>(current->end - static_cast<char*>(p)) >= round_up(n)) {
+		current->cur = static_cast<char*>(p) + round_up(n);
+		h->size = n;
+		return p;
+	}
+
+	auto np = tf_malloc(n);
+	if (np) {
+		std::memcpy(np, p, std::min(h->size, n));
+	}
+	return np;
+}
+
+static char* tf_strdup(const char* s) {
+	auto n = std::strlen(s) + 1;
+	auto p = static_cast<char*>(tf_malloc(n));
+	if (p) {
+		std::memcpy(p, s, n);
+	}
+	return p;
+}
+
+void install() {
+	if (!is_installed.exchange(true)) {
+		xmlMemSetup(tf_free, tf_malloc, tf_realloc, tf_strdup);
+	}
+}
+
+bool installed() {
+	return is_installed.load();
+}
+
+Scope::Scope() {
+	if (!installed()) {
+		return;
+	}
+	arena = new Pool;
+	outer = current;
+	current = static_cast<Pool*>(arena);
+}
+
+Scope::~Scope() {
+	if (arena == nullptr) {
+		return;
+	}
+	// The thread's last error may have its message in the arena, and libxml2 frees that when the next error comes along
+	xmlResetLastError();
+	current = static_cast<Pool*>(outer);
+	auto pool = static_cast<Pool*>(arena);
+	pool->release();
+	delete pool;
+}
+
+}
+}
@@ -0,0 +1,51 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_ARENA_HPP_
+#define e5bd51be_ARENA_HPP_
+
+#include <cstddef>
+
+namespace Transfuse {
+
+// Opt-in arena allocation for everything libxml2 allocates while a document is processed
+// Nodes, properties, and strings are bump-allocated from large chunks, xmlFree() of them does nothing, and the chunks are dropped at once when the document is done
+namespace Arena {
+	// Routes libxml2's allocator through the arena hooks; must be called once, before xmlInitParser() or anything else that uses libxml2
+	// Until then, and on threads without a Scope, allocations go to the heap as usual
+	void install();
+	bool installed();
+
+	// Makes the calling thread's libxml2 allocations come from a fresh arena until destruction, which releases all of it
+	// Nothing allocated by libxml2 within the scope may be used after it; heap blocks from other threads may mix freely with arena blocks
+	// Does nothing if install() was not called
+	struct Scope {
+		Scope();
+		~Scope();
+
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+		void* arena = nullptr;
+		void* outer = nullptr;
+	};
+}
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cache.hpp"
+#include "config.hpp"
+#include "base64.hpp"
+#include "shared.hpp"
+#include <xxhash.h>
+#include <sqlite3.h>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+namespace Transfuse {
+
+// State files that make up a finished extraction, other than the stream which needs its header rewritten
+static const char* doc_files[] = { "content.xml", "styled.xml", "state.bin", "state.sqlite3" };
+
+static std::string stream_header(Stream stream, const fs::path& tmpdir) {
+	xmlString header;
+	make_stream(stream)->stream_header(header, tmpdir);
+	return std::string(x2s(header));
+}
+
+// Entries are written under a unique name and renamed into place, so concurrent jobs never see half an entry
+static fs::path temp_name(const fs::path& p) {
+	std::random_device rd;
+	auto rnd = UI64(rd()) | (UI64(rd()) << UI64(32));
+	return concat(p.string(), ".tmp-", base64_url(rnd));
+}
+
+Cache::Cache(fs::path dir)
+  : dir(dir)
+{
+	fs::create_directories(this->dir);
+	if (!fs::is_directory(this->dir)) {
+		throw std::runtime_error(concat("Cache folder did not exist and could not be created: ", this->dir.string()));
+	}
+}
+
+Cache::~Cache() {
+	// Blocks that were never committed are dropped, as whatever failed may have left them half-translated
+	sqlite3_finalize(sel);
+	sqlite3_close(db);
+}
+
+std::string Cache::doc_key(std::string_view original, std::string_view format, Stream stream) {
+	auto hash = XXH64(original.data(), original.size(), 0);
+	return concat(base64_url(static_cast<uint64_t>(hash)), "-", format, "-", stream);
+}
+
+bool Cache::load_doc(std::string_view key, const fs::path& tmpdir, Stream stream) {
+	auto src = dir / "docs" / TF_VERSION / fs::path(std::string(key));
+	if (!fs::exists(src / "extracted")) {
+		return false;
+	}
+
+	for (auto f : doc_files) {
+		if (fs::exists(src / f)) {
+			fs::copy_file(src / f, tmpdir / f, fs::copy_options::overwrite_existing);
+		}
+		else {
+			fs::remove(tmpdir / f);
+		}
+	}
+
+	// The stream is written last, as its presence is what marks the folder as holding a finished extraction
+	auto body = file_load(src / "extracted");
+	std::ofstream out((tmpdir / "extracted").string(), std::ios::binary);
+	out.exceptions(std::ios::badbit | std::ios::failbit);
+	out << stream_header(stream, tmpdir) << body;
+	return true;
+}
+
+void Cache::save_doc(std::string_view key, const fs::path& tmpdir, Stream stream) {
+	auto dst = dir / "docs" / TF_VERSION / fs::path(std::string(key));
+	if (fs::exists(dst)) {
+		return;
+	}
+
+	// The header names the state folder, so only what comes after it can be shared
+	auto extracted = file_load(tmpdir / "extracted");
+	auto header = stream_header(stream, tmpdir);
+	if (extracted.compare(0, header.size(), header) != 0) {
+		return;
+	}
+
+	auto tmp = temp_name(dst);
+	fs::create_directories(tmp);
+	for (auto f : doc_files) {
+		if (fs::exists(tmpdir / f)) {
+			fs::copy_file(tmpdir / f, tmp / f);
+		}
+	}
+	file_save(tmp / "extracted", std::string_view(extracted).substr(header.size()));
+
+	// Losing the race to another job that cached the same document is fine
+	std::error_code ec;
+	fs::rename(tmp, dst, ec);
+	if (ec) {
+		fs::remove_all(tmp, ec);
+	}
+}
+
+// Only injection needs the blocks, so the database is not opened until then
+void Cache::open_blocks() {
+	if (db) {
+		return;
+	}
+	if (sqlite3_initialize() != SQLITE_OK) {
+		throw std::runtime_error("sqlite3_initialize() errored");
+	}
+	if (sqlite3_open_v2((dir / "blocks.sqlite3").string().c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3_open_v2() error: ", sqlite3_errmsg(db)));
+	}
+	// Concurrent jobs share the database, so readers must not block the writer, and the writer waits its turn rather than failing
+	sqlite3_busy_timeout(db, 60000);
+	if (sqlite3_exec(db, "PRAGMA journal_mode=WAL", nullptr, nullptr, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error while setting journal mode: ", sqlite3_errmsg(db)));
+	}
+	if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS blocks (source BLOB PRIMARY KEY NOT NULL, body BLOB NOT NULL) WITHOUT ROWID", nullptr, nullptr, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error while creating blocks table: ", sqlite3_errmsg(db)));
+	}
+	if (sqlite3_prepare_v2(db, "SELECT body FROM blocks WHERE source = :source", -1, &sel, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error preparing select from blocks table: ", sqlite3_errmsg(db)));
+	}
+}
+
+bool Cache::load_block(std::string_view source, std::string& body) {
+	auto it = saved.find(std::string(source));
+	if (it != saved.end()) {
+		body = it->second;
+		return true;
+	}
+
+	open_blocks();
+	sqlite3_reset(sel);
+	if (sqlite3_bind_blob(sel, 1, source.data(), SI(source.size()), SQLITE_STATIC) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error trying to bind blob for source: ", sqlite3_errmsg(db)));
+	}
+	auto r = sqlite3_step(sel);
+	if (r == SQLITE_DONE) {
+		return false;
+	}
+	if (r != SQLITE_ROW) {
+		throw std::runtime_error(concat("sqlite3 error selecting from blocks table: ", sqlite3_errmsg(db)));
+	}
+	body.assign(static_cast<const char*>(sqlite3_column_blob(sel, 0)), SZ(sqlite3_column_bytes(sel, 0)));
+	sqlite3_reset(sel);
+	return true;
+}
+
+void Cache::save_block(std::string_view source, std::string_view body) {
+	saved[std::string(source)].assign(body.begin(), body.end());
+}
+
+void Cache::commit() {
+	if (saved.empty()) {
+		return;
+	}
+
+	open_blocks();
+	sqlite3_stmt* ins = nullptr;
+	if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO blocks (source, body) VALUES (:source, :body)", -1, &ins, nullptr) != SQLITE_OK) {
+		throw std::runtime_error(concat("sqlite3 error preparing insert into blocks table: ", sqlite3_errmsg(db)));
+	}
+	// IMMEDIATE takes the write lock up front, so two jobs can't both start reading and then deadlock on upgrading
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+		sqlite3_finalize(ins);
+		throw std::runtime_error(concat("sqlite3 error while beginning transaction: ", sqlite3_errmsg(db)));
+	}
+	for (auto& b : saved) {
+		sqlite3_reset(ins);
+		if (sqlite3_bind_blob(ins, 1, b.first.data(), SI(b.first.size()), SQLITE_STATIC) != SQLITE_OK || sqlite3_bind_blob(ins, 2, b.second.data(), SI(b.second.size()), SQLITE_STATIC) != SQLITE_OK || sqlite3_step(ins) != SQLITE_DONE) {
+			std::string err{ sqlite3_errmsg(db) };
+			sqlite3_finalize(ins);
+			sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+			throw std::runtime_error(concat("sqlite3 error inserting into blocks table: ", err));
+		}
+	}
+	sqlite3_finalize(ins);
+	if (sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+		std::string err{ sqlite3_errmsg(db) };
+		sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+		throw std::runtime_error(concat("sqlite3 error while committing transaction: ", err));
+	}
+	saved.clear();
+}
+
+}
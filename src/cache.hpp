@@ -0,0 +1,68 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_CACHE_HPP_
+#define e5bd51be_CACHE_HPP_
+
+#include "string_view.hpp"
+#include "filesystem.hpp"
+#include "stream.hpp"
+#include <string>
+#include <unordered_map>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace Transfuse {
+
+// Persistent cache shared by all documents, addressed by content hashes, so that resubmitted documents and unchanged blocks need no new work
+// docs/<version>/<key>/ holds the state files of a finished extraction, keyed by doc_key()
+// blocks.sqlite3 holds the last translation injected for each block, keyed by its source text
+// A translation is only as good as the pipeline that made it, so use one cache folder per language pair
+struct Cache {
+	fs::path dir;
+
+	explicit Cache(fs::path dir);
+	~Cache();
+	Cache(const Cache&) = delete;
+	Cache& operator=(const Cache&) = delete;
+
+	// XXH64 of the original document, plus the format and stream that the extraction was made for
+	static std::string doc_key(std::string_view original, std::string_view format, Stream stream);
+
+	// Copies a cached extraction into the state folder, with the stream header pointing at that folder instead
+	bool load_doc(std::string_view key, const fs::path& tmpdir, Stream stream);
+	void save_doc(std::string_view key, const fs::path& tmpdir, Stream stream);
+
+	// Source and translation are both in the XML-escaped form they have in content.xml
+	// Saved blocks are held in memory until commit() writes them all in one transaction, so that concurrent jobs only hold the database's lock briefly
+	bool load_block(std::string_view source, std::string& body);
+	void save_block(std::string_view source, std::string_view body);
+	void commit();
+
+private:
+	void open_blocks();
+
+	sqlite3* db = nullptr;
+	sqlite3_stmt* sel = nullptr;
+	std::unordered_map<std::string, std::string> saved;
+};
+
+}
+
+#endif
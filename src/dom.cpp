@@ -18,9 +18,11 @@
 #include "dom.hpp"
 #include "shared.hpp"
 #include "base64.hpp"
-#include <unicode/utext.h>
-#include <unicode/regex.h>
+#include <unicode/uchar.h>
+#include <unicode/utf8.h>
 #include <xxhash.h>
+#include <algorithm>
+#include <vector>
 #include <memory>
 #include <stdexcept>
 using namespace icu;
@@ -67,29 +69,14 @@ void append_attrs(xmlString& s, xmlNodePtr n, bool with_tf = false) {
 	}
 }
 
-DOM::DOM(State& state, xmlDocPtr xml)
+DOM::DOM(State& state, xmlDocPtr xml, Stream stream_type)
   : state(state)
   , xml(xml, &xmlFreeDoc)
-  , rx_space_only(UnicodeString::fromUTF8(R"X(^([\s\p{Zs}]+)$)X"), 0, status)
-  , rx_blank_only(UnicodeString::fromUTF8(R"X(^([\s\r\n\p{Z}]+)$)X"), 0, status)
-  , rx_blank_head(UnicodeString::fromUTF8(R"X(^([\s\r\n\p{Z}]+))X"), 0, status)
-  , rx_blank_tail(UnicodeString::fromUTF8(R"X(([\s\r\n\p{Z}]+)$)X"), 0, status)
-  , rx_any_alnum(UnicodeString::fromUTF8(R"X([\w\p{L}\p{N}\p{M}])X"), 0, status)
 {
-	if (state.stream() == Streams::apertium) {
-		stream.reset(new ApertiumStream);
-	}
-	else {
-		stream.reset(new VISLStream);
-	}
-
-	if (U_FAILURE(status)) {
-		throw std::runtime_error(concat("Something ICU went wrong in DOM::DOM(): ", u_errorName(status)));
+	if (stream_type == Streams::detect) {
+		stream_type = state.stream();
 	}
-}
-
-DOM::~DOM() {
-	utext_close(&tmp_ut);
+	stream = make_stream(stream_type);
 }
 
 // Stores whether a node had space around and/or inside it
@@ -111,10 +98,10 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 			save_spaces(child, rn + 1);
 		}
 		else if (child->content && child->parent) {
-			utext_openUTF8(tmp_ut, child->content);
+			auto content = x2s(child->content);
+			auto head = prefix_len(content, is_space_cp);
 
-			rx_blank_only.reset(&tmp_ut);
-			if (rx_blank_only.matches(status)) {
+			if (!content.empty() && head == content.size()) {
 				if (!child->prev) {
 					xmlSetProp(child->parent, XC("tf-space-prefix"), child->content);
 				}
@@ -130,14 +117,10 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 				// If the node was entirely whitespace, skip looking for leading/trailing
 				continue;
 			}
-			if (U_FAILURE(status)) {
-				throw std::runtime_error(concat("Could not match rx_blank_only: ", u_errorName(status)));
-			}
 
 			// If this node has leading whitespace, record that either in the previous sibling or parent
-			rx_blank_head.reset(&tmp_ut);
-			if (rx_blank_head.find(status)) {
-				tmp_lxs[0].assign(child->content + rx_blank_head.start(1, status), child->content + rx_blank_head.end(1, status));
+			if (head) {
+				tmp_lxs[0].assign(child->content, child->content + head);
 				if (child->prev) {
 					if (child->prev->type == XML_ELEMENT_NODE || child->prev->properties) {
 						xmlSetProp(child->prev, XC("tf-space-after"), tmp_lxs[0].c_str());
@@ -147,14 +130,11 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 					xmlSetProp(child->parent, XC("tf-space-prefix"), tmp_lxs[0].c_str());
 				}
 			}
-			if (U_FAILURE(status)) {
-				throw std::runtime_error(concat("Could not match rx_blank_head: ", u_errorName(status)));
-			}
 
 			// If this node has trailing whitespace, record that either in the next sibling or parent
-			rx_blank_tail.reset(&tmp_ut);
-			if (rx_blank_tail.find(status)) {
-				tmp_lxs[0].assign(child->content + rx_blank_tail.start(1, status), child->content + rx_blank_tail.end(1, status));
+			auto tail = suffix_start(content, is_space_cp);
+			if (tail < content.size()) {
+				tmp_lxs[0].assign(child->content + tail, child->content + content.size());
 				if (child->next) {
 					if (child->next->type == XML_ELEMENT_NODE || child->next->properties) {
 						xmlSetProp(child->next, XC("tf-space-before"), tmp_lxs[0].c_str());
@@ -164,23 +144,12 @@ void DOM::save_spaces(xmlNodePtr dom, size_t rn) {
 					xmlSetProp(child->parent, XC("tf-space-suffix"), tmp_lxs[0].c_str());
 				}
 			}
-			if (U_FAILURE(status)) {
-				throw std::runtime_error(concat("Could not match rx_blank_tail: ", u_errorName(status)));
-			}
 		}
 	}
 }
 
 void DOM::append_ltrim(xmlString& s, xmlChar_view xc) {
-	utext_openUTF8(tmp_ut, xc);
-	rx_blank_head.reset(&tmp_ut);
-	if (rx_blank_head.find()) {
-		auto e = rx_blank_head.end(0, status);
-		s.append(xc.begin() + PD(e), xc.end());
-	}
-	else {
-		s += xc;
-	}
+	s.append(xc.begin() + PD(prefix_len(x2s(xc), is_space_cp)), xc.end());
 }
 
 void DOM::assign_ltrim(xmlString& s, xmlChar_view xc) {
@@ -190,15 +159,7 @@ void DOM::assign_ltrim(xmlString& s, xmlChar_view xc) {
 
 void DOM::assign_rtrim(xmlString& s, xmlChar_view xc) {
 	s.clear();
-	utext_openUTF8(tmp_ut, xc);
-	rx_blank_tail.reset(&tmp_ut);
-	if (rx_blank_tail.find()) {
-		auto b = rx_blank_tail.start(0, status);
-		s.append(xc.begin(), xc.begin() + PD(b));
-	}
-	else {
-		s += xc;
-	}
+	s.append(xc.begin(), xc.begin() + PD(suffix_start(x2s(xc), is_space_cp)));
 }
 
 // restore_spaces() can only modify existing nodes, so this function will create new nodes for any remaining saved whitespace
@@ -211,7 +172,8 @@ void DOM::create_spaces(xmlNodePtr dom, size_t rn) {
 	tmp_xs = &tmp_xss[rn];
 	auto& tmp_lxs = tmp_xss[rn];
 
-	bool apertium = (state.stream() == Streams::apertium);
+	// Only VISL loses whitespace, as the other streams carry the text as-is
+	bool verbatim = (state.stream() != Streams::visl);
 
 	for (auto child = dom->children; child != nullptr; child = child->next) {
 		assign_name_ns(tmp_lxs[0], child);
@@ -223,14 +185,14 @@ void DOM::create_spaces(xmlNodePtr dom, size_t rn) {
 
 			xmlAttrPtr attr;
 			if ((attr = xmlHasProp(child, XC("tf-space-after"))) != nullptr) {
-				if (!apertium) {
+				if (!verbatim) {
 					auto text = xmlNewText(attr->children->content);
 					xmlAddNextSibling(child, text);
 				}
 				xmlRemoveProp(attr);
 			}
 			if ((attr = xmlHasProp(child, XC("tf-space-prefix"))) != nullptr) {
-				if (!apertium) {
+				if (!verbatim) {
 					auto text = xmlNewText(attr->children->content);
 					if (child->children) {
 						xmlAddPrevSibling(child->children, text);
@@ -242,14 +204,14 @@ void DOM::create_spaces(xmlNodePtr dom, size_t rn) {
 				xmlRemoveProp(attr);
 			}
 			if ((attr = xmlHasProp(child, XC("tf-space-before"))) != nullptr) {
-				if (!apertium) {
+				if (!verbatim) {
 					auto text = xmlNewText(attr->children->content);
 					xmlAddPrevSibling(child, text);
 				}
 				xmlRemoveProp(attr);
 			}
 			if ((attr = xmlHasProp(child, XC("tf-space-suffix"))) != nullptr) {
-				if (!apertium) {
+				if (!verbatim) {
 					auto text = xmlNewText(attr->children->content);
 					xmlAddChild(child, text);
 				}
@@ -269,7 +231,8 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 	tmp_xs = &tmp_xss[rn];
 	auto& tmp_lxs = tmp_xss[rn];
 
-	bool apertium = (state.stream() == Streams::apertium);
+	// Only VISL loses whitespace, as the other streams carry the text as-is
+	bool verbatim = (state.stream() != Streams::visl);
 
 	for (auto child = dom->children; child != nullptr; child = child->next) {
 		assign_name_ns(tmp_lxs[0], child);
@@ -282,7 +245,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 		else if (child->content && child->parent) {
 			xmlAttrPtr attr;
 			if (child->prev && (attr = xmlHasProp(child->prev, XC("tf-space-after"))) != nullptr) {
-				if (!apertium) {
+				if (!verbatim) {
 					tmp_lxs[1] = attr->children->content;
 					append_ltrim(tmp_lxs[1], child->content);
 					xmlNodeSetContent(child, tmp_lxs[1].c_str());
@@ -290,7 +253,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 				xmlRemoveProp(attr);
 			}
 			if ((attr = xmlHasProp(child->parent, XC("tf-space-prefix"))) != nullptr) {
-				if (child == child->parent->children && !apertium) {
+				if (child == child->parent->children && !verbatim) {
 					tmp_lxs[1] = attr->children->content;
 					append_ltrim(tmp_lxs[1], child->content);
 					xmlNodeSetContent(child, tmp_lxs[1].c_str());
@@ -298,7 +261,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 				xmlRemoveProp(attr);
 			}
 			if (child->next && (attr = xmlHasProp(child->next, XC("tf-space-before"))) != nullptr) {
-				if (!apertium) {
+				if (!verbatim) {
 					assign_rtrim(tmp_lxs[1], child->content);
 					tmp_lxs[1] += attr->children->content;
 					xmlNodeSetContent(child, tmp_lxs[1].c_str());
@@ -306,7 +269,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 				xmlRemoveProp(attr);
 			}
 			if ((attr = xmlHasProp(child->parent, XC("tf-space-suffix"))) != nullptr) {
-				if (child == child->parent->last && !apertium) {
+				if (child == child->parent->last && !verbatim) {
 					assign_rtrim(tmp_lxs[1], child->content);
 					tmp_lxs[1] += attr->children->content;
 					xmlNodeSetContent(child, tmp_lxs[1].c_str());
@@ -332,14 +295,7 @@ void DOM::restore_spaces(xmlNodePtr dom, size_t rn) {
 }
 
 bool DOM::is_space(xmlChar_view xc) {
-	bool rv = true;
-	utext_openUTF8(tmp_ut, xc);
-	rx_space_only.reset(&tmp_ut);
-	rv = rx_space_only.matches(status);
-	if (U_FAILURE(status)) {
-		throw std::runtime_error(concat("Could not match rx_space_only: ", u_errorName(status)));
-	}
-	return rv;
+	return !xc.empty() && prefix_len(x2s(xc), is_space_cp) == xc.size();
 }
 
 bool DOM::is_only_child(xmlNodePtr cn) {
@@ -512,9 +468,7 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt) {
 			for (auto a : tag_attrs) {
 				if (auto attr = xmlHasProp(child, a.data())) {
 					tmp_lxs[1] = attr->children->content;
-					utext_openUTF8(tmp_ut, tmp_lxs[1]);
-					rx_any_alnum.reset(&tmp_ut);
-					if (!rx_any_alnum.find()) {
+					if (!any_cp(x2s(tmp_lxs[1]), is_word_cp)) {
 						// If the value contains no alphanumeric data, skip it
 						continue;
 					}
@@ -526,9 +480,15 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt) {
 					tmp_lxs[2] += '-';
 					tmp_lxs[2] += tmp_s;
 
-					stream->block_open(s, tmp_lxs[2]);
-					stream->block_body(s, tmp_lxs[1]);
-					stream->block_close(s, tmp_lxs[2]);
+					if (!is_known(tmp_lxs[1])) {
+						stream->block_open(s, tmp_lxs[2]);
+						stream->block_body(s, tmp_lxs[1]);
+						stream->block_close(s, tmp_lxs[2]);
+					}
+					else {
+						blocks_skipped += x2s(tmp_lxs[2]);
+						blocks_skipped += ' ';
+					}
 
 					tmp_lxs[3] = XC(TFB_OPEN_B);
 					tmp_lxs[3] += tmp_lxs[2];
@@ -564,9 +524,7 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt) {
 			}
 
 			tmp_lxs[1] = child->content;
-			utext_openUTF8(tmp_ut, tmp_lxs[1]);
-			rx_any_alnum.reset(&tmp_ut);
-			if (!rx_any_alnum.find()) {
+			if (!any_cp(x2s(tmp_lxs[1]), is_word_cp)) {
 				continue;
 			}
 
@@ -577,9 +535,15 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt) {
 			tmp_lxs[2] += '-';
 			tmp_lxs[2] += tmp_s;
 
-			stream->block_open(s, tmp_lxs[2]);
-			stream->block_body(s, tmp_lxs[1]);
-			stream->block_close(s, tmp_lxs[2]);
+			if (!is_known(tmp_lxs[1])) {
+				stream->block_open(s, tmp_lxs[2]);
+				stream->block_body(s, tmp_lxs[1]);
+				stream->block_close(s, tmp_lxs[2]);
+			}
+			else {
+				blocks_skipped += x2s(tmp_lxs[2]);
+				blocks_skipped += ' ';
+			}
 
 			tmp_lxs[3] = XC(TFB_OPEN_B);
 			tmp_lxs[3] += tmp_lxs[2];
@@ -593,181 +557,311 @@ void DOM::extract_blocks(xmlString& s, xmlNodePtr dom, size_t rn, bool txt) {
 	}
 }
 
-// Adjust and merge inline information where applicable
-void cleanup_styles(std::string& str) {
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-	std::string tmp;
-	tmp.reserve(str.size());
-
-	RegexMatcher rx_merge(R"X((\ue011[^\ue012]+\ue012)([^\ue011-\ue013]+)\ue013([\s\p{Zs}]*)(\1))X", 0, status);
-	RegexMatcher rx_nested(R"X(\ue011([^\ue012]+)\ue012\ue011([^\ue012]+)\ue012([^\ue011-\ue013]+)\ue013\ue013)X", 0, status);
-	RegexMatcher rx_alpha_prefix(R"X(([\p{L}\p{N}\p{M}]*?[\p{L}\p{M}])(\ue011[^\ue012]+\ue012)(\p{L}+))X", 0, status);
-	RegexMatcher rx_alpha_suffix(R"X((\p{L}[\p{L}\p{M}]*)(\ue013)(\p{L}[\p{L}\p{N}\p{M}]*))X", 0, status);
-	RegexMatcher rx_spc_prefix(R"X((\ue011[^\ue012]+\ue012)([\s\p{Zs}]+))X", 0, status);
-	RegexMatcher rx_spc_suffix(R"X(([\s\p{Zs}]+)(\ue013))X", 0, status);
+enum StyleTokenType : uint8_t {
+	TT_TEXT,
+	TT_OPEN,
+	TT_CLOSE,
+	TT_STRAY,
+};
 
-	bool did = true;
-	while (did) {
-		int32_t l = 0;
-		did = false;
+struct StyleToken {
+	StyleTokenType type;
+	std::string str; // Text for TT_TEXT, the style list between TFI_OPEN_B and TFI_OPEN_E for TT_OPEN, the marker itself for TT_STRAY
+};
+using StyleTokens = std::vector<StyleToken>;
+
+// Appends tokens while keeping text tokens maximal and non-empty, so that a text token is always a whole run of bytes between markers
+struct StyleTokenWriter {
+	StyleTokens& out;
+
+	void text(std::string_view s) {
+		if (s.empty()) {
+			return;
+		}
+		if (!out.empty() && out.back().type == TT_TEXT) {
+			out.back().str += s;
+		}
+		else {
+			out.push_back({ TT_TEXT, std::string(s.begin(), s.end()) });
+		}
+	}
 
-		// Merge identical inline tags if they have nothing or only space between them (first time)
-		auto merge_spans = [&]() {
-			tmp.resize(0);
-			utext_openUTF8(tmp_ut, str);
-			rx_merge.reset(&tmp_ut);
-			l = 0;
-			while (rx_merge.find()) {
-				auto tb = rx_merge.start(1, status);
-				auto be = rx_merge.end(2, status);
-				auto sb = rx_merge.start(3, status);
-				auto se = rx_merge.end(3, status);
-				auto de = rx_merge.end(4, status);
-				tmp.append(str.begin() + l, str.begin() + tb);
-				tmp.append(str.begin() + tb, str.begin() + be);
-				tmp.append(str.begin() + sb, str.begin() + se);
-				l = de;
+	void token(StyleToken& t) {
+		if (t.type == TT_TEXT) {
+			text(t.str);
+		}
+		else {
+			out.push_back(std::move(t));
+		}
+	}
+};
+
+inline bool is_marker(std::string_view str, size_t i, char which) {
+	return (i + 2 < str.size() && str[i] == TFI_OPEN_B[0] && str[i + 1] == TFI_OPEN_B[1] && str[i + 2] == which);
+}
+
+// Splits the string into text and inline markers
+// A TFI_OPEN_B that isn't followed by a non-empty style list and TFI_OPEN_E, or a stray TFI_OPEN_E, becomes a TT_STRAY token that no step matches, so it is kept as-is and nothing is merged or moved across it
+static void tokenize_styles(std::string_view str, StyleTokens& toks) {
+	toks.clear();
+	StyleTokenWriter w{ toks };
+	size_t l = 0;
+	for (auto b = str.find(TFI_OPEN_B, 0, 2); b != std::string_view::npos; b = str.find(TFI_OPEN_B, b, 2)) {
+		if (is_marker(str, b, TFI_OPEN_B[2])) {
+			w.text(str.substr(l, b - l));
+			auto e = b + 3;
+			for (; e < str.size() && !is_marker(str, e, TFI_OPEN_B[2]) && !is_marker(str, e, TFI_OPEN_E[2]) && !is_marker(str, e, TFI_CLOSE[2]); ++e) {
+			}
+			if (e == b + 3 || !is_marker(str, e, TFI_OPEN_E[2])) {
+				toks.push_back({ TT_STRAY, std::string(str.substr(b, 3)) });
+				l = b = b + 3;
+				continue;
+			}
+			toks.push_back({ TT_OPEN, std::string(str.begin() + PD(b) + 3, str.begin() + PD(e)) });
+			l = b = e + 3;
+		}
+		else if (is_marker(str, b, TFI_CLOSE[2])) {
+			w.text(str.substr(l, b - l));
+			toks.push_back({ TT_CLOSE, {} });
+			l = b = b + 3;
+		}
+		else if (is_marker(str, b, TFI_OPEN_E[2])) {
+			w.text(str.substr(l, b - l));
+			toks.push_back({ TT_STRAY, std::string(str.substr(b, 3)) });
+			l = b = b + 3;
+		}
+		else {
+			++b;
+		}
+	}
+	w.text(str.substr(l));
+}
+
+// Merge identical inline tags if they have nothing or only space between them
+static bool styles_merge(StyleTokens& in, StyleTokens& out) {
+	bool did = false;
+	StyleTokenWriter w{ out };
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i].type == TT_OPEN && i + 2 < in.size() && in[i + 1].type == TT_TEXT && in[i + 2].type == TT_CLOSE) {
+			auto j = i + 3;
+			if (j < in.size() && in[j].type == TT_TEXT && prefix_len(in[j].str, is_space_cp) == in[j].str.size()) {
+				++j;
+			}
+			if (j < in.size() && in[j].type == TT_OPEN && in[j].str == in[i].str) {
+				w.token(in[i]);
+				w.text(in[i + 1].str);
+				if (j != i + 3) {
+					w.text(in[i + 3].str);
+				}
+				i = j;
 				did = true;
+				continue;
 			}
-			if (did) {
-				tmp.append(str.begin() + l, str.end());
-				str.swap(tmp);
-			}
-		};
-		merge_spans();
-
-		// Merge perfectly nested inline tags
-		tmp.resize(0);
-		utext_openUTF8(tmp_ut, str);
-		rx_nested.reset(&tmp_ut);
-		l = 0;
-		while (rx_nested.find()) {
-			auto mb = rx_nested.start(status);
-			auto me = rx_nested.end(status);
-			auto fb = rx_nested.start(1, status);
-			auto fe = rx_nested.end(1, status);
-			auto sb = rx_nested.start(2, status);
-			auto se = rx_nested.end(2, status);
-			auto bp = rx_nested.start(3, status);
-			auto be = rx_nested.end(3, status);
-			tmp.append(str.begin() + l, str.begin() + mb);
-
-			auto ft = std::string_view(&str[SZ(fb)], SZ(fe - fb));
-			auto st = std::string_view(&str[SZ(sb)], SZ(se - sb));
+		}
+		w.token(in[i]);
+	}
+	return did;
+}
+
+// Merge perfectly nested inline tags
+static bool styles_nested(StyleTokens& in, StyleTokens& out) {
+	bool did = false;
+	StyleTokenWriter w{ out };
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (i + 4 < in.size() && in[i].type == TT_OPEN && in[i + 1].type == TT_OPEN && in[i + 2].type == TT_TEXT && in[i + 3].type == TT_CLOSE && in[i + 4].type == TT_CLOSE) {
+			auto ft = std::string_view(in[i].str);
+			auto st = std::string_view(in[i + 1].str);
 			trim_wb(ft);
 			trim_wb(st);
 
-			tmp += TFI_OPEN_B;
-			tmp.append(ft.begin(), ft.end());
-			tmp += ';';
-			tmp.append(st.begin(), st.end());
-			tmp += TFI_OPEN_E;
-			tmp.append(str.begin() + bp, str.begin() + be);
-			tmp += TFI_CLOSE;
-			l = me;
+			StyleToken t{ TT_OPEN, std::string(ft.begin(), ft.end()) };
+			t.str += ';';
+			t.str.append(st.begin(), st.end());
+			w.token(t);
+			w.text(in[i + 2].str);
+			w.token(in[i + 3]);
+			i += 4;
 			did = true;
+			continue;
 		}
-		if (did) {
-			tmp.append(str.begin() + l, str.end());
-			str.swap(tmp);
-		}
-
-		// If the inline tag starts with a letter and has only alphanumerics before it (ending with alpha), move that prefix inside
-		tmp.resize(0);
-		utext_openUTF8(tmp_ut, str);
-		rx_alpha_prefix.reset(&tmp_ut);
-		l = 0;
-		while (rx_alpha_prefix.find()) {
-			auto pb = rx_alpha_prefix.start(1, status);
-			auto pe = rx_alpha_prefix.end(1, status);
-			auto tb = rx_alpha_prefix.start(2, status);
-			auto te = rx_alpha_prefix.end(2, status);
-			auto sb = rx_alpha_prefix.start(3, status);
-			auto se = rx_alpha_prefix.end(3, status);
-			tmp.append(str.begin() + l, str.begin() + pb);
-			tmp.append(str.begin() + tb, str.begin() + te);
-			tmp.append(str.begin() + pb, str.begin() + pe);
-			tmp.append(str.begin() + sb, str.begin() + se);
-			l = se;
-			did = true;
+		w.token(in[i]);
+	}
+	return did;
+}
+
+// If the inline tag starts with a letter and has only alphanumerics before it (ending with alpha), move that prefix inside
+static bool styles_alpha_prefix(StyleTokens& in, StyleTokens& out) {
+	bool did = false;
+	StyleTokenWriter w{ out };
+	size_t r = 0; // Offset into the current text token where a previous match ended
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i].type != TT_TEXT) {
+			w.token(in[i]);
+			continue;
 		}
-		if (did) {
-			tmp.append(str.begin() + l, str.end());
-			str.swap(tmp);
-		}
-
-		// If the inline tag ends with a letter and has only alphanumerics after it (starting with alpha), move that suffix inside
-		tmp.resize(0);
-		utext_openUTF8(tmp_ut, str);
-		rx_alpha_suffix.reset(&tmp_ut);
-		l = 0;
-		while (rx_alpha_suffix.find()) {
-			auto pb = rx_alpha_suffix.start(1, status);
-			auto pe = rx_alpha_suffix.end(1, status);
-			auto tb = rx_alpha_suffix.start(2, status);
-			auto te = rx_alpha_suffix.end(2, status);
-			auto sb = rx_alpha_suffix.start(3, status);
-			auto se = rx_alpha_suffix.end(3, status);
-			tmp.append(str.begin() + l, str.begin() + pb);
-			tmp.append(str.begin() + pb, str.begin() + pe);
-			tmp.append(str.begin() + sb, str.begin() + se);
-			tmp.append(str.begin() + tb, str.begin() + te);
-			l = se;
-			did = true;
+		auto pend = std::string_view(in[i].str).substr(r);
+		r = 0;
+		if (i + 2 < in.size() && in[i + 1].type == TT_OPEN && in[i + 2].type == TT_TEXT) {
+			auto pb = suffix_start(pend, is_lnm_cp);
+			auto sl = prefix_len(in[i + 2].str, is_l_cp);
+			if (pb < pend.size() && sl) {
+				auto raw = reinterpret_cast<const uint8_t*>(pend.data());
+				int32_t lc = SI32(pend.size());
+				UChar32 c = 0;
+				U8_PREV(raw, 0, lc, c);
+				if (is_lm_cp(c)) {
+					w.text(pend.substr(0, pb));
+					w.token(in[i + 1]);
+					w.text(pend.substr(pb));
+					w.text(std::string_view(in[i + 2].str).substr(0, sl));
+					r = sl;
+					++i;
+					did = true;
+					continue;
+				}
+			}
 		}
-		if (did) {
-			tmp.append(str.begin() + l, str.end());
-			str.swap(tmp);
-		}
-
-		// Move leading space from inside the tag to before it
-		tmp.resize(0);
-		utext_openUTF8(tmp_ut, str);
-		rx_spc_prefix.reset(&tmp_ut);
-		l = 0;
-		while (rx_spc_prefix.find()) {
-			auto tb = rx_spc_prefix.start(1, status);
-			auto te = rx_spc_prefix.end(1, status);
-			auto sb = rx_spc_prefix.start(2, status);
-			auto se = rx_spc_prefix.end(2, status);
-			tmp.append(str.begin() + l, str.begin() + tb);
-			tmp.append(str.begin() + sb, str.begin() + se);
-			tmp.append(str.begin() + tb, str.begin() + te);
-			l = se;
-			did = true;
+		w.text(pend);
+	}
+	return did;
+}
+
+// If the inline tag ends with a letter and has only alphanumerics after it (starting with alpha), move that suffix inside
+static bool styles_alpha_suffix(StyleTokens& in, StyleTokens& out) {
+	bool did = false;
+	StyleTokenWriter w{ out };
+	size_t r = 0;
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i].type != TT_TEXT) {
+			w.token(in[i]);
+			continue;
 		}
-		if (did) {
-			tmp.append(str.begin() + l, str.end());
-			str.swap(tmp);
-		}
-
-		// Move trailing space from inside the tag to after it
-		tmp.resize(0);
-		utext_openUTF8(tmp_ut, str);
-		rx_spc_suffix.reset(&tmp_ut);
-		l = 0;
-		while (rx_spc_suffix.find()) {
-			auto tb = rx_spc_suffix.start(1, status);
-			auto te = rx_spc_suffix.end(1, status);
-			auto sb = rx_spc_suffix.start(2, status);
-			auto se = rx_spc_suffix.end(2, status);
-			tmp.append(str.begin() + l, str.begin() + tb);
-			tmp.append(str.begin() + sb, str.begin() + se);
-			tmp.append(str.begin() + tb, str.begin() + te);
-			l = se;
-			did = true;
+		auto pend = std::string_view(in[i].str).substr(r);
+		r = 0;
+		if (i + 2 < in.size() && in[i + 1].type == TT_CLOSE && in[i + 2].type == TT_TEXT) {
+			// The run of [\p{L}\p{M}] before the tag end must contain a letter
+			auto run = pend.substr(suffix_start(pend, is_lm_cp));
+			bool has_l = (prefix_len(run, [](UChar32 c) { return !is_l_cp(c); }) < run.size());
+
+			auto next = std::string_view(in[i + 2].str);
+			size_t sl = 0;
+			int32_t ni = 0;
+			if (!next.empty() && is_l_cp(next_cp(next, ni))) {
+				sl = SZ(ni) + prefix_len(next.substr(SZ(ni)), is_lnm_cp);
+			}
+
+			if (has_l && sl) {
+				w.text(pend);
+				w.text(next.substr(0, sl));
+				w.token(in[i + 1]);
+				r = sl;
+				++i;
+				did = true;
+				continue;
+			}
 		}
-		if (did) {
-			tmp.append(str.begin() + l, str.end());
-			str.swap(tmp);
+		w.text(pend);
+	}
+	return did;
+}
+
+// Move leading space from inside the tag to before it
+static bool styles_space_prefix(StyleTokens& in, StyleTokens& out) {
+	bool did = false;
+	StyleTokenWriter w{ out };
+	size_t r = 0;
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i].type == TT_TEXT) {
+			w.text(std::string_view(in[i].str).substr(r));
+			r = 0;
+			continue;
 		}
+		if (in[i].type == TT_OPEN && i + 1 < in.size() && in[i + 1].type == TT_TEXT) {
+			auto sl = prefix_len(in[i + 1].str, is_space_cp);
+			if (sl) {
+				w.text(std::string_view(in[i + 1].str).substr(0, sl));
+				w.token(in[i]);
+				r = sl;
+				did = true;
+				continue;
+			}
+		}
+		w.token(in[i]);
+	}
+	return did;
+}
+
+// Move trailing space from inside the tag to after it
+static bool styles_space_suffix(StyleTokens& in, StyleTokens& out) {
+	bool did = false;
+	StyleTokenWriter w{ out };
+	for (size_t i = 0; i < in.size(); ++i) {
+		if (in[i].type == TT_TEXT && i + 1 < in.size() && in[i + 1].type == TT_CLOSE) {
+			auto sb = suffix_start(in[i].str, is_space_cp);
+			if (sb < in[i].str.size()) {
+				w.text(std::string_view(in[i].str).substr(0, sb));
+				w.token(in[i + 1]);
+				w.text(std::string_view(in[i].str).substr(sb));
+				++i;
+				did = true;
+				continue;
+			}
+		}
+		w.token(in[i]);
+	}
+	return did;
+}
+
+// Adjust and merge inline information where applicable
+// Works on a token list of text and inline markers, applying each step in turn until nothing changes
+void cleanup_styles(std::string& str) {
+	Profile::count(Profile::cleanup_calls);
+	StyleTokens toks;
+	tokenize_styles(str, toks);
+	if (std::none_of(toks.begin(), toks.end(), [](const StyleToken& t) { return t.type == TT_OPEN || t.type == TT_CLOSE; })) {
+		return;
+	}
 
-		// Merge identical inline tags if they have nothing or only space between them (second time)
-		merge_spans();
+	StyleTokens tmp;
+	auto pass = [&](bool (*fn)(StyleTokens&, StyleTokens&)) {
+		tmp.clear();
+		bool rv = fn(toks, tmp);
+		toks.swap(tmp);
+		return rv;
+	};
+
+	bool did = true;
+	while (did) {
+		Profile::count(Profile::cleanup_rounds);
+		did = false;
+		did |= pass(styles_merge);
+		did |= pass(styles_nested);
+		did |= pass(styles_alpha_prefix);
+		did |= pass(styles_alpha_suffix);
+		did |= pass(styles_space_prefix);
+		did |= pass(styles_space_suffix);
+		did |= pass(styles_merge);
 	}
 
-	utext_close(&tmp_ut);
+	size_t sz = 0;
+	for (auto& t : toks) {
+		sz += t.str.size() + 6;
+	}
+	str.clear();
+	str.reserve(sz);
+	for (auto& t : toks) {
+		if (t.type == TT_TEXT || t.type == TT_STRAY) {
+			str += t.str;
+		}
+		else if (t.type == TT_OPEN) {
+			str += TFI_OPEN_B;
+			str += t.str;
+			str += TFI_OPEN_E;
+		}
+		else {
+			str += TFI_CLOSE;
+		}
+	}
 }
 
 }
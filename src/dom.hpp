@@ -23,11 +23,14 @@
 #include "string_view.hpp"
 #include "xml.hpp"
 #include "stream.hpp"
+#include "simd.hpp"
+#include "profile.hpp"
 #include <unicode/utext.h>
 #include <unicode/regex.h>
 #include <libxml/tree.h>
 #include <array>
 #include <deque>
+#include <unordered_set>
 
 namespace Transfuse {
 
@@ -37,34 +40,42 @@ inline void cleanup_styles(xmlString& str) {
 }
 
 inline void append_xml(xmlString& str, xmlChar_view xc, bool nls = false) {
-	for (auto c : xc) {
-		if (c == '&') {
-			str += "&amp;";
+	auto b = reinterpret_cast<const char*>(xc.data());
+	auto e = b + xc.size();
+	while (b != e) {
+		// Copy everything up to the next byte that needs an entity
+		auto n = nls ? find_any<'&', '"', '\'', '<', '>', '\t', '\n', '\r'>(b, e) : find_any<'&', '"', '\'', '<', '>'>(b, e);
+		str.append(reinterpret_cast<const xmlChar*>(b), SZ(n - b));
+		if (n == e) {
+			break;
 		}
-		else if (c == '"') {
+		switch (*n) {
+		case '&':
+			str += "&amp;";
+			break;
+		case '"':
 			str += "&quot;";
-		}
-		else if (c == '\'') {
+			break;
+		case '\'':
 			str += "&apos;";
-		}
-		else if (c == '<') {
+			break;
+		case '<':
 			str += "&lt;";
-		}
-		else if (c == '>') {
+			break;
+		case '>':
 			str += "&gt;";
-		}
-		else if (c == '\t' && nls) {
+			break;
+		case '\t':
 			str += "&#9;";
-		}
-		else if (c == '\n' && nls) {
+			break;
+		case '\n':
 			str += "&#10;";
-		}
-		else if (c == '\r' && nls) {
+			break;
+		case '\r':
 			str += "&#13;";
+			break;
 		}
-		else {
-			str += c;
-		}
+		b = n + 1;
 	}
 }
 
@@ -78,53 +89,6 @@ inline void assign_xml(S& str, SV sv, bool nls = false) {
 	append_xml(str, sv, nls);
 }
 
-inline void rx_replaceAll(const char* pattern, const char* repl, icu::UnicodeString& udata, icu::UnicodeString& tmp) {
-	UErrorCode status = U_ZERO_ERROR;
-	icu::RegexMatcher regex(pattern, 0, status);
-	if (U_FAILURE(status)) {
-		throw status;
-	}
-
-	regex.reset(udata);
-	tmp = regex.replaceAll(repl, status);
-	if (U_FAILURE(status)) {
-		throw status;
-	}
-	std::swap(udata, tmp);
-}
-
-inline void rx_replaceAll_expand_21(const char* pattern, icu::UnicodeString& udata, icu::UnicodeString& tmp) {
-	UErrorCode status = U_ZERO_ERROR;
-	icu::RegexMatcher regex(pattern, 0, status);
-	if (U_FAILURE(status)) {
-		throw status;
-	}
-
-	regex.reset(udata);
-	tmp.remove();
-	int32_t last = 0;
-	while (regex.find()) {
-		auto pb = regex.start(1, status);
-		while (pb > 0 && udata.charAt(pb - 1) != '>') {
-			--pb;
-		}
-		tmp.append(udata, last, pb - last);
-
-		auto sb = regex.start(2, status);
-		auto se = regex.end(2, status);
-		tmp.append(udata, sb, se - sb);
-
-		tmp.append(udata, pb, sb - pb);
-
-		last = regex.end(status);
-		if (U_FAILURE(status)) {
-			throw status;
-		}
-	}
-	tmp.append(udata, last, udata.length() - last);
-	std::swap(udata, tmp);
-}
-
 struct DOM {
 	State& state;
 	std::unique_ptr<xmlDoc,decltype(&xmlFreeDoc)> xml;
@@ -136,14 +100,6 @@ struct DOM {
 	size_t blocks = 0;
 	std::unique_ptr<StreamBase> stream;
 
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-	icu::RegexMatcher rx_space_only;
-	icu::RegexMatcher rx_blank_only;
-	icu::RegexMatcher rx_blank_head;
-	icu::RegexMatcher rx_blank_tail;
-	icu::RegexMatcher rx_any_alnum;
-
 	xmlChars tags_prot; // Protected tags
 	xmlChars tags_prot_inline; // Protected inline tags
 	xmlChars tags_raw; // Tags with raw CDATA contents that should not be XML-mangled
@@ -151,12 +107,15 @@ struct DOM {
 	xmlChars tags_parents_allow; // If set, only extract children of these tags
 	xmlChars tags_parents_direct; // Used for TTX <df>?
 	xmlChars tag_attrs; // Attributes that should also be extracted
+	std::unordered_set<std::string> blocks_known; // Text of blocks an earlier injection already has translations for, which are only marked in the document
+	std::string blocks_skipped; // Space-separated IDs of the blocks that were left out of the stream for being in blocks_known
 
-	DOM(State&, xmlDocPtr);
-	~DOM();
+	// Pass the stream type explicitly when constructing from a thread that must not touch the state
+	DOM(State&, xmlDocPtr, Stream stream = Streams::detect);
 
 	void save_spaces(xmlNodePtr, size_t);
 	void save_spaces() {
+		Profile::Timer timer("dom.save_spaces");
 		save_spaces(reinterpret_cast<xmlNodePtr>(xml.get()), 0);
 	}
 
@@ -167,6 +126,7 @@ struct DOM {
 	void create_spaces(xmlNodePtr, size_t);
 	void restore_spaces(xmlNodePtr, size_t);
 	void restore_spaces() {
+		Profile::Timer timer("dom.restore_spaces");
 		restore_spaces(reinterpret_cast<xmlNodePtr>(xml.get()), 0);
 		create_spaces(reinterpret_cast<xmlNodePtr>(xml.get()), 0);
 	}
@@ -177,6 +137,7 @@ struct DOM {
 
 	void save_styles(xmlString&, xmlNodePtr, size_t, bool protect = false);
 	xmlString save_styles(bool prefix = false) {
+		Profile::Timer timer("dom.save_styles");
 		xmlString rv;
 		if (prefix) {
 			rv += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
@@ -189,12 +150,23 @@ struct DOM {
 		return rv;
 	}
 
+	// Whether a block with this text can be left out of the stream, as in blocks_known
+	bool is_known(xmlChar_view text) {
+		if (blocks_known.empty()) {
+			return false;
+		}
+		tmp_s = x2s(text);
+		return blocks_known.count(tmp_s) != 0;
+	}
+
 	void extract_blocks(xmlString&, xmlNodePtr, size_t, bool txt = false);
 	xmlString extract_blocks() {
+		Profile::Timer timer("dom.extract_blocks");
 		xmlString rv;
 		stream->stream_header(rv, state.tmpdir);
 		blocks = 0;
 		extract_blocks(rv, reinterpret_cast<xmlNodePtr>(xml.get()), 0);
+		Profile::count(Profile::blocks_extracted, blocks);
 		return rv;
 	}
 };
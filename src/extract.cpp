@@ -22,17 +22,222 @@
 #include "base64.hpp"
 #include "dom.hpp"
 #include "formats.hpp"
+#include "cache.hpp"
+#include "profile.hpp"
+#include "format-zip.hpp"
 #include <libxml/tree.h>
 #include <libxml/xmlsave.h>
+#include <unicode/utf8.h>
 #include <zip.h>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <random>
 #include <memory>
+#include <unordered_set>
+#include <cerrno>
+#include <cstring>
 
 namespace Transfuse {
 
-fs::path extract(fs::path tmpdir, fs::path infile, std::string_view format, Stream stream, bool wipe) {
+// Whether needle occurs in data, ignoring ASCII case
+// Only ASCII letters can case-fold to the letters of an ASCII tag, so a byte-wise case-insensitive search is exact, and the input need not be lowercased as a whole
+static bool contains_ci(std::string_view data, std::string_view needle) {
+	auto it = std::search(data.begin(), data.end(), needle.begin(), needle.end(), [](char a, char b) {
+		return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b));
+	});
+	return it != data.end();
+}
+
+// Turns the escaped form a block has in content.xml back into its text
+// libxml2 only ever writes the predefined entities and numeric character references, so those are all that need handling
+static void assign_unxml(std::string& str, std::string_view xc) {
+	str.clear();
+	size_t b = 0;
+	for (auto a = xc.find('&'); a != std::string_view::npos; a = xc.find('&', b)) {
+		auto e = xc.find(';', a);
+		if (e == std::string_view::npos) {
+			break;
+		}
+		str.append(xc.begin() + PD(b), xc.begin() + PD(a));
+		b = e + 1;
+
+		auto ent = xc.substr(a + 1, e - a - 1);
+		if (ent == "amp") {
+			str += '&';
+		}
+		else if (ent == "lt") {
+			str += '<';
+		}
+		else if (ent == "gt") {
+			str += '>';
+		}
+		else if (ent == "quot") {
+			str += '"';
+		}
+		else if (ent == "apos") {
+			str += '\'';
+		}
+		else if (ent.size() > 1 && ent[0] == '#') {
+			bool hex = (ent[1] == 'x' || ent[1] == 'X');
+			auto cp = std::strtoul(std::string(ent.substr(hex ? 2 : 1)).c_str(), nullptr, hex ? 16 : 10);
+			char buf[U8_MAX_LENGTH]{};
+			int32_t n = 0;
+			U8_APPEND_UNSAFE(buf, n, static_cast<UChar32>(cp));
+			str.append(buf, SZ(n));
+		}
+		else {
+			str.append(xc.begin() + PD(a), xc.begin() + PD(b));
+		}
+	}
+	str.append(xc.begin() + PD(b), xc.end());
+}
+
+// Collects the source text of every block that an earlier injection into the folder found a translation for
+// Only those can be left out of the new stream, as injection takes their translations from the same file
+static void load_known_blocks(const fs::path& since, std::unordered_set<std::string>& known) {
+	if (!fs::exists(since / "translated")) {
+		throw std::runtime_error(concat("Folder given to --since had no translations, so it must have been injected into with --keep or --dir: ", since.string()));
+	}
+
+	// Pairs of source and translation, each followed by a NUL
+	auto data = file_load(since / "translated");
+	std::string_view view{ data };
+	std::string text;
+	for (size_t b = 0; b < view.size(); ) {
+		auto m = view.find('\0', b);
+		auto e = m == std::string_view::npos ? m : view.find('\0', m + 1);
+		if (e == std::string_view::npos) {
+			break;
+		}
+		assign_unxml(text, view.substr(b, m - b));
+		known.insert(text);
+		b = e + 1;
+	}
+}
+
+// Picks the format from the file extension, or failing that from the contents, unless a format was already given
+static std::string_view detect_format(std::string_view data, std::string_view format, const fs::path& infile) {
+	if (format == "auto") {
+		auto ext = infile.extension().string();
+		if (!ext.empty()) {
+			ext = ext.substr(1);
+		}
+		to_lower(ext);
+
+		if (ext == "docx") {
+			format = "docx";
+		}
+		else if (ext == "pptx") {
+			format = "pptx";
+		}
+		else if (ext == "odt") {
+			format = "odt";
+		}
+		else if (ext == "odp") {
+			format = "odp";
+		}
+		else if (ext == "html" || ext == "htm") {
+			format = "html";
+		}
+		else if (ext == "text" || ext == "txt") {
+			format = "text";
+		}
+		else {
+			bool is_zip = (data.size() >= 4 && data[0] == 'P' && data[1] == 'K' && ((data[2] == '\x03' && data[3] == '\x04') || (data[2] == '\x05' && data[3] == '\x06') || (data[2] == '\x07' && data[3] == '\x08')));
+
+			if (is_zip) {
+				auto zip = zip_open_buffer(data, "zip");
+				if (zip_name_locate(zip, "word/document.xml", 0) >= 0) {
+					format = "docx";
+				}
+				else if (zip_name_locate(zip, "ppt/slides/slide1.xml", 0) >= 0) {
+					format = "pptx";
+				}
+				else if (zip_name_locate(zip, "content.xml", 0) >= 0) {
+					// ODP == ODT
+					format = "odt";
+				}
+				zip_discard(zip);
+			}
+			else if (contains_ci(data, "</html>")) {
+				format = "html";
+			}
+			else {
+				format = "text";
+				for (auto tag : { "</b>", "</a>", "</i>", "</span>", "</p>", "</u>", "</strong>", "</em>", "</s>", "</q>", "</font>" }) {
+					if (contains_ci(data, tag)) {
+						format = "html-fragment";
+						break;
+					}
+				}
+			}
+		}
+	}
+	if (format == "auto") {
+		throw std::runtime_error("Could not auto-detect input file format");
+	}
+	return format;
+}
+
+static std::unique_ptr<DOM> extract_format(State& state, std::string_view format) {
+	Profile::Timer timer("extract.format");
+	if (format == "docx") {
+		return extract_docx(state);
+	}
+	else if (format == "pptx") {
+		return extract_pptx(state);
+	}
+	else if (format == "odt" || format == "odp") {
+		return extract_odt(state);
+	}
+	else if (format == "html") {
+		return extract_html(state);
+	}
+	else if (format == "html-fragment") {
+		return extract_html_fragment(state);
+	}
+	else if (format == "text") {
+		return extract_text(state);
+	}
+	else if (format == "line") {
+		return extract_text(state, true);
+	}
+	else {
+		throw std::runtime_error(concat("Unknown format: ", format));
+	}
+}
+
+// Turns the document into the stream and the content to inject into later, saving both in the folder unless the state is transient
+static Extraction finish_extraction(State& state, std::unique_ptr<DOM> dom) {
+	Extraction rv{ state.tmpdir, dom->extract_blocks(), {}, {} };
+	// Lets injection know not to look for these in the stream
+	if (!dom->blocks_skipped.empty()) {
+		state.info("skipped", dom->blocks_skipped);
+	}
+	Profile::Timer t_save("extract.save");
+	Profile::count(Profile::bytes_written, rv.stream.size());
+
+	auto buf = xmlBufferCreate();
+	auto cntx = xmlSaveToBuffer(buf, "UTF-8", 0);
+	xmlSaveDoc(cntx, dom->xml.get());
+	xmlSaveClose(cntx);
+	rv.content.assign(reinterpret_cast<const char*>(xmlBufferContent(buf)), SZ(xmlBufferLength(buf)));
+	xmlBufferFree(buf);
+	dom.reset();
+
+	// A transient state goes straight to injection, so nothing needs to find the extraction in the folder
+	if (!state.transient) {
+		file_save(state.tmpdir / "extracted", x2s(rv.stream));
+		file_save(state.tmpdir / "content.xml", rv.content);
+	}
+	t_save.stop();
+
+	return rv;
+}
+
+Extraction extract(fs::path tmpdir, fs::path infile, std::string_view format, Stream stream, bool wipe, Backend backend, const fs::path& cache, const fs::path& since) {
 	if (stream == Streams::detect) {
 		stream = Streams::apertium;
 	}
@@ -86,157 +291,136 @@ fs::path extract(fs::path tmpdir, fs::path infile, std::string_view format, Stre
 	if (!fs::exists(tmpdir)) {
 		throw std::runtime_error(concat("State folder did not exist and could not be created: ", tmpdir.string()));
 	}
+	// All state files are addressed via the folder, rather than changing the process-wide current folder, so that several documents can be processed at once
+	tmpdir = fs::canonical(tmpdir);
 
 	std::unique_ptr<State> state;
 	std::unique_ptr<DOM> dom;
+	std::string key;
 
 	// If the folder already contains an extraction, assume the user just wants to output the existing extraction again, potentially in another stream format
 	if (!fs::exists(tmpdir / "extracted")) {
-		// If input is coming from stdin, put it into a file that we can manipulate
-		if (infile == "-") {
-			std::ofstream tmpfile(tmpdir / "original", std::ios::binary);
-			tmpfile.exceptions(std::ios::badbit | std::ios::failbit);
-			tmpfile << std::cin.rdbuf();
-			tmpfile.close();
+		Profile::Timer t_input("extract.input");
+		// The input is mapped once, and format detection, the cache key, and the format readers all work from that mapping
+		// A transient state dies with this process, so the input is mapped where it is, while other states need a copy in the folder for later injection
+		std::shared_ptr<MappedFile> original;
+		if (backend == Backends::transient && infile != "-" && fs::is_regular_file(infile)) {
+			original = std::make_shared<MappedFile>(infile);
+		}
+		else if (backend == Backends::transient) {
+			std::ifstream file;
+			std::istream* in = &std::cin;
+			if (infile != "-") {
+				file.open(infile, std::ios::binary);
+				if (!file) {
+					throw std::runtime_error(concat("Could not read ", infile.string(), ": ", std::strerror(errno)));
+				}
+				file.exceptions(std::ios::badbit | std::ios::failbit);
+				in = &file;
+			}
+			original = std::make_shared<MappedFile>(std::string{ std::istreambuf_iterator<char>(*in), std::istreambuf_iterator<char>() });
 		}
 		else {
-			try {
-				fs::copy_file(infile, tmpdir / "original");
+			if (infile == "-") {
+				std::ofstream tmpfile(tmpdir / "original", std::ios::binary);
+				tmpfile.exceptions(std::ios::badbit | std::ios::failbit);
+				tmpfile << std::cin.rdbuf();
+				tmpfile.close();
 			}
-			catch (...) {
-				std::ifstream in(infile, std::ios::binary);
-				in.exceptions(std::ios::badbit | std::ios::failbit);
-
-				std::ofstream out(tmpdir / "original", std::ios::binary);
-				out.exceptions(std::ios::badbit | std::ios::failbit);
-				out << in.rdbuf();
-				out.close();
+			else {
+				file_clone(infile, tmpdir / "original");
 			}
+			original = std::make_shared<MappedFile>(tmpdir / "original");
 		}
+		auto data = original->view();
+		Profile::count(Profile::bytes_read, data.size());
+		t_input.stop();
 
-		fs::current_path(tmpdir);
-
-		state = std::make_unique<State>(fs::current_path());
-		state->name(infile.filename().string());
-
-		if (format == "auto") {
-			auto ext = infile.extension().string();
-			if (!ext.empty()) {
-				ext = ext.substr(1);
-			}
-			to_lower(ext);
+		Profile::Timer t_detect("extract.detect");
+		format = detect_format(data, format, infile);
+		t_detect.stop();
 
-			if (ext == "docx") {
-				format = "docx";
+		// An identical original was extracted before, so its state can be reused as-is
+		// A partial stream for --since is not worth sharing
+		if (!cache.empty() && since.empty()) {
+			Profile::Timer timer("extract.cache");
+			key = Cache::doc_key(data, format, stream);
+			if (Cache(cache).load_doc(key, tmpdir, stream)) {
+				state = std::make_unique<State>(tmpdir);
+				state->name(infile.filename().string());
+				state->info("cache", fs::absolute(cache).string());
+				auto extracted = file_load(tmpdir / "extracted");
+				auto xv = s2x(extracted);
+				return { tmpdir, xmlString(xv.begin(), xv.end()), file_load(tmpdir / "content.xml"), std::move(state) };
 			}
-			else if (ext == "pptx") {
-				format = "pptx";
-			}
-			else if (ext == "odt") {
-				format = "odt";
-			}
-			else if (ext == "odp") {
-				format = "odp";
-			}
-			else if (ext == "html" || ext == "htm") {
-				format = "html";
-			}
-			else if (ext == "text" || ext == "txt") {
-				format = "text";
-			}
-			else {
-				bool is_zip = []() {
-					char buf[4]{};
-					std::ifstream in("original", std::ios::binary);
-					in.exceptions(std::ios::badbit | std::ios::failbit);
-					in.read(buf, sizeof(buf));
-					return (buf[0] == 'P' && buf[1] == 'K' && ((buf[2] == '\x03' && buf[3] == '\x04') || (buf[2] == '\x05' && buf[3] == '\x06') || (buf[2] == '\x07' && buf[3] == '\x08')));
-				}();
-
-				if (is_zip) {
-					int e = 0;
-					auto zip = zip_open("original", ZIP_RDONLY, &e);
-					if (zip == nullptr) {
-						throw std::runtime_error(concat("Could not open zip file: ", std::to_string(e)));
-					}
-					if (zip_name_locate(zip, "word/document.xml", 0) >= 0) {
-						format = "docx";
-					}
-					else if (zip_name_locate(zip, "ppt/slides/slide1.xml", 0) >= 0) {
-						format = "pptx";
-					}
-					else if (zip_name_locate(zip, "content.xml", 0) >= 0) {
-						// ODP == ODT
-						format = "odt";
-					}
-					zip_close(zip);
-				}
-				else {
-					auto c = file_load("original");
-					to_lower(c);
-					if (c.find("</html>") != std::string::npos) {
-						format = "html";
-					}
-					else if (c.find("</b>") != std::string::npos || c.find("</a>") != std::string::npos || c.find("</i>") != std::string::npos || c.find("</span>") != std::string::npos || c.find("</p>") != std::string::npos || c.find("</u>") != std::string::npos || c.find("</strong>") != std::string::npos || c.find("</em>") != std::string::npos || c.find("</s>") != std::string::npos || c.find("</q>") != std::string::npos || c.find("</font>") != std::string::npos) {
-						format = "html-fragment";
-					}
-					else {
-						format = "text";
-					}
-				}
-			}
-		}
-		if (format == "auto") {
-			throw std::runtime_error("Could not auto-detect input file format");
 		}
 
+		state = std::make_unique<State>(tmpdir, false, backend);
+		state->original(std::move(original));
+		state->name(infile.filename().string());
 		state->format(format);
 		state->stream(stream);
-
-		if (format == "docx") {
-			dom = extract_docx(*state);
-		}
-		else if (format == "pptx") {
-			dom = extract_pptx(*state);
-		}
-		else if (format == "odt" || format == "odp") {
-			dom = extract_odt(*state);
-		}
-		else if (format == "html") {
-			dom = extract_html(*state);
-		}
-		else if (format == "html-fragment") {
-			dom = extract_html_fragment(*state);
-		}
-		else if (format == "text") {
-			dom = extract_text(*state);
-		}
-		else if (format == "line") {
-			dom = extract_text(*state, true);
-		}
-		else {
-			throw std::runtime_error(concat("Unknown format: ", format));
+		if (!cache.empty()) {
+			state->info("cache", fs::absolute(cache).string());
 		}
+
+		dom = extract_format(*state, format);
 	}
 	else {
-		fs::current_path(tmpdir);
-
-		auto xml = xmlReadFile("styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
+		auto xml = xmlReadFile((tmpdir / "styled.xml").string().c_str(), "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
 		if (xml == nullptr) {
-			throw std::runtime_error(concat("Could not parse styled.xml: ", xmlLastError.message));
+			throw std::runtime_error(concat("Could not parse styled.xml: ", xml_error_message()));
 		}
-		state = std::make_unique<State>(fs::current_path(), true);
+		state = std::make_unique<State>(tmpdir, since.empty());
 		dom = std::make_unique<DOM>(*state, xml);
 	}
 
-	auto extracted = dom->extract_blocks();
-	file_save("extracted", x2s(extracted));
+	// Leave out blocks that the earlier folder already has translations for, and let injection know where to find them
+	if (!since.empty()) {
+		load_known_blocks(since, dom->blocks_known);
+		state->info("since", fs::absolute(since).string());
+	}
 
-	auto cntx = xmlSaveToFilename("content.xml", "UTF-8", 0);
-	xmlSaveDoc(cntx, dom->xml.get());
-	xmlSaveClose(cntx);
+	auto rv = finish_extraction(*state, std::move(dom));
+
+	if (!key.empty()) {
+		// The state must be closed before its files can be copied
+		state.reset();
+		Profile::Timer timer("extract.cache");
+		Cache(cache).save_doc(key, tmpdir, stream);
+	}
+
+	rv.state = std::move(state);
+	return rv;
+}
+
+// Extracts a document that is already in memory, as the embeddable API in libtransfuse.hpp does
+// Without a folder the state is transient and nothing touches the filesystem; with one, the state is saved there just as extract() would, so the command line tool can inject into it later
+Extraction extract_buffer(fs::path tmpdir, std::shared_ptr<MappedFile> original, const fs::path& name, std::string_view format, Stream stream) {
+	if (stream == Streams::detect) {
+		stream = Streams::apertium;
+	}
+
+	Profile::count(Profile::bytes_read, original->size);
+	format = detect_format(original->view(), format, name);
+
+	auto backend = Backends::transient;
+	if (!tmpdir.empty()) {
+		fs::create_directories(tmpdir);
+		tmpdir = fs::canonical(tmpdir);
+		file_save(tmpdir / "original", original->view());
+		backend = Backends::memory;
+	}
+
+	auto state = std::make_unique<State>(tmpdir, false, backend);
+	state->original(std::move(original));
+	state->name(name.filename().string());
+	state->format(format);
+	state->stream(stream);
 
-	return tmpdir;
+	auto rv = finish_extraction(*state, extract_format(*state, format));
+	rv.state = std::move(state);
+	return rv;
 }
 
 }
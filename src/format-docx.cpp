@@ -17,14 +17,12 @@
 
 #include "shared.hpp"
 #include "formats.hpp"
+#include "format-zip.hpp"
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <libxml/xmlsave.h>
-#include <unicode/ustring.h>
-#include <unicode/regex.h>
 #include <zip.h>
-using namespace icu;
 
 namespace Transfuse {
 
@@ -59,6 +57,10 @@ void docx_merge_wt(State& state, xmlDocPtr xml) {
 	xmlString content;
 	auto buf = xmlBufferCreate();
 
+	// Most runs share their properties with many others, so each distinct run is only serialized once
+	RunStyles seen;
+	std::string encoded;
+
 	// For each paragraph, merge all text nodes but remember if they were bold, italic, or hyperlinks
 	// This creates <tf-text> elements, which will be removed after injection
 	auto ns = rs->nodesetval;
@@ -81,30 +83,40 @@ void docx_merge_wt(State& state, xmlDocPtr xml) {
 			xmlNodeSetContent(node, XC(TF_SENTINEL));
 
 			auto bp = node->parent;
-			xmlBufferEmpty(buf);
-			auto sz = xmlNodeDump(buf, bp->doc, bp, 0, 0);
-			tag.assign(buf->content, buf->content + sz);
-
-			xmlChar_view type{ XC("text") };
-			if (tag.find(XC("<w:b/>")) != xmlString::npos && tag.find(XC("<w:i/>")) != xmlString::npos) {
-				type = XC("b+i");
-			}
-			else if (tag.find(XC("<w:b/>")) != xmlString::npos) {
-				type = XC("b");
-			}
-			else if (tag.find(XC("<w:i/>")) != xmlString::npos) {
-				type = XC("i");
+			auto key = xml_hash_tree(bp, encoded);
+			auto it = seen.find(key);
+			RunStyle style;
+			if (it == seen.end() || it->second.encoded != encoded) {
+				xmlBufferEmpty(buf);
+				auto sz = xmlNodeDump(buf, bp->doc, bp, 0, 0);
+				tag.assign(buf->content, buf->content + sz);
+
+				style.type = XC("text");
+				if (tag.find(XC("<w:b/>")) != xmlString::npos && tag.find(XC("<w:i/>")) != xmlString::npos) {
+					style.type = XC("b+i");
+				}
+				else if (tag.find(XC("<w:b/>")) != xmlString::npos) {
+					style.type = XC("b");
+				}
+				else if (tag.find(XC("<w:i/>")) != xmlString::npos) {
+					style.type = XC("i");
+				}
+
+				auto s = tag.find(XC(TF_SENTINEL));
+				tmp.assign(tag.begin() + PD(s) + 3, tag.end());
+				tag.erase(s);
+				style.hash = state.style(style.type, tag, tmp);
+				if (it == seen.end()) {
+					style.encoded = encoded;
+					it = seen.emplace(key, style).first;
+				}
 			}
-
-			auto s = tag.find(XC(TF_SENTINEL));
-			tmp.assign(tag.begin() + PD(s) + 3, tag.end());
-			tag.erase(s);
-			auto hash = state.style(type, tag, tmp);
+			auto& run = (it->second.encoded == encoded) ? it->second : style;
 
 			tmp = XC(TFI_OPEN_B);
-			tmp += type;
+			tmp += run.type;
 			tmp += ':';
-			tmp += hash;
+			tmp += run.hash;
 			tmp += TFI_OPEN_E;
 			append_xml(tmp, content);
 			tmp += TFI_CLOSE;
@@ -171,12 +183,70 @@ void docx_merge_wt(State& state, xmlDocPtr xml) {
 	state.commit();
 }
 
-std::unique_ptr<DOM> extract_docx(State& state) {
-	int e = 0;
-	auto zip = zip_open("original", ZIP_RDONLY, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open DOCX file: ", std::to_string(e)));
+// Other full-tag chaff, which may only have become empty once the chaff attributes were dropped
+static void docx_wipe_chaff(xmlDocPtr xml) {
+	auto pred = [](xmlNodePtr node) {
+		if ((xml_is(node, "w", "lang") || xml_is(node, "w", "proofErr")) && node->properties && !node->children) {
+			return true;
+		}
+		if (xml_is_bare(node, "w", "noProof") || xml_is_bare(node, "w", "lastRenderedPageBreak") || xml_is_bare(node, "w", "rFonts") || xml_is_bare(node, "w", "rPr") || xml_is_bare(node, "w", "softHyphen")) {
+			return true;
+		}
+		if (xml_is(node, "w", "color") && !node->children && node->properties && !node->properties->next) {
+			auto p = node->properties;
+			if (xmlStrcmp(p->name, XC("val")) == 0 && p->ns && xmlStrcmp(p->ns->prefix, XC("w")) == 0) {
+				return p->children && xmlStrcmp(p->children->content, XC("auto")) == 0;
+			}
+		}
+		return false;
+	};
+	xml_remove_if(reinterpret_cast<xmlNodePtr>(xml), pred);
+}
+
+// Copies node as if it were already a child of parent, so namespaces in scope there are used instead of declared again on the copy
+static xmlNodePtr docx_clone(xmlNodePtr node, xmlNodePtr parent, int deep) {
+	xmlNodePtr rv = nullptr;
+	if (xmlDOMWrapCloneNode(nullptr, node->doc, node, &rv, node->doc, parent, deep, 0) != 0 || rv == nullptr) {
+		throw std::runtime_error("Could not copy DOCX run");
 	}
+	return rv;
+}
+
+// Move <w:tab> to its very own <w:r> so it doesn't interfere with <w:t> merging or style hashing
+// The run's leading properties are repeated in both halves
+static void docx_split_tabs(xmlNodePtr node) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		if (!xml_is(child, "w", "r")) {
+			docx_split_tabs(child);
+			continue;
+		}
+
+		xmlNodePtr tab = nullptr;
+		for (auto c = child->children; c; c = c->next) {
+			if (xml_is_bare(c, "w", "tab") && c->next && xml_is(c->next, "w", "t") && c->next->properties == nullptr) {
+				tab = c;
+				break;
+			}
+		}
+		if (tab == nullptr) {
+			continue;
+		}
+
+		auto run = docx_clone(child, child->parent, 0);
+		xmlAddPrevSibling(child, run);
+		for (auto c = child->children; c != tab; c = c->next) {
+			xmlAddChild(run, docx_clone(c, run, 1));
+		}
+		xmlUnlinkNode(tab);
+		xmlAddChild(run, tab);
+	}
+}
+
+std::unique_ptr<DOM> extract_docx(State& state) {
+	auto zip = zip_open_buffer(state.original(), "DOCX");
 
 	zip_stat_t stat{};
 	if (zip_stat(zip, "word/document.xml", 0, &stat) != 0) {
@@ -186,82 +256,25 @@ std::unique_ptr<DOM> extract_docx(State& state) {
 		throw std::runtime_error("DOCX document.xml was empty");
 	}
 
-	auto zf = zip_fopen_index(zip, stat.index, 0);
-	if (zf == nullptr) {
-		throw std::runtime_error("Could not open DOCX document.xml");
-	}
-
-	std::string data(stat.size, 0);
-	zip_fread(zf, &data[0], stat.size);
-	zip_fclose(zf);
-
+	// Wipe chaff that's not relevant when translated, or simply superfluous, including revision tracking information
+	static const ChaffAttrs chaff{
+		{ "xml", "space", "preserve" },
+		{ "w", "eastAsiaTheme", "minorHAnsi" },
+		{ "w", "type", "textWrapping" },
+		{ "w", "rsidP", "" },
+		{ "w", "rsidRDefault", "" },
+		{ "w", "rsidR", "" },
+		{ "w", "rsidRPr", "" },
+		{ "w", "rsidDel", "" },
+	};
+	auto xml = zip_read_xml(zip, stat.index, "document.xml", chaff);
 	zip_close(zip);
 
-	auto udata = UnicodeString::fromUTF8(data);
-
-	udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
-
-	// Wipe chaff that's not relevant when translated, or simply superfluous
-	udata.findAndReplace(" xml:space=\"preserve\"", "");
-	udata.findAndReplace(" w:eastAsiaTheme=\"minorHAnsi\"", "");
-	udata.findAndReplace(" w:type=\"textWrapping\"", "");
-
-	UnicodeString tmp;
-
-	// Revision tracking information
-	rx_replaceAll(R"X( w:rsidP="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidRDefault="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidR="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidRPr="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( w:rsidDel="[^"]+")X", "", udata, tmp);
-
-	// Other full-tag chaff, intentionally done after attributes because removing those may leave these tags empty
-	rx_replaceAll(R"X(<w:lang(?=[ >])[^/>]+/>)X", "", udata, tmp);
-	rx_replaceAll(R"X(<w:proofErr(?=[ >])[^/>]+/>)X", "", udata, tmp);
-
-	udata.findAndReplace("<w:noProof/>", "");
-	udata.findAndReplace("<w:lastRenderedPageBreak/>", "");
-	udata.findAndReplace("<w:color w:val=\"auto\"/>", "");
-	udata.findAndReplace("<w:rFonts/>", "");
-	udata.findAndReplace("<w:rFonts></w:rFonts>", "");
-	udata.findAndReplace("<w:rPr></w:rPr>", "");
-	udata.findAndReplace("<w:softHyphen/>", "");
-
-	rx_replaceAll(R"X(</w:t>([^<>]+?)<w:t(?=[ >])[^>]*>)X", "", udata, tmp);
-
-	// Move <w:tab> to its very own <w:r> so it doesn't interfere with <w:t> merging or style hashing
-	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx_wr(R"X(<w:r(?=[ >])[^>]*>.*?</w:r>)X", 0, status);
-
-	tmp.remove();
-	rx_wr.reset(udata);
-	int32_t last = 0;
-	while (rx_wr.find(last, status)) {
-		auto mb = rx_wr.start(0, status);
-		auto me = rx_wr.end(0, status);
-
-		tmp.append(udata, last, mb - last);
-		int32_t tab = 0;
-		if ((tab = udata.indexOf("<w:tab/><w:t>", mb, me - mb)) != -1) {
-			tmp.append(udata, mb, tab - mb);
-			tmp.append("<w:tab/></w:r>");
-			tmp.append(udata, mb, tab - mb);
-			tmp.append(udata, tab + 8, me - tab - 8);
-		}
-		else {
-			tmp.append(udata, mb, me - mb);
-		}
-		last = me;
-	}
-	tmp.append(udata, last, udata.length() - last);
-	std::swap(tmp, udata);
+	docx_wipe_chaff(xml);
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "document.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse document.xml: ", xmlLastError.message));
-	}
-	udata.remove();
-	tmp.remove();
+	auto root = reinterpret_cast<xmlNodePtr>(xml);
+	xml_merge_text_siblings(root, "w", "t");
+	docx_split_tabs(root);
 
 	docx_merge_wt(state, xml);
 
@@ -269,85 +282,109 @@ std::unique_ptr<DOM> extract_docx(State& state) {
 	dom->tags_parents_allow = make_xmlChars("tf-text", "w:t");
 	dom->save_spaces();
 
-	auto buf = xmlBufferCreate();
-	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
-	xmlSaveFileTo(obuf, xml, "UTF-8");
-	data.assign(buf->content, buf->content + buf->use);
-	xmlBufferFree(buf);
-	cleanup_styles(data);
+	// The tree is already what the stream will be extracted from, so it is only serialized for later re-extraction
+	xml_cleanup_tf_text(root);
 
-	auto b = data.rfind("</tf-text><tf-text>");
-	while (b != std::string::npos) {
-		data.erase(b, 19);
-		b = data.rfind("</tf-text><tf-text>");
+	if (!state.transient) {
+		auto cntx = xmlSaveToFilename((state.tmpdir / "styled.xml").string().c_str(), "UTF-8", 0);
+		xmlSaveDoc(cntx, xml);
+		xmlSaveClose(cntx);
 	}
 
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(data.data()), SI(data.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlLastError.message));
-	}
-	file_save("styled.xml", data);
-
 	return dom;
 }
 
-std::string inject_docx(DOM& dom) {
-	auto buf = xmlBufferCreate();
-	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
-	xmlSaveFileTo(obuf, dom.xml.get(), "UTF-8");
-	std::string data(buf->content, buf->content + buf->use);
-	xmlBufferFree(buf);
+// Whether the element is a <w:r> that ends with a non-empty <w:t>, i.e. serializes as ...</w:t></w:r>
+static bool docx_is_closed_run(xmlNodePtr node) {
+	return xml_is(node, "w", "r") && node->last && xml_is(node->last, "w", "t") && node->last->children;
+}
 
-	auto udata = UnicodeString::fromUTF8(data);
-	UnicodeString tmp;
+// Wraps <w:r><w:t> around text directly after each element the predicate returns true for, in a way that does not inherit formatting
+template<typename Pred>
+static void docx_wrap_chars_after(xmlNodePtr node, Pred& pred, std::vector<xmlNodePtr>& chars) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		docx_wrap_chars_after(child, pred, chars);
+		if (!pred(child) || !xml_chars_after(child, chars)) {
+			continue;
+		}
+		auto r = xmlNewDocNode(child->doc, child->ns, XC("r"), nullptr);
+		auto t = xmlNewDocNode(child->doc, child->ns, XC("t"), nullptr);
+		xmlAddChild(r, t);
+		xmlAddNextSibling(child, r);
+		for (auto c : chars) {
+			xmlUnlinkNode(c);
+			xmlAddChild(t, c);
+		}
+		child = r;
+	}
+}
 
-	// DOCX can't have any text outside w:t
-	// Wrap tags around text after </w:t></w:r>, in a way that does not inherit formatting
-	rx_replaceAll(R"X((</w:t></w:r>)([^<>]+))X", "$1<w:r><w:t>$2</w:t></w:r>", udata, tmp);
+// Puts xml:space="preserve" first on every <w:t> that has a start tag
+static void docx_preserve_space(xmlNodePtr node, xmlNsPtr xmlns) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		docx_preserve_space(child, xmlns);
+		if (!xml_is(child, "w", "t") || !xml_has_start_tag(child)) {
+			continue;
+		}
+		auto space = xmlNewNsProp(child, xmlns, XC("space"), XC("preserve"));
+		if (child->properties != space) {
+			space->prev->next = nullptr;
+			space->prev = nullptr;
+			space->next = child->properties;
+			child->properties->prev = space;
+			child->properties = space;
+		}
+	}
+}
+
+// DOCX can't have any text outside w:t
+// These passes used to be regexes over the serialized document, and are done in the same order so the output is the same
+static void docx_fix_text(xmlDocPtr xml) {
+	auto root = xmlDocGetRootElement(xml);
+	std::vector<xmlNodePtr> chars;
+
+	// Wrap tags around text after </w:t></w:r>
+	docx_wrap_chars_after(root, docx_is_closed_run, chars);
 
 	// Ditto for text after </w:t></w:r></w:hyperlink>
-	rx_replaceAll(R"X((</w:t></w:r></w:hyperlink>)([^<>]+))X", "$1<w:r><w:t>$2</w:t></w:r>", udata, tmp);
+	auto is_closed_link = [](xmlNodePtr node) {
+		return xml_is(node, "w", "hyperlink") && node->last && docx_is_closed_run(node->last);
+	};
+	docx_wrap_chars_after(root, is_closed_link, chars);
 
 	// Move text from before <w:r><w:t> inside it
-	rx_replaceAll_expand_21(R"X(([^>])(<w:r(?=[ >])[^>]*>.*?<w:t(?=[ >])[^>]*>))X", udata, tmp);
+	xml_move_leading_chars(root, "w", "r", { "t" });
 
 	// Move text from before <w:hyperlink><w:r><w:t> inside it
-	rx_replaceAll_expand_21(R"X(([^>])(<w:hyperlink(?=[ >])[^>]*>.*?<w:r(?=[ >])[^>]*>.*?<w:t(?=[ >])[^>]*>))X", udata, tmp);
+	xml_move_leading_chars(root, "w", "hyperlink", { "r", "t" });
 
 	// Remove empty text elements
-	rx_replaceAll(R"X(<w:r><w:t/></w:r>)X", "", udata, tmp);
+	xml_remove_empty_runs(root, "w");
 
 	// Remove the <tf-text> helper elements that we added
-	rx_replaceAll(R"X(</?tf-text>)X", "", udata, tmp);
+	xml_unwrap_tf_text(root);
 
 	// DOCX by default does ignores all leading/trailing whitespace, so tell it not do.
 	// ToDo: xml:space=preserve needs adjusting to only be added where it makes sense, such as not before punctuation
-	rx_replaceAll(R"X(<w:t([ >]))X", "<w:t xml:space=\"preserve\"$1", udata, tmp);
-
-	data.clear();
-	udata.toUTF8String(data);
-	file_save("injected.xml", data);
-
-	fs::copy("original", "injected.docx");
-
-	int e = 0;
-	auto zip = zip_open("injected.docx", 0, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open DOCX file: ", std::to_string(e)));
-	}
+	docx_preserve_space(root, xmlSearchNs(xml, root, XC("xml")));
+}
 
-	auto src = zip_source_file(zip, "injected.xml", 0, 0);
-	if (src == nullptr) {
-		throw std::runtime_error("Could not open injected.xml");
-	}
+std::string inject_docx(DOM& dom, const fs::path& out) {
+	docx_fix_text(dom.xml.get());
 
-	if (zip_file_add(zip, "word/document.xml", src, ZIP_FL_OVERWRITE) < 0) {
-		throw std::runtime_error("Could not replace word/document.xml");
-	}
-
-	zip_close(zip);
+	auto buf = xmlBufferCreate();
+	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
+	xmlSaveFileTo(obuf, dom.xml.get(), "UTF-8");
+	std::string data(buf->content, buf->content + buf->use);
+	xmlBufferFree(buf);
 
-	return "injected.docx";
+	return zip_write_replaced(dom.state.original(), out, { { "word/document.xml", data } });
 }
 
 }
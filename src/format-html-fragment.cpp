@@ -22,19 +22,15 @@ using namespace icu;
 namespace Transfuse {
 
 std::unique_ptr<DOM> extract_html_fragment(State& state) {
-	auto raw_data = file_load("original");
-	auto enc = detect_encoding(raw_data);
-
-	auto data = std::make_unique<UnicodeString>(to_ustring(raw_data, enc));
-
-	data->insert(0, "<!DOCTYPE html>\n<html><head><meta charset=\"UTF-16\"></head><body>");
-	data->append("</body></html>");
+	std::string data{ "<!DOCTYPE html>\n<html><head><meta charset=\"UTF-8\"></head><body>" };
+	data += to_utf8(std::string(state.original()));
+	data += "</body></html>";
 
 	return extract_html(state, std::move(data));
 }
 
 std::string inject_html_fragment(DOM& dom) {
-	auto fragment = file_load(inject_html(dom));
+	auto fragment = inject_html(dom);
 
 	auto e = fragment.find("</body>");
 	fragment.erase(e);
@@ -42,9 +38,7 @@ std::string inject_html_fragment(DOM& dom) {
 	auto b = fragment.find("<body>");
 	fragment.erase(0, b + 6);
 
-	file_save("injected.fragment", fragment);
-
-	return "injected.fragment";
+	return fragment;
 }
 
 }
@@ -24,51 +24,176 @@
 #include <libxml/tree.h>
 #include <libxml/xmlsave.h>
 #include <unicode/regex.h>
-#include <unicode/ustring.h>
 #include <memory>
 using namespace icu;
 
 namespace Transfuse {
 
-std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeString> data) {
-	if (!data) {
-		auto raw_data = file_load("original");
-		auto enc = detect_encoding(raw_data);
-		data = std::make_unique<UnicodeString>(to_ustring(raw_data, enc));
+// Bytes [start, end) of a capture group
+inline std::string_view rx_group(RegexMatcher& rx, std::string_view data, int32_t n) {
+	UErrorCode status = U_ZERO_ERROR;
+	auto b = rx.start(n, status);
+	auto e = rx.end(n, status);
+	if (U_FAILURE(status) || b < 0) {
+		return {};
+	}
+	return data.substr(SZ(b), SZ(e - b));
+}
+
+// Runs the regex directly over the UTF-8 data, and replaces each match with what fn appends to the output
+// Only copies the data if there was a match, and never rescans text that has already been passed
+template<typename F>
+static void rx_replace_utf8(RegexMatcher& rx, std::string& data, F fn) {
+	UText ut = UTEXT_INITIALIZER;
+	utext_openUTF8(ut, data);
+	rx.reset(&ut);
+
+	UErrorCode status = U_ZERO_ERROR;
+	std::string out;
+	bool did = false;
+	size_t last = 0;
+	while (rx.find()) {
+		if (!did) {
+			out.reserve(data.size() + data.size() / 16);
+			did = true;
+		}
+		auto b = SZ(rx.start(status));
+		out.append(data, last, b - last);
+		fn(out, rx, data);
+		last = SZ(rx.end(status));
+	}
+	utext_close(&ut);
+	if (U_FAILURE(status)) {
+		throw std::runtime_error(concat("Could not match regex in HTML: ", u_errorName(status)));
+	}
+
+	if (did) {
+		out.append(data, last, std::string::npos);
+		data.swap(out);
+	}
+}
+
+inline bool ascii_iequal(std::string_view data, size_t i, std::string_view lower) {
+	if (data.size() - i < lower.size()) {
+		return false;
+	}
+	for (size_t j = 0; j < lower.size(); ++j) {
+		auto c = data[i + j];
+		if (c >= 'A' && c <= 'Z') {
+			c = static_cast<char>(c + 32);
+		}
+		if (c != lower[j]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Length of the soft-hyphen at data[i], in any of the forms <wbr>, <wbr/>, U+00AD, &shy;, &#173;, &#xad;, or 0 if there is none
+static size_t shy_len(std::string_view data, size_t i) {
+	if (data[i] == '\xc2') {
+		return (i + 1 < data.size() && data[i + 1] == '\xad') ? 2 : 0;
+	}
+	if (data[i] == '<') {
+		if (!ascii_iequal(data, i + 1, "wbr")) {
+			return 0;
+		}
+		auto j = SI32(i + 4);
+		auto e = j;
+		while (j < SI32(data.size()) && is_space_cp(next_cp(data, j))) {
+			e = j;
+		}
+		auto k = SZ(e);
+		if (k < data.size() && data[k] == '/') {
+			++k;
+		}
+		return (k < data.size() && data[k] == '>') ? k + 1 - i : 0;
+	}
+	if (ascii_iequal(data, i + 1, "shy;")) {
+		return 5;
+	}
+	if (ascii_iequal(data, i + 1, "#173;")) {
+		return 6;
+	}
+	if (ascii_iequal(data, i + 1, "#x")) {
+		auto k = i + 3;
+		while (k < data.size() && data[k] == '0') {
+			++k;
+		}
+		return ascii_iequal(data, k, "ad;") ? k + 3 - i : 0;
+	}
+	return 0;
+}
+
+// Wipes all forms soft-hyphens can take, in a single pass that only copies if there are any
+static void remove_shy(std::string& data) {
+	std::string out;
+	bool did = false;
+	size_t last = 0;
+	for (auto i = data.find_first_of("<&\xc2"); i != std::string::npos; i = data.find_first_of("<&\xc2", i)) {
+		auto n = shy_len(data, i);
+		if (n == 0) {
+			++i;
+			continue;
+		}
+		if (!did) {
+			out.reserve(data.size());
+			did = true;
+		}
+		out.append(data, last, i - last);
+		i += n;
+		last = i;
+	}
+	if (did) {
+		out.append(data, last, std::string::npos);
+		data.swap(out);
+	}
+}
+
+std::unique_ptr<DOM> extract_html(State& state, std::string data) {
+	if (data.empty()) {
+		data = to_utf8(std::string(state.original()));
 
 		// If there is no closing tag, this can't be a fully formed valid HTML document
-		if (data->indexOf("</html>") == -1 && data->indexOf("</HTML>") == -1) {
-			// Perform expensive lower-casing and check again, just in case someone uses </Html> or similar
-			auto tmp = *data;
-			tmp.toLower();
-			if (tmp.indexOf("</html>") == -1) {
-				state.format("html-fragment");
-				return extract_html_fragment(state);
+		// Only ASCII letters can case-fold to the letters of </html>, so a byte-wise case-insensitive search is exact
+		bool has_close = false;
+		for (auto i = data.find("</"); i != std::string::npos; i = data.find("</", i + 2)) {
+			if (ascii_iequal(data, i + 2, "html>")) {
+				has_close = true;
+				break;
 			}
 		}
+		if (!has_close) {
+			state.format("html-fragment");
+			return extract_html_fragment(state);
+		}
 	}
 
+	// Everything up to parsing works on the UTF-8 bytes, with regexes running over UText, so no UTF-16 copy of the document is ever made
 	// Find any charset="" charset='' charset= and replace with a placeholder that we will set to UTF-8 in injection
+	Profile::Timer t_prep("html.prepare");
 	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx(R"X(charset\s*=(["']?)\s*([-\w\d]+)\s*(["']?))X", UREGEX_CASE_INSENSITIVE, status);
-	if (U_FAILURE(status)) {
-		throw std::runtime_error(concat("Could not create RegexMatcher: ", u_errorName(status)));
-	}
-
-	rx.reset(*data);
-	if (rx.find()) {
-		UnicodeString cset("charset=");
-		auto b = rx.start(1, status);
-		auto e = rx.end(1, status);
-		cset.append(*data, b, e-b);
-		cset += XML_ENC_UC;
-		b = rx.start(3, status);
-		e = rx.end(3, status);
-		cset.append(*data, b, e - b);
+	{
+		auto& rx = cached_rx(R"X(charset\s*=(["']?)\s*([-\w\d]+)\s*(["']?))X", UREGEX_CASE_INSENSITIVE);
+		UText ut = UTEXT_INITIALIZER;
+		utext_openUTF8(ut, data);
+		rx.reset(&ut);
+		if (rx.find()) {
+			auto q1 = rx_group(rx, data, 1);
+			auto q3 = rx_group(rx, data, 3);
+			std::string cset{ "charset=" };
+			cset.append(q1.begin(), q1.end());
+			cset += XML_ENC_U8;
+			cset.append(q3.begin(), q3.end());
 
-		b = rx.start(0, status);
-		e = rx.end(0, status);
-		data->replace(b, e - b, cset);
+			auto b = rx.start(status);
+			auto e = rx.end(status);
+			utext_close(&ut);
+			data.replace(SZ(b), SZ(e - b), cset);
+		}
+		else {
+			utext_close(&ut);
+		}
 	}
 	if (U_FAILURE(status)) {
 		throw std::runtime_error(concat("Could not replace charset in data: ", u_errorName(status)));
@@ -76,61 +201,76 @@ std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeStri
 
 	{
 		// Protect <script> and <style> because they may contain unescaped & and other meta-characters that annoy the XML parser
-		RegexMatcher _rx_script(R"X(<script[^<>]*>(.*?)</script[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE, status);
-		RegexMatcher _rx_style(R"X(<style[^<>]*>(.*?)</style[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE, status);
+		auto& _rx_script = cached_rx(R"X(<script[^<>]*>(.*?)</script[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE);
+		auto& _rx_style = cached_rx(R"X(<style[^<>]*>(.*?)</style[^<>]*>)X", UREGEX_DOTALL | UREGEX_CASE_INSENSITIVE);
 		RegexMatcher* rx_ss[]{ &_rx_script, &_rx_style };
-		std::string tmp_str;
-		std::string tmp_p;
 		for (auto& rxs : rx_ss) {
-			rxs->reset(*data);
-			int32_t last = 0;
-			while (rxs->find(last, status)) {
-				auto b = rxs->start(1, status);
-				auto e = rxs->end(1, status);
-				if (b == e) {
-					last = b + 1;
-					continue;
+			rx_replace_utf8(*rxs, data, [&](std::string& out, RegexMatcher& rx, std::string_view in) {
+				auto m = rx_group(rx, in, 0);
+				auto body = rx_group(rx, in, 1);
+				auto pre = SZ(body.data() - m.data());
+				out.append(m.begin(), m.begin() + PD(pre));
+				if (body.empty()) {
+					out.append(body.end(), m.end());
+					return;
 				}
-				tmp_str.resize(SZ((e - b) * 4));
-				int32_t olen = 0;
-				int32_t slen = 0;
-				u_strToUTF8WithSub(&tmp_str[0], SI32(tmp_str.size()), &olen, &data->getTerminatedBuffer()[b], e - b, u'\uFFFD', &slen, &status);
-
-				auto hash = state.style("U", tmp_str, "");
-				tmp_p.clear();
-				tmp_p += TFU_OPEN;
-				tmp_p += hash;
-				tmp_p += TFU_CLOSE;
-				data->replaceBetween(b, e, UnicodeString::fromUTF8(tmp_p));
-				rxs->reset(*data);
-				last = b + 1;
-			}
+				out += TFU_OPEN;
+				out += state.style("U", body, "");
+				out += TFU_CLOSE;
+				out.append(body.end(), m.end());
+			});
 		}
 
-		// Wipe <wbr>, &shy;, and all other forms soft-hyphens can take
-		UnicodeString tmp;
-		RegexMatcher rx_shy(R"X((<wbr\s*/?>)|(\u00ad)|(&shy;)|(&#173;)|(&#x(0*)ad;))X", UREGEX_CASE_INSENSITIVE, status);
-		rx_shy.reset(*data);
-		tmp = rx_shy.replaceAll("", status);
-		std::swap(tmp, *data);
+		remove_shy(data);
 
 		// Add spaces around <sub> and <sup> where needed, and record that we've done so
-		RegexMatcher rx_subp_open(R"X(([^>\s])(<su[bp])( |>))X", UREGEX_CASE_INSENSITIVE, status);
-		rx_subp_open.reset(*data);
-		tmp = rx_subp_open.replaceAll("$1 $2 tf-added-before=\"1\"$3", status);
-		std::swap(tmp, *data);
+		bool has_subp = false;
+		for (auto i = data.find('<'); i != std::string::npos; i = data.find('<', i + 1)) {
+			if (ascii_iequal(data, i + 1, "su")) {
+				has_subp = true;
+				break;
+			}
+		}
+		if (has_subp) {
+			auto& rx_subp_open = cached_rx(R"X(([^>\s])(<su[bp])( |>))X", UREGEX_CASE_INSENSITIVE);
+			rx_replace_utf8(rx_subp_open, data, [&](std::string& out, RegexMatcher& rx, std::string_view in) {
+				auto g1 = rx_group(rx, in, 1);
+				auto g2 = rx_group(rx, in, 2);
+				auto g3 = rx_group(rx, in, 3);
+				out.append(g1.begin(), g1.end());
+				out += ' ';
+				out.append(g2.begin(), g2.end());
+				out += " tf-added-before=\"1\"";
+				out.append(g3.begin(), g3.end());
+			});
 
-		RegexMatcher rx_subp_close(R"X(<(su[bp])( |>)(.*?)(</\1>)([^<\s]))X", UREGEX_CASE_INSENSITIVE, status);
-		rx_subp_close.reset(*data);
-		tmp = rx_subp_close.replaceAll("<$1 tf-added-after=\"1\"$2$3$4 $5", status);
-		std::swap(tmp, *data);
+			auto& rx_subp_close = cached_rx(R"X(<(su[bp])( |>)(.*?)(</\1>)([^<\s]))X", UREGEX_CASE_INSENSITIVE);
+			rx_replace_utf8(rx_subp_close, data, [&](std::string& out, RegexMatcher& rx, std::string_view in) {
+				auto g1 = rx_group(rx, in, 1);
+				auto g2 = rx_group(rx, in, 2);
+				auto g3 = rx_group(rx, in, 3);
+				auto g4 = rx_group(rx, in, 4);
+				auto g5 = rx_group(rx, in, 5);
+				out += '<';
+				out.append(g1.begin(), g1.end());
+				out += " tf-added-after=\"1\"";
+				out.append(g2.begin(), g2.end());
+				out.append(g3.begin(), g3.end());
+				out.append(g4.begin(), g4.end());
+				out += ' ';
+				out.append(g5.begin(), g5.end());
+			});
+		}
 	}
+	t_prep.stop();
 
-	auto xml = htmlReadMemory(reinterpret_cast<const char*>(data->getTerminatedBuffer()), SI(SZ(data->length()) * sizeof(UChar)), "transfuse.html", utf16_native, HTML_PARSE_RECOVER | HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR | HTML_PARSE_NONET);
+	Profile::Timer t_parse("html.parse");
+	auto xml = htmlReadMemory(data.data(), SI(data.size()), "transfuse.html", "UTF-8", HTML_PARSE_RECOVER | HTML_PARSE_NOWARNING | HTML_PARSE_NOERROR | HTML_PARSE_NONET);
 	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse HTML: ", xmlLastError.message));
+		throw std::runtime_error(concat("Could not parse HTML: ", xml_error_message()));
 	}
-	data.reset();
+	std::string().swap(data);
+	t_parse.stop();
 
 	auto dom = std::make_unique<DOM>(state, xml);
 	dom->tags_prot = make_xmlChars("applet", "area", "base", "cite", "code", "frame", "frameset", "link", "meta", "nowiki", "object", "pre", "ref", "script", "style", "svg", "syntaxhighlight", "template");
@@ -141,28 +281,30 @@ std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeStri
 	dom->save_spaces();
 
 	auto styled = dom->save_styles(true);
-	file_save("styled.xml", x2s(styled));
+	if (!state.transient) {
+		file_save(state.tmpdir / "styled.xml", x2s(styled));
+	}
+	Profile::Timer timer("xml.reparse");
 	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(styled.data()), SI(styled.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
 	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlLastError.message));
+		throw std::runtime_error(concat("Could not parse styled XML: ", xml_error_message()));
 	}
 
 	return dom;
 }
 
 std::string inject_html(DOM& dom) {
-	auto cntx = xmlSaveToFilename("injected.html", "UTF-8", XML_SAVE_AS_HTML);
+	auto buf = xmlBufferCreate();
+	auto cntx = xmlSaveToBuffer(buf, "UTF-8", XML_SAVE_AS_HTML);
 	xmlSaveDoc(cntx, dom.xml.get());
 	xmlSaveClose(cntx);
+	std::string content(reinterpret_cast<const char*>(xmlBufferContent(buf)), SZ(xmlBufferLength(buf)));
+	xmlBufferFree(buf);
 
-	std::ifstream in("original", std::ios::binary);
-	in.exceptions(std::ios::badbit | std::ios::failbit);
-	std::string line;
-	std::getline(in, line);
+	auto original = dom.state.original();
+	std::string line{ original.substr(0, original.find('\n')) };
 	bool had_doctype = to_lower(line).find("<!doctype") != std::string::npos;
-	in.close();
 
-	auto content = file_load("injected.html");
 	auto b = content.find(XML_ENC_U8);
 	if (b != std::string::npos) {
 		content.replace(b, 3, "UTF-8");
@@ -188,9 +330,7 @@ std::string inject_html(DOM& dom) {
 		b = content.find(TFU_OPEN);
 	}
 
-	file_save("injected.html", content);
-
-	return "injected.html";
+	return content;
 }
 
 }
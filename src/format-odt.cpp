@@ -17,121 +17,167 @@
 
 #include "shared.hpp"
 #include "formats.hpp"
+#include "format-zip.hpp"
 #include <libxml/tree.h>
 #include <libxml/xmlsave.h>
-#include <unicode/ustring.h>
-#include <unicode/regex.h>
 #include <zip.h>
 #include <unordered_map>
-using namespace icu;
+#include <unordered_set>
+#include <vector>
 
 namespace Transfuse {
 
-struct ustring_hash {
-	using hash_type = std::hash<ustring_view>;
-	using is_transparent = void;
-	size_t operator()(const UChar* str) const { return hash_type{}(str); }
-	size_t operator()(ustring_view str) const { return hash_type{}(str); }
-	size_t operator()(UnicodeString const& str) const { return hash_type{}(ustring_view(str.getBuffer(), str.length())); }
-};
-
-std::unique_ptr<DOM> extract_odt(State& state) {
-	int e = 0;
-	auto zip = zip_open("original", ZIP_RDONLY, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open ODT/ODP file: ", std::to_string(e)));
+// Only automatic paragraph and text styles are deduplicated, as those are the families whose references odt_rename_styles() knows how to remap
+// Common styles are left alone, as the common styles in styles.xml are referenced from content.xml and shown to the user by name
+// Names used by styles of any other family are collected in others, as such a name can't be remapped without knowing which family a reference is for
+static void odt_collect_styles(xmlDocPtr xml, std::vector<xmlNodePtr>& styles, std::unordered_set<std::string>& others) {
+	for (auto child = xmlDocGetRootElement(xml)->children; child; child = child->next) {
+		bool automatic = xml_is(child, "office", "automatic-styles");
+		if (!automatic && !xml_is(child, "office", "styles")) {
+			continue;
+		}
+		for (auto style = child->children; style; style = style->next) {
+			if (!xml_is(style, "style", "style")) {
+				continue;
+			}
+			auto family = xmlGetNsProp(style, XC("family"), style->ns->href);
+			bool dedup = family && (xmlStrcmp(family, XC("paragraph")) == 0 || xmlStrcmp(family, XC("text")) == 0);
+			xmlFree(family);
+			if (automatic && dedup) {
+				if (style->children) {
+					styles.push_back(style);
+				}
+				continue;
+			}
+			if (auto name = xmlGetNsProp(style, XC("name"), style->ns->href)) {
+				others.emplace(reinterpret_cast<const char*>(name));
+				xmlFree(name);
+			}
+		}
 	}
+}
 
-	zip_stat_t stat{};
-	if (zip_stat(zip, "content.xml", 0, &stat) != 0) {
-		throw std::runtime_error("ODT/ODP did not have content.xml");
+// Every attribute that can refer to a paragraph or text style
+static bool odt_is_style_ref(xmlAttrPtr attr) {
+	struct Ref {
+		const char* prefix;
+		const char* name;
+	};
+	static const Ref refs[] = {
+		{ "text", "style-name" },
+		{ "text", "cond-style-name" },
+		{ "text", "visited-style-name" },
+		{ "text", "citation-style-name" },
+		{ "text", "citation-body-style-name" },
+		{ "text", "main-entry-style-name" },
+		{ "text", "default-style-name" },
+		{ "draw", "text-style-name" },
+		{ "style", "parent-style-name" },
+		{ "style", "next-style-name" },
+		{ "table", "paragraph-style-name" },
+	};
+	if (attr->ns == nullptr || attr->ns->prefix == nullptr) {
+		return false;
 	}
-	if (stat.size == 0) {
-		throw std::runtime_error("ODT/ODP content.xml was empty");
+	for (auto& ref : refs) {
+		if (xmlStrcmp(attr->name, XC(ref.name)) == 0 && xmlStrcmp(attr->ns->prefix, XC(ref.prefix)) == 0) {
+			return true;
+		}
 	}
+	return false;
+}
 
-	auto zf = zip_fopen_index(zip, stat.index, 0);
-	if (zf == nullptr) {
-		throw std::runtime_error("Could not open ODT/ODP content.xml");
+static void odt_rename_styles(xmlNodePtr node, const std::unordered_map<std::string, std::string>& renames) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		for (auto attr = child->properties; attr; attr = attr->next) {
+			if (attr->children == nullptr || !odt_is_style_ref(attr)) {
+				continue;
+			}
+			auto it = renames.find(reinterpret_cast<const char*>(attr->children->content));
+			if (it != renames.end()) {
+				xmlSetNsProp(child, attr->ns, attr->name, XC(it->second.c_str()));
+			}
+		}
+		odt_rename_styles(child, renames);
 	}
+}
 
-	std::string data(stat.size, 0);
-	zip_fread(zf, &data[0], stat.size);
-	zip_fclose(zf);
-
-	zip_close(zip);
-
-	// ToDo: Turn <text:tab> and <text:tab [^>]*> into \t?
-
-	UnicodeString tmp;
-	auto udata = UnicodeString::fromUTF8(data);
-	udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
-
-	// Wipe chaff that's not relevant when translated, or simply superfluous
-	rx_replaceAll(R"X( fo:language="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:language-complex="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:language-asian="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( fo:country="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:country-complex="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( style:country-asian="[^"]+")X", "", udata, tmp);
-
-	// Revision tracking information
-	rx_replaceAll(R"X( officeooo:paragraph-rsid="[^"]+")X", "", udata, tmp);
-	rx_replaceAll(R"X( officeooo:rsid="[^"]+")X", "", udata, tmp);
-
-	udata.findAndReplace("<style:text-properties/>", "");
-
-	UnicodeString normed = udata;
-	UnicodeString rpl;
-	std::unordered_map<UnicodeString, UnicodeString, ustring_hash> styles;
-	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx_styles(R"X((<style:style style:name=")([^"]+)(".+?</style:style>))X", 0, status);
-
-	rx_styles.reset(udata);
-	while (rx_styles.find()) {
-		tmp.remove();
-
-		auto b1 = rx_styles.start(1, status);
-		auto e1 = rx_styles.end(1, status);
-		tmp.append(udata, b1, e1 - b1);
-
-		auto b3 = rx_styles.start(3, status);
-		auto e3 = rx_styles.end(3, status);
-		tmp.append(udata, b3, e3 - b3);
+// If a style, minus its unique name, is identical to an already seen style, drop it and point its users at the existing one
+// Styles are compared by their tree encoding, so all duplicates are found in one pass and all references are remapped in one more
+// Returns whether any style was dropped
+static bool odt_dedup_styles(xmlDocPtr xml) {
+	std::vector<xmlNodePtr> nodes;
+	std::unordered_set<std::string> others;
+	odt_collect_styles(xml, nodes, others);
+
+	std::unordered_map<std::string, std::string> styles;
+	std::unordered_map<std::string, std::string> renames;
+	std::string key;
+	for (auto node : nodes) {
+		auto name = xmlHasNsProp(node, XC("name"), node->ns ? node->ns->href : nullptr);
+		if (name == nullptr || name->children == nullptr) {
+			continue;
+		}
+		std::string sname(reinterpret_cast<const char*>(name->children->content));
+		if (others.count(sname)) {
+			continue;
+		}
 
-		// If the style, minus the unique name, is identical to an already seen style, replace it with the existing one
-		auto it = styles.find(tmp);
+		xml_encode_tree(key, node, name);
+		auto it = styles.find(key);
 		if (it != styles.end()) {
-			auto b0 = rx_styles.start(0, status);
-			auto e0 = rx_styles.end(0, status);
-			tmp.setTo(udata, b0, e0 - b0);
-			normed.findAndReplace(tmp, "");
-
-			auto b2 = rx_styles.start(2, status);
-			auto e2 = rx_styles.end(2, status);
-			tmp.setTo(" text:style-name=\"");
-			tmp.append(udata, b2, e2 - b2);
-			tmp.append("\"");
-			rpl.setTo(" text:style-name=\"");
-			rpl.append(it->second);
-			rpl.append("\"");
-			normed.findAndReplace(tmp, rpl);
+			renames[sname] = it->second;
+			xmlUnlinkNode(node);
+			xmlFreeNode(node);
 		}
 		else {
-			auto b2 = rx_styles.start(2, status);
-			auto e2 = rx_styles.end(2, status);
-			styles[tmp].setTo(udata, b2, e2 - b2);
+			styles.emplace(key, sname);
 		}
 	}
 
-	udata.swap(normed);
+	if (renames.empty()) {
+		return false;
+	}
+	odt_rename_styles(reinterpret_cast<xmlNodePtr>(xml), renames);
+	return true;
+}
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "content.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse content.xml: ", xmlLastError.message));
+std::unique_ptr<DOM> extract_odt(State& state) {
+	auto zip = zip_open_buffer(state.original(), "ODT/ODP");
+
+	zip_stat_t stat{};
+	if (zip_stat(zip, "content.xml", 0, &stat) != 0) {
+		throw std::runtime_error("ODT/ODP did not have content.xml");
 	}
-	data.clear();
-	data.shrink_to_fit();
+	if (stat.size == 0) {
+		throw std::runtime_error("ODT/ODP content.xml was empty");
+	}
+
+	// ToDo: Turn <text:tab> and <text:tab [^>]*> into \t?
+
+	// Wipe chaff that's not relevant when translated, or simply superfluous, including revision tracking information
+	static const ChaffAttrs chaff{
+		{ "fo", "language", "" },
+		{ "style", "language-complex", "" },
+		{ "style", "language-asian", "" },
+		{ "fo", "country", "" },
+		{ "style", "country-complex", "" },
+		{ "style", "country-asian", "" },
+		{ "officeooo", "paragraph-rsid", "" },
+		{ "officeooo", "rsid", "" },
+	};
+	auto xml = zip_read_xml(zip, stat.index, "content.xml", chaff);
+	zip_close(zip);
+
+	auto pred = [](xmlNodePtr node) {
+		return xml_is_bare(node, "style", "text-properties");
+	};
+	xml_remove_if(reinterpret_cast<xmlNodePtr>(xml), pred);
+
+	odt_dedup_styles(xml);
 
 	auto dom = std::make_unique<DOM>(state, xml);
 	dom->tags_parents_allow = make_xmlChars("text:h", "text:p");
@@ -140,40 +186,61 @@ std::unique_ptr<DOM> extract_odt(State& state) {
 	dom->save_spaces();
 
 	auto styled = dom->save_styles(true);
-	file_save("styled.xml", x2s(styled));
+	if (!state.transient) {
+		file_save(state.tmpdir / "styled.xml", x2s(styled));
+	}
+	Profile::Timer timer("xml.reparse");
 	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(styled.data()), SI(styled.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
 	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlLastError.message));
+		throw std::runtime_error(concat("Could not parse styled XML: ", xml_error_message()));
 	}
 
 	return dom;
 }
 
-std::string inject_odt(DOM& dom) {
-	auto cntx = xmlSaveToFilename("injected.xml", "UTF-8", 0);
-	xmlSaveDoc(cntx, dom.xml.get());
-	xmlSaveClose(cntx);
+static std::string odt_save(xmlDocPtr xml) {
+	auto buf = xmlBufferCreate();
+	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
+	xmlSaveFileTo(obuf, xml, "UTF-8");
+	std::string data(buf->content, buf->content + buf->use);
+	xmlBufferFree(buf);
+	return data;
+}
 
-	fs::copy("original", "injected.odt");
+// The automatic styles of headers, footers, and master pages live in styles.xml and are just as redundant as those in content.xml
+// Returns an empty string if there was nothing to deduplicate, so the original member can be carried over as-is
+static std::string odt_dedup_styles_xml(std::string_view original) {
+	auto zip = zip_open_buffer(original, "ODT/ODP");
 
-	int e = 0;
-	auto zip = zip_open("injected.odt", 0, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open ODT/ODP file: ", std::to_string(e)));
+	zip_stat_t stat{};
+	if (zip_stat(zip, "styles.xml", 0, &stat) != 0 || stat.size == 0) {
+		zip_close(zip);
+		return {};
 	}
-
-	auto src = zip_source_file(zip, "injected.xml", 0, 0);
-	if (src == nullptr) {
-		throw std::runtime_error("Could not open injected.xml");
+	std::unique_ptr<xmlDoc, decltype(&xmlFreeDoc)> xml(nullptr, &xmlFreeDoc);
+	try {
+		xml.reset(zip_read_xml(zip, stat.index, "styles.xml"));
+	}
+	catch (...) {
+		zip_close(zip);
+		throw;
 	}
+	zip_close(zip);
 
-	if (zip_file_add(zip, "content.xml", src, ZIP_FL_OVERWRITE) < 0) {
-		throw std::runtime_error("Could not replace content.xml");
+	if (!odt_dedup_styles(xml.get())) {
+		return {};
 	}
+	return odt_save(xml.get());
+}
 
-	zip_close(zip);
+std::string inject_odt(DOM& dom, const fs::path& out) {
+	std::map<std::string, std::string> replace{ { "content.xml", odt_save(dom.xml.get()) } };
+	auto styles = odt_dedup_styles_xml(dom.state.original());
+	if (!styles.empty()) {
+		replace["styles.xml"] = std::move(styles);
+	}
 
-	return "injected.odt";
+	return zip_write_replaced(dom.state.original(), out, replace);
 }
 
 }
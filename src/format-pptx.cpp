@@ -17,21 +17,24 @@
 
 #include "shared.hpp"
 #include "formats.hpp"
+#include "format-zip.hpp"
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include <libxml/xmlsave.h>
-#include <unicode/ustring.h>
-#include <unicode/regex.h>
 #include <zip.h>
-#include <deque>
-using namespace icu;
+#include <algorithm>
+#include <array>
+#include <vector>
 
 namespace Transfuse {
 
+using pptx_style = std::array<std::string, 3>;
+
 // Merges sibling a:t elements, except that a:t are never direct siblings - they're contained in a:r elements
 // Very similar to docx_merge_wt(), but PPTX uses b="1", i="1", and child <a:hlinkClick> instead
-void pptx_merge_at(State& state, xmlDocPtr xml) {
+// Runs on one slide at a time from any thread, so the styles are handed back for the caller to store, and the number of a:p found is returned
+static size_t pptx_merge_at(xmlDocPtr xml, std::vector<pptx_style>& styles) {
 	auto ctx = xmlXPathNewContext(xml);
 	if (ctx == nullptr) {
 		throw std::runtime_error("Could not create XPath context");
@@ -50,16 +53,19 @@ void pptx_merge_at(State& state, xmlDocPtr xml) {
 
 	if (xmlXPathNodeSetIsEmpty(rs->nodesetval)) {
 		xmlXPathFreeObject(rs);
-		throw std::runtime_error("XPath found zero a:p elements");
+		xmlXPathFreeContext(ctx);
+		return 0;
 	}
 
-	state.begin();
-
 	xmlString tag;
 	xmlString tmp;
 	xmlString content;
 	auto buf = xmlBufferCreate();
 
+	// Most runs share their properties with many others, so each distinct run is only serialized and handed back once
+	RunStyles seen;
+	std::string encoded;
+
 	// For each paragraph, merge all text nodes but remember if they were bold, italic, or hyperlinks
 	// This creates <tf-text> elements, which will be removed after injection
 	auto ns = rs->nodesetval;
@@ -82,53 +88,65 @@ void pptx_merge_at(State& state, xmlDocPtr xml) {
 			xmlNodeSetContent(node, XC(TF_SENTINEL));
 
 			auto bp = node->parent;
-			xmlBufferEmpty(buf);
-			auto sz = xmlNodeDump(buf, bp->doc, bp, 0, 0);
-			tag.assign(buf->content, buf->content + sz);
-
-			xmlChar_view type{ XC("text") };
-			auto apos = tag.find(XC("a:hlinkClick"));
-			auto bpos = tag.find(XC(" b=\"1\""));
-			auto ipos = tag.find(XC(" i=\"1\""));
-			if (apos != xmlString::npos && bpos != xmlString::npos && ipos != xmlString::npos) {
-				type = XC("a+b+i");
-			}
-			else if (bpos != xmlString::npos && ipos != xmlString::npos) {
-				type = XC("b+i");
-			}
-			else if (apos != xmlString::npos && bpos != xmlString::npos) {
-				type = XC("a+b");
-			}
-			else if (apos != xmlString::npos && ipos != xmlString::npos) {
-				type = XC("a+i");
-			}
-			else if (apos != xmlString::npos) {
-				type = XC("a");
-			}
-			else if (bpos != xmlString::npos) {
-				type = XC("b");
-			}
-			else if (ipos != xmlString::npos) {
-				type = XC("i");
+			auto key = xml_hash_tree(bp, encoded);
+			auto it = seen.find(key);
+			RunStyle style;
+			if (it == seen.end() || it->second.encoded != encoded) {
+				xmlBufferEmpty(buf);
+				auto sz = xmlNodeDump(buf, bp->doc, bp, 0, 0);
+				tag.assign(buf->content, buf->content + sz);
+
+				xmlChar_view type{ XC("text") };
+				auto apos = tag.find(XC("a:hlinkClick"));
+				auto bpos = tag.find(XC(" b=\"1\""));
+				auto ipos = tag.find(XC(" i=\"1\""));
+				if (apos != xmlString::npos && bpos != xmlString::npos && ipos != xmlString::npos) {
+					type = XC("a+b+i");
+				}
+				else if (bpos != xmlString::npos && ipos != xmlString::npos) {
+					type = XC("b+i");
+				}
+				else if (apos != xmlString::npos && bpos != xmlString::npos) {
+					type = XC("a+b");
+				}
+				else if (apos != xmlString::npos && ipos != xmlString::npos) {
+					type = XC("a+i");
+				}
+				else if (apos != xmlString::npos) {
+					type = XC("a");
+				}
+				else if (bpos != xmlString::npos) {
+					type = XC("b");
+				}
+				else if (ipos != xmlString::npos) {
+					type = XC("i");
+				}
+
+				auto s = tag.find(XC(TF_SENTINEL));
+				tmp.assign(tag.begin() + PD(s) + 3, tag.end());
+				tag.erase(s);
+				styles.push_back({ std::string(x2s(type)), std::string(x2s(tag)), std::string(x2s(tmp)) });
+				style.type = type;
+				style.hash = s2x(State::style_hash(styles.back()[1], styles.back()[2]));
+				if (it == seen.end()) {
+					style.encoded = encoded;
+					it = seen.emplace(key, style).first;
+				}
 			}
-
-			auto s = tag.find(XC(TF_SENTINEL));
-			tmp.assign(tag.begin() + PD(s) + 3, tag.end());
-			tag.erase(s);
-			auto hash = state.style(type, tag, tmp);
+			auto& run = (it->second.encoded == encoded) ? it->second : style;
 
 			tmp = XC(TFI_OPEN_B);
-			tmp += type;
+			tmp += run.type;
 			tmp += ':';
-			tmp += hash;
+			tmp += run.hash;
 			tmp += TFI_OPEN_E;
-			tmp += content;
+			append_xml(tmp, content);
 			tmp += TFI_CLOSE;
 
 			if (bp->prev && xmlStrcmp(bp->prev->name, XC("tf-text")) == 0) {
-				content = bp->prev->children->content;
+				assign_xml(content, bp->prev->children->content);
 				content += tmp;
-				xmlNodeSetContent(bp->prev->children, content.c_str());
+				xmlNodeSetContent(bp->prev, content.c_str());
 			}
 			else {
 				auto nn = xmlNewNode(nullptr, XC("tf-text"));
@@ -143,186 +161,194 @@ void pptx_merge_at(State& state, xmlDocPtr xml) {
 	}
 
 	xmlBufferFree(buf);
-	state.commit();
+	auto nps = SZ(ns->nodeNr);
+	xmlXPathFreeObject(rs);
+	xmlXPathFreeContext(ctx);
+	return nps;
 }
 
 std::unique_ptr<DOM> extract_pptx(State& state) {
-	int e = 0;
-	auto zip = zip_open("original", ZIP_RDONLY, &e);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open pptx file: ", std::to_string(e)));
-	}
+	using zip_ptr = std::unique_ptr<zip_t, decltype(&zip_discard)>;
+	auto original = state.original();
+	auto open_zip = [&]() {
+		return zip_ptr(zip_open_buffer(original, "pptx"), &zip_discard);
+	};
+
+	std::vector<zip_ptr> zips;
+	zips.push_back(open_zip());
 
-	std::string data{"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<tf-slides>"};
-	std::string slide;
+	std::vector<std::string> names;
+	std::vector<zip_uint64_t> indices;
 	for (int i = 1; ; ++i) {
 		char buffer[64]{};
 		sprintf(buffer, "ppt/slides/slide%d.xml", i);
 
 		zip_stat_t stat{};
-		if (zip_stat(zip, buffer, 0, &stat) != 0) {
+		if (zip_stat(zips[0].get(), buffer, 0, &stat) != 0) {
 			// No more slides
 			break;
 		}
 		if (stat.size == 0) {
 			throw std::runtime_error(concat("Empty pptx slide ", buffer));
 		}
-
-		auto zf = zip_fopen_index(zip, stat.index, 0);
-		if (zf == nullptr) {
-			throw std::runtime_error(concat("Could not open pptx ", buffer));
-		}
-
-		slide.resize(stat.size, 0);
-		zip_fread(zf, &slide[0], stat.size);
-		zip_fclose(zf);
-
-		auto xs = slide.find("?>\r\n");
-		if (xs != std::string::npos) {
-			data.append(slide, xs + 4, std::string::npos);
-		}
-		else {
-			xs = slide.find("?>\n");
-			data.append(slide, xs + 3, std::string::npos);
-		}
+		names.emplace_back(buffer);
+		indices.push_back(stat.index);
 	}
-	data += "</tf-slides>";
 
-	zip_close(zip);
-
-	auto udata = UnicodeString::fromUTF8(data);
+	// Wipe chaff that's not relevant when translated, or simply superfluous
+	static const ChaffAttrs chaff{
+		{ "", "lang", "" },
+	};
+	auto pred = [](xmlNodePtr node) {
+		return xml_is_bare(node, "a", "rPr");
+	};
+
+	// Slides are independent of each other, so each is cleaned, merged, and styled on its own, with the results stitched together in order afterwards
+	// Block IDs are only assigned once the stitched document is extracted, so they come out the same no matter which thread did what
+	auto n = names.size();
+	std::vector<std::unique_ptr<xmlDoc, decltype(&xmlFreeDoc)>> slides;
+	for (size_t i = 0; i < n; ++i) {
+		slides.emplace_back(nullptr, &xmlFreeDoc);
+	}
+	std::vector<std::vector<pptx_style>> styles(n);
+	std::vector<size_t> paras(n);
+	std::string stream{ state.stream() };
+	while (zips.size() < doc_threads(n)) {
+		zips.emplace_back(nullptr, &zip_discard);
+	}
 
-	udata.findAndReplace(" encoding=\"UTF-8\"", " encoding=\"UTF-16\"");
+	parallel_for(n, [&](size_t t, size_t i) {
+		if (!zips[t]) {
+			zips[t] = open_zip();
+		}
 
-	// Wipe chaff that's not relevant when translated, or simply superfluous
-	UnicodeString tmp;
-	UErrorCode status = U_ZERO_ERROR;
+		auto slide = zip_read_xml(zips[t].get(), indices[i], names[i].c_str(), chaff);
+		DOM dom(state, slide, stream);
+		auto root = reinterpret_cast<xmlNodePtr>(slide);
+		xml_remove_if(root, pred);
+		xml_merge_text_siblings(root, "a", "t");
+		paras[i] = pptx_merge_at(slide, styles[i]);
 
-	RegexMatcher rx_lang(R"X( lang="[^"]*")X", 0, status);
-	rx_lang.reset(udata);
-	tmp = rx_lang.replaceAll("", status);
-	std::swap(udata, tmp);
+		dom.tags_parents_allow = make_xmlChars("tf-text", "a:t");
+		dom.save_spaces();
 
-	udata.findAndReplace("<a:rPr/>", "");
+		xml_cleanup_tf_text(root);
 
-	RegexMatcher rx_wt(R"X(</a:t>([^<>]+?)<a:t(?=[ >])[^>]*>)X", 0, status);
-	rx_wt.reset(udata);
-	tmp = rx_wt.replaceAll("", status);
-	std::swap(udata, tmp);
+		// Hand the slide over from the DOM, as it is moved into the stitched document below
+		slides[i].reset(dom.xml.release());
+	});
+	zips.clear();
 
-	auto xml = xmlReadMemory(reinterpret_cast<const char*>(udata.getTerminatedBuffer()), SI(SZ(udata.length()) * sizeof(UChar)), "slides.xml", utf16_native, XML_PARSE_RECOVER | XML_PARSE_NONET);
-	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse slides.xml: ", xmlLastError.message));
+	if (std::all_of(paras.begin(), paras.end(), [](size_t p) { return p == 0; })) {
+		throw std::runtime_error("XPath found zero a:p elements");
 	}
-	udata.remove();
-	tmp.remove();
 
-	pptx_merge_at(state, xml);
+	state.begin();
+	for (auto& ss : styles) {
+		for (auto& st : ss) {
+			state.style(st[0], st[1], st[2]);
+		}
+	}
+	state.commit();
 
+	// Move each slide's root element into the stitched document, rather than serializing the slides and parsing them all again
+	auto xml = xmlNewDoc(XC("1.0"));
 	auto dom = std::make_unique<DOM>(state, xml);
-	dom->tags_parents_allow = make_xmlChars("tf-text", "a:t");
-	dom->save_spaces();
-
-	auto buf = xmlBufferCreate();
-	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
-	xmlSaveFileTo(obuf, xml, "UTF-8");
-	data.assign(buf->content, buf->content + buf->use);
-	xmlBufferFree(buf);
-	cleanup_styles(data);
-
-	auto b = data.rfind("</tf-text><tf-text>");
-	while (b != std::string::npos) {
-		data.erase(b, 19);
-		b = data.rfind("</tf-text><tf-text>");
+	auto tf_slides = xmlNewDocNode(xml, nullptr, XC("tf-slides"), nullptr);
+	xmlDocSetRootElement(xml, tf_slides);
+	for (auto& slide : slides) {
+		auto sroot = xmlDocGetRootElement(slide.get());
+		xmlUnlinkNode(sroot);
+		if (xmlDOMWrapAdoptNode(nullptr, slide.get(), sroot, xml, tf_slides, 0) != 0) {
+			xmlFreeNode(sroot);
+			throw std::runtime_error("Could not move slide into stitched document");
+		}
+		xmlAddChild(tf_slides, sroot);
+		slide.reset();
 	}
 
-	dom->xml.reset(xmlReadMemory(reinterpret_cast<const char*>(data.data()), SI(data.size()), "styled.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET));
-	if (dom->xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlLastError.message));
+	if (!state.transient) {
+		auto cntx = xmlSaveToFilename((state.tmpdir / "styled.xml").string().c_str(), "UTF-8", 0);
+		xmlSaveDoc(cntx, xml);
+		xmlSaveClose(cntx);
 	}
-	file_save("styled.xml", data);
 
+	dom->tags_parents_allow = make_xmlChars("tf-text", "a:t");
 	return dom;
 }
 
-std::string inject_pptx(DOM& dom) {
-	auto buf = xmlBufferCreate();
-	auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
-	xmlSaveFileTo(obuf, dom.xml.get(), "UTF-8");
-	std::string data(buf->content, buf->content + buf->use);
-	xmlBufferFree(buf);
+// Moves text from after </a:t></a:r> inside it
+static void pptx_move_trailing_chars(xmlNodePtr node, std::vector<xmlNodePtr>& chars) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		pptx_move_trailing_chars(child, chars);
+		if (!xml_is(child, "a", "r") || !child->last || !xml_is(child->last, "a", "t") || !child->last->children || !xml_chars_after(child, chars)) {
+			continue;
+		}
+		for (auto c : chars) {
+			xmlUnlinkNode(c);
+			xmlAddChild(child->last, c);
+		}
+	}
+}
 
-	auto udata = UnicodeString::fromUTF8(data);
-	UnicodeString tmp;
-	UErrorCode status = U_ZERO_ERROR;
+// pptx can't have any text outside a:t
+// These passes used to be regexes over the serialized slide, and are done in the same order so the output is the same
+static void pptx_fix_text(xmlNodePtr sld) {
+	std::vector<xmlNodePtr> chars;
 
-	// pptx can't have any text outside a:t
 	// Move text from after </a:t></a:r> inside it
-	RegexMatcher rx_after_r(R"X((</a:t></a:r>)([^<>]+))X", 0, status);
-	rx_after_r.reset(udata);
-	tmp = rx_after_r.replaceAll("$2$1", status);
-	std::swap(udata, tmp);
+	pptx_move_trailing_chars(sld, chars);
 
 	// Move text from before <a:r><a:t> inside it
-	RegexMatcher rx_before_r(R"X(([^<>]+)(<a:r(?=[ >][^>]*>).*?<a:t(?=[ >])[^>]*>))X", 0, status);
-	rx_before_r.reset(udata);
-	tmp = rx_before_r.replaceAll("$2$1", status);
-	std::swap(udata, tmp);
+	xml_move_leading_chars(sld, "a", "r", { "t" });
 
 	// Remove empty text elements
-	RegexMatcher rx_snip_empty(R"X(<a:r><a:t/></a:r>)X", 0, status);
-	rx_snip_empty.reset(udata);
-	tmp = rx_snip_empty.replaceAll("", status);
-	std::swap(udata, tmp);
+	xml_remove_empty_runs(sld, "a");
 
 	// Remove the <tf-text> helper elements that we added
-	RegexMatcher rx_snip_tf(R"X(</?tf-text>)X", 0, status);
-	rx_snip_tf.reset(udata);
-	tmp = rx_snip_tf.replaceAll("", status);
-	std::swap(udata, tmp);
+	xml_unwrap_tf_text(sld);
+}
 
-	data.clear();
-	udata.toUTF8String(data);
-	file_save("injected.xml", data);
+std::string inject_pptx(DOM& dom, const fs::path& out) {
+	// Each <p:sld> under the <tf-slides> root goes back to its own slide file, and those can be fixed up independently
+	std::vector<xmlNodePtr> slds;
+	for (auto sld = xmlDocGetRootElement(dom.xml.get())->children; sld; sld = sld->next) {
+		if (sld->type == XML_ELEMENT_NODE) {
+			slds.push_back(sld);
+		}
+	}
 
-	fs::copy("original", "injected.pptx");
+	parallel_for(slds.size(), [&](size_t, size_t i) {
+		pptx_fix_text(slds[i]);
+	});
 
-	int er = 0;
-	auto zip = zip_open("injected.pptx", 0, &er);
-	if (zip == nullptr) {
-		throw std::runtime_error(concat("Could not open pptx file: ", std::to_string(er)));
+	std::vector<std::string> datas;
+	auto buf = xmlBufferCreate();
+	for (auto sld : slds) {
+		xmlBufferEmpty(buf);
+		auto obuf = xmlOutputBufferCreateBuffer(buf, nullptr);
+		xmlNodeDumpOutput(obuf, dom.xml.get(), sld, 0, 0, "UTF-8");
+		xmlOutputBufferClose(obuf);
+		datas.emplace_back(buf->content, buf->content + buf->use);
 	}
+	xmlBufferFree(buf);
 
-	std::deque<std::string> slides;
-	size_t b = data.find("<p:sld ");
-	size_t e = data.find("</p:sld>", b);
-	int i = 0;
-	while (b != std::string::npos) {
-		++i;
+	std::map<std::string, std::string> slides;
+	for (size_t i = 0; i < datas.size(); ++i) {
 		char buffer[64]{};
-		sprintf(buffer, "ppt/slides/slide%d.xml", i);
+		sprintf(buffer, "ppt/slides/slide%zu.xml", i + 1);
 
-		slides.resize(slides.size() + 1);
-		auto& slide = slides.back();
+		auto& slide = slides[buffer];
 		slide = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n";
-		slide.append(data, b, (e - b) + 8);
-
-		auto src = zip_source_buffer(zip, slide.c_str(), slide.size(), 0);
-		if (src == nullptr) {
-			throw std::runtime_error(concat("Could not create buffer for ", buffer));
-		}
-
-		if (zip_file_add(zip, buffer, src, ZIP_FL_OVERWRITE) < 0) {
-			throw std::runtime_error(concat("Could not replace ", buffer));
-		}
-
-		b = data.find("<p:sld ", e);
-		e = data.find("</p:sld>", b);
+		slide += datas[i];
+		datas[i].clear();
+		datas[i].shrink_to_fit();
 	}
 
-	zip_close(zip);
-
-	return "injected.pptx";
+	return zip_write_replaced(dom.state.original(), out, slides);
 }
 
 }
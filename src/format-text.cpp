@@ -22,33 +22,63 @@ using namespace icu;
 namespace Transfuse {
 
 std::unique_ptr<DOM> extract_text(State& state, bool by_line) {
-	auto raw_data = file_load("original");
-	auto enc = detect_encoding(raw_data);
+	auto text = to_utf8(std::string(state.original()));
 
-	auto data = std::make_unique<UnicodeString>(to_ustring(raw_data, enc));
-	data->findAndReplace("&", "&amp;");
-	data->findAndReplace("<", "&lt;");
-	data->findAndReplace(">", "&gt;");
-	data->findAndReplace("\"", "&quot;");
-	data->findAndReplace("'", "&apos;");
-
-	UErrorCode status = U_ZERO_ERROR;
-	RegexMatcher rx_multiline(UnicodeString::fromUTF8(R"X(\n[\s\p{Zs}]*(\n[\s\p{Zs}]*)+)X"), 0, status);
-	rx_multiline.reset(*data);
-	*data = rx_multiline.replaceAll(UnicodeString::fromUTF8("</p><p>"), status);
-
-	if (by_line) data->findAndReplace("\n", "</p><p>");
-	else data->findAndReplace("\n", "<br>\n");
-	data->findAndReplace("</p><p>", "</p>\n<p>");
-
-	data->insert(0, "<!DOCTYPE html>\n<html><head><meta charset=\"UTF-16\"></head><body><p>");
-	data->append("</p></body></html>");
+	// Escape, and turn runs of blank lines into paragraph breaks and other newlines into line breaks, in one pass over the UTF-8
+	// A run is the longest stretch of [\s\p{Zs}] starting at a newline, and is a paragraph break if it has at least 2 newlines
+	std::string data{ "<!DOCTYPE html>\n<html><head><meta charset=\"UTF-8\"></head><body><p>" };
+	data.reserve(data.size() + text.size() + text.size() / 8 + 20);
+	int32_t i = 0;
+	while (i < SI32(text.size())) {
+		auto c = text[SZ(i)];
+		switch (c) {
+		case '&':
+			data += "&amp;";
+			break;
+		case '<':
+			data += "&lt;";
+			break;
+		case '>':
+			data += "&gt;";
+			break;
+		case '"':
+			data += "&quot;";
+			break;
+		case '\'':
+			data += "&apos;";
+			break;
+		case '\n': {
+			size_t nls = 0;
+			auto e = i;
+			for (auto j = i; j < SI32(text.size());) {
+				auto cp = next_cp(text, j);
+				if (!is_space_cp(cp)) {
+					break;
+				}
+				nls += (cp == '\n');
+				e = j;
+			}
+			if (nls >= 2) {
+				data += "</p>\n<p>";
+				i = e;
+				continue;
+			}
+			data += by_line ? "</p>\n<p>" : "<br>\n";
+			break;
+		}
+		default:
+			data += c;
+			break;
+		}
+		++i;
+	}
+	data += "</p></body></html>";
 
 	return extract_html(state, std::move(data));
 }
 
 std::string inject_text(DOM& dom, bool by_line) {
-	auto txt = file_load(inject_html(dom));
+	auto txt = inject_html(dom);
 
 	auto e = txt.find("</p></body>");
 	txt.erase(e);
@@ -67,9 +97,7 @@ std::string inject_text(DOM& dom, bool by_line) {
 	replace_all("&apos;", "'", txt, tmp);
 	replace_all("&amp;", "&", txt, tmp);
 
-	file_save("injected.txt", txt);
-
-	return "injected.txt";
+	return txt;
 }
 
 }
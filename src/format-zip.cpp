@@ -0,0 +1,561 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "format-zip.hpp"
+#include "shared.hpp"
+#include "dom.hpp"
+#include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <libxml/SAX2.h>
+#include <xxhash.h>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+namespace Transfuse {
+
+struct ChaffFilter {
+	const ChaffAttrs& chaff;
+	std::vector<const xmlChar*> attrs;
+};
+
+inline bool is_chaff(const ChaffAttrs& chaff, const xmlChar** attr) {
+	// Each SAX2 attribute is localname, prefix, URI, value, value end
+	auto name = reinterpret_cast<const char*>(attr[0]);
+	auto prefix = attr[1] ? reinterpret_cast<const char*>(attr[1]) : "";
+	std::string_view value(reinterpret_cast<const char*>(attr[3]), SZ(attr[4] - attr[3]));
+	for (auto& c : chaff) {
+		if (c.name == name && c.prefix == prefix && (c.value.empty() || c.value == value)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void chaff_start_element(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces, int nb_attributes, int nb_defaulted, const xmlChar** attributes) {
+	auto ctxt = static_cast<xmlParserCtxtPtr>(ctx);
+	auto& filter = *static_cast<ChaffFilter*>(ctxt->_private);
+
+	filter.attrs.clear();
+	int kept = 0;
+	int kept_defaulted = 0;
+	for (int i = 0; i < nb_attributes; ++i) {
+		auto attr = attributes + i * 5;
+		if (is_chaff(filter.chaff, attr)) {
+			continue;
+		}
+		filter.attrs.insert(filter.attrs.end(), attr, attr + 5);
+		++kept;
+		// Defaulted attributes are always at the end
+		if (i >= nb_attributes - nb_defaulted) {
+			++kept_defaulted;
+		}
+	}
+
+	xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces, namespaces, kept, kept_defaulted, filter.attrs.data());
+}
+
+xmlDocPtr zip_read_xml(zip_t* zip, zip_uint64_t index, const char* name, const ChaffAttrs& chaff) {
+	Profile::Timer timer("zip.read_xml");
+	auto zf = zip_fopen_index(zip, index, 0);
+	if (zf == nullptr) {
+		throw std::runtime_error(concat("Could not open ", name));
+	}
+
+	xmlSAXHandler sax{};
+	xmlSAXVersion(&sax, 2);
+	ChaffFilter filter{ chaff, {} };
+	if (!chaff.empty()) {
+		sax.startElementNs = chaff_start_element;
+	}
+
+	auto ctxt = xmlCreatePushParserCtxt(&sax, nullptr, nullptr, 0, name);
+	if (ctxt == nullptr) {
+		zip_fclose(zf);
+		throw std::runtime_error(concat("Could not create XML parser for ", name));
+	}
+	ctxt->_private = &filter;
+	xmlCtxtUseOptions(ctxt, XML_PARSE_RECOVER | XML_PARSE_NONET);
+
+	std::array<char, 64 * 1024> buf;
+	zip_int64_t n = 0;
+	while ((n = zip_fread(zf, buf.data(), buf.size())) > 0) {
+		xmlParseChunk(ctxt, buf.data(), SI(n), 0);
+	}
+	zip_fclose(zf);
+	xmlParseChunk(ctxt, nullptr, 0, 1);
+
+	auto xml = ctxt->myDoc;
+	ctxt->myDoc = nullptr;
+	xmlFreeParserCtxt(ctxt);
+
+	if (n < 0) {
+		xmlFreeDoc(xml);
+		throw std::runtime_error(concat("Could not read ", name));
+	}
+	if (xml == nullptr) {
+		throw std::runtime_error(concat("Could not parse ", name, ": ", xml_error_message()));
+	}
+	return xml;
+}
+
+zip_t* zip_open_buffer(std::string_view data, std::string_view what) {
+	zip_error_t ze;
+	zip_error_init(&ze);
+	auto zs = zip_source_buffer_create(data.data(), data.size(), 0, &ze);
+	zip_t* zip = nullptr;
+	if (zs) {
+		zip = zip_open_from_source(zs, ZIP_RDONLY, &ze);
+		if (zip == nullptr) {
+			zip_source_free(zs);
+		}
+	}
+	if (zip == nullptr) {
+		auto msg = concat("Could not open ", what, " file: ", zip_error_strerror(&ze));
+		zip_error_fini(&ze);
+		throw std::runtime_error(msg);
+	}
+	zip_error_fini(&ze);
+	return zip;
+}
+
+std::string zip_write_replaced(std::string_view original, const fs::path& target, const std::map<std::string, std::string>& replace) {
+	Profile::Timer timer("zip.write");
+	auto src = zip_open_buffer(original, "zip");
+
+	zip_t* dst = nullptr;
+	// Kept alive past zip_close(), so the written archive can be read back out of it
+	zip_source_t* mem = nullptr;
+	if (target.empty()) {
+		zip_error_t ze;
+		zip_error_init(&ze);
+		mem = zip_source_buffer_create(nullptr, 0, 0, &ze);
+		if (mem) {
+			zip_source_keep(mem);
+			dst = zip_open_from_source(mem, ZIP_TRUNCATE, &ze);
+		}
+		if (dst == nullptr) {
+			auto msg = concat("Could not create zip file in memory: ", zip_error_strerror(&ze));
+			zip_error_fini(&ze);
+			zip_source_free(mem);
+			zip_source_free(mem);
+			zip_discard(src);
+			throw std::runtime_error(msg);
+		}
+		zip_error_fini(&ze);
+	}
+	else {
+		int e = 0;
+		dst = zip_open(target.string().c_str(), ZIP_CREATE | ZIP_TRUNCATE, &e);
+		if (dst == nullptr) {
+			zip_discard(src);
+			throw std::runtime_error(concat("Could not create ", target.string(), ": ", std::to_string(e)));
+		}
+	}
+
+	auto fail = [&](std::string_view what) {
+		auto msg = concat(what, ": ", zip_strerror(dst));
+		zip_discard(dst);
+		zip_discard(src);
+		zip_source_free(mem);
+		throw std::runtime_error(msg);
+	};
+
+	auto add_buffer = [&](const std::string& name, const std::string& data) {
+		auto zs = zip_source_buffer(dst, data.data(), data.size(), 0);
+		if (zs == nullptr) {
+			fail(concat("Could not create buffer for ", name));
+		}
+		if (zip_file_add(dst, name.c_str(), zs, ZIP_FL_ENC_GUESS) < 0) {
+			zip_source_free(zs);
+			fail(concat("Could not add ", name));
+		}
+	};
+
+	size_t replaced = 0;
+	auto n = zip_get_num_entries(src, 0);
+	for (zip_int64_t i = 0; i < n; ++i) {
+		auto idx = static_cast<zip_uint64_t>(i);
+		std::string name{ zip_get_name(src, idx, 0) };
+
+		auto it = replace.find(name);
+		if (it != replace.end()) {
+			add_buffer(name, it->second);
+			++replaced;
+			continue;
+		}
+
+		auto zs = zip_source_zip(dst, src, idx, ZIP_FL_COMPRESSED, 0, -1);
+		if (zs == nullptr) {
+			fail(concat("Could not read ", name));
+		}
+		if (zip_file_add(dst, name.c_str(), zs, ZIP_FL_ENC_GUESS) < 0) {
+			zip_source_free(zs);
+			fail(concat("Could not copy ", name));
+		}
+	}
+
+	if (replaced != replace.size()) {
+		for (auto& it : replace) {
+			if (zip_name_locate(src, it.first.c_str(), 0) < 0) {
+				add_buffer(it.first, it.second);
+			}
+		}
+	}
+
+	// The source must stay open until the destination has been written, as it reads from it
+	if (zip_close(dst) != 0) {
+		fail(concat("Could not write ", target.empty() ? "zip file in memory" : target.string()));
+	}
+	zip_discard(src);
+
+	std::string rv;
+	if (mem) {
+		zip_stat_t stat{};
+		bool ok = (zip_source_stat(mem, &stat) == 0 && zip_source_open(mem) == 0);
+		if (ok) {
+			rv.resize(SZ(stat.size));
+			ok = (zip_source_read(mem, &rv[0], stat.size) == static_cast<zip_int64_t>(stat.size));
+			zip_source_close(mem);
+		}
+		zip_source_free(mem);
+		if (!ok) {
+			throw std::runtime_error("Could not read back zip file written in memory");
+		}
+	}
+	return rv;
+}
+
+void xml_merge_text_siblings(xmlNodePtr node, const char* prefix, const char* name) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		if (!xml_is(child, prefix, name)) {
+			xml_merge_text_siblings(child, prefix, name);
+			continue;
+		}
+
+		// The text in between must be non-empty and the first element must have had a separate closing tag
+		while (child->children && child->next && child->next->type == XML_TEXT_NODE && child->next->content && child->next->content[0] && child->next->next && xml_is(child->next->next, prefix, name)) {
+			auto text = child->next;
+			auto other = text->next;
+			xmlUnlinkNode(text);
+			xmlFreeNode(text);
+			while (auto c = other->children) {
+				xmlUnlinkNode(c);
+				xmlAddChild(child, c);
+			}
+			xmlUnlinkNode(other);
+			xmlFreeNode(other);
+		}
+	}
+}
+
+// Strings are NUL-terminated and every node is its type byte up to a closing ')', so distinct trees never encode the same
+static void append_field(std::string& buf, const xmlChar* s) {
+	if (s) {
+		buf += reinterpret_cast<const char*>(s);
+	}
+	buf += '\0';
+}
+
+static void encode_tree(std::string& buf, xmlNodePtr node, xmlAttrPtr skip = nullptr) {
+	buf += static_cast<char>(node->type);
+	append_field(buf, node->name);
+	if (node->type == XML_ELEMENT_NODE || node->type == XML_ATTRIBUTE_NODE) {
+		append_field(buf, node->ns ? node->ns->prefix : nullptr);
+	}
+	if (node->type == XML_ELEMENT_NODE) {
+		for (auto ns = node->nsDef; ns; ns = ns->next) {
+			buf += 'N';
+			append_field(buf, ns->prefix);
+			append_field(buf, ns->href);
+		}
+		for (auto a = node->properties; a; a = a->next) {
+			if (a != skip) {
+				encode_tree(buf, reinterpret_cast<xmlNodePtr>(a));
+			}
+		}
+	}
+	else if (node->type != XML_ATTRIBUTE_NODE) {
+		append_field(buf, node->content);
+	}
+	for (auto c = node->children; c; c = c->next) {
+		encode_tree(buf, c);
+	}
+	buf += ')';
+}
+
+uint64_t xml_hash_tree(xmlNodePtr node, std::string& buf) {
+	buf.clear();
+	encode_tree(buf, node);
+	return static_cast<uint64_t>(XXH64(buf.data(), buf.size(), 0));
+}
+
+void xml_encode_tree(std::string& buf, xmlNodePtr node, xmlAttrPtr skip) {
+	buf.clear();
+	encode_tree(buf, node, skip);
+}
+
+static bool serializes_empty(xmlNodePtr node) {
+	return node->type == XML_TEXT_NODE && (node->content == nullptr || node->content[0] == 0);
+}
+
+bool xml_chars_before(xmlNodePtr node, std::vector<xmlNodePtr>& chars, xmlNodePtr stop) {
+	chars.clear();
+	bool any = false;
+	for (auto c = node->prev; c && c != stop && xml_is_chars(c); c = c->prev) {
+		chars.push_back(c);
+		any = any || !serializes_empty(c);
+	}
+	std::reverse(chars.begin(), chars.end());
+	return any;
+}
+
+bool xml_chars_after(xmlNodePtr node, std::vector<xmlNodePtr>& chars) {
+	chars.clear();
+	bool any = false;
+	for (auto c = node->next; c && xml_is_chars(c); c = c->next) {
+		chars.push_back(c);
+		any = any || !serializes_empty(c);
+	}
+	return any;
+}
+
+// Whether the string has a character that . does not match without UREGEX_DOTALL
+// Carriage returns in text are serialized as &#13; so only count elsewhere
+static bool has_line_break(const xmlChar* s, bool cr) {
+	for (; s && *s; ++s) {
+		if (*s == '\n' || *s == '\x0b' || *s == '\x0c' || (cr && *s == '\r')) {
+			return true;
+		}
+		// U+0085 and U+2028 / U+2029
+		if ((s[0] == 0xC2 && s[1] == 0x85) || (s[0] == 0xE2 && s[1] == 0x80 && (s[2] == 0xA8 || s[2] == 0xA9))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The next node in document order within root, only descending into elements
+static xmlNodePtr next_in_order(xmlNodePtr node, xmlNodePtr root) {
+	if (node->type == XML_ELEMENT_NODE && node->children) {
+		return node->children;
+	}
+	for (; node && node != root; node = node->parent) {
+		if (node->next) {
+			return node->next;
+		}
+	}
+	return nullptr;
+}
+
+// Finds the first <prefix:name> with a start tag after the node's own start tag, in document order without leaving root
+// Gives up at the first line break between the two, and then sets stop to the node that had it, or to null if the search hit the end
+static xmlNodePtr next_start_tag(xmlNodePtr node, const char* prefix, const char* name, xmlNodePtr root, xmlNodePtr& stop) {
+	for (auto n = next_in_order(node, root); n; n = next_in_order(n, root)) {
+		if (n->type == XML_ELEMENT_NODE) {
+			if (xml_is(n, prefix, name) && xml_has_start_tag(n)) {
+				return n;
+			}
+			// Attribute values escape \n and \r, but not the other line breaks
+			for (auto a = n->properties; a; a = a->next) {
+				for (auto v = a->children; v; v = v->next) {
+					if (has_line_break(v->content, false)) {
+						stop = n;
+						return nullptr;
+					}
+				}
+			}
+		}
+		else if (n->type != XML_ENTITY_REF_NODE && has_line_break(n->content, n->type != XML_TEXT_NODE)) {
+			stop = n;
+			return nullptr;
+		}
+	}
+	stop = nullptr;
+	return nullptr;
+}
+
+// Links the node in before or after a sibling without xmlAddPrevSibling()'s merging of adjacent text
+static void link_before(xmlNodePtr at, xmlNodePtr node) {
+	node->parent = at->parent;
+	node->prev = at->prev;
+	node->next = at;
+	if (at->prev) {
+		at->prev->next = node;
+	}
+	else {
+		at->parent->children = node;
+	}
+	at->prev = node;
+}
+
+static void link_after(xmlNodePtr at, xmlNodePtr node) {
+	node->parent = at->parent;
+	node->prev = at;
+	node->next = at->next;
+	if (at->next) {
+		at->next->prev = node;
+	}
+	else {
+		at->parent->last = node;
+	}
+	at->next = node;
+}
+
+void xml_move_leading_chars(xmlNodePtr root, const char* prefix, const char* lead, std::initializer_list<const char*> path) {
+	std::vector<xmlNodePtr> chars;
+	// A match runs up to the end of the target's start tag, and the next one can only start after that
+	xmlNodePtr consumed = nullptr;
+	// Text that was moved is not part of the text before a later lead, since the regex only ever saw the original
+	// So moved nodes are kept apart from their new neighbours, and the last one fences off the text before it
+	xmlNodePtr fence = nullptr;
+	// A failed search fails the same way for every lead before where it stopped, so those are not searched again
+	xmlNodePtr stop = nullptr;
+	for (auto n = root; n; n = next_in_order(n, root)) {
+		if (n == consumed) {
+			consumed = nullptr;
+			continue;
+		}
+		if (n == stop) {
+			stop = nullptr;
+		}
+		if (consumed || stop || n->type != XML_ELEMENT_NODE || !xml_is(n, prefix, lead) || !xml_has_start_tag(n)) {
+			continue;
+		}
+		if (!xml_chars_before(n, chars, fence)) {
+			continue;
+		}
+
+		auto target = n;
+		for (auto p : path) {
+			target = next_start_tag(target, prefix, p, root, stop);
+			if (target == nullptr) {
+				break;
+			}
+		}
+		if (target == nullptr) {
+			if (stop == nullptr) {
+				return;
+			}
+			continue;
+		}
+
+		for (auto c : chars) {
+			xmlUnlinkNode(c);
+		}
+		// A self-closed target with attributes still matched, so then the text ends up right after it
+		if (auto first = target->children) {
+			for (auto c : chars) {
+				link_before(first, c);
+			}
+		}
+		else {
+			auto at = target;
+			for (auto c : chars) {
+				link_after(at, c);
+				at = c;
+			}
+		}
+		consumed = target;
+		fence = chars.back();
+	}
+}
+
+void xml_remove_empty_runs(xmlNodePtr node, const char* prefix) {
+	for (auto child = node->children; child; ) {
+		auto next = child->next;
+		if (child->type == XML_ELEMENT_NODE) {
+			auto t = child->children;
+			if (xml_is(child, prefix, "r") && !child->properties && !child->nsDef && t && t == child->last && xml_is_bare(t, prefix, "t") && !t->nsDef) {
+				xmlUnlinkNode(child);
+				xmlFreeNode(child);
+			}
+			else {
+				xml_remove_empty_runs(child, prefix);
+			}
+		}
+		child = next;
+	}
+}
+
+// Same as erasing <tf-text> and </tf-text> from the serialized form, except that empty <tf-text/> are also dropped
+void xml_unwrap_tf_text(xmlNodePtr node) {
+	for (auto child = node->children; child; ) {
+		auto next = child->next;
+		if (child->type == XML_ELEMENT_NODE) {
+			xml_unwrap_tf_text(child);
+			if (xml_is(child, nullptr, "tf-text") && child->properties == nullptr) {
+				while (auto c = child->children) {
+					xmlUnlinkNode(c);
+					xmlAddPrevSibling(child, c);
+				}
+				xmlUnlinkNode(child);
+				xmlFreeNode(child);
+			}
+		}
+		child = next;
+	}
+}
+
+static void cleanup_text_nodes(xmlNodePtr node, std::string& buf) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type == XML_ELEMENT_NODE) {
+			cleanup_text_nodes(child, buf);
+		}
+		else if (child->type == XML_TEXT_NODE && child->content && (xmlStrstr(child->content, XC(TFI_OPEN_B)) || xmlStrstr(child->content, XC(TFI_CLOSE)))) {
+			buf = reinterpret_cast<const char*>(child->content);
+			cleanup_styles(buf);
+			xmlNodeSetContent(child, XC(buf.c_str()));
+		}
+	}
+}
+
+// Same conditions as erasing "</tf-text><tf-text>" from the serialized form: both must have had content, and the second no attributes
+static void merge_tf_text(xmlNodePtr node) {
+	for (auto child = node->children; child; child = child->next) {
+		if (child->type != XML_ELEMENT_NODE) {
+			continue;
+		}
+		if (!xml_is(child, nullptr, "tf-text")) {
+			merge_tf_text(child);
+			continue;
+		}
+
+		while (child->children && child->next && xml_is(child->next, nullptr, "tf-text") && child->next->children && child->next->properties == nullptr) {
+			auto other = child->next;
+			while (auto c = other->children) {
+				xmlUnlinkNode(c);
+				xmlAddChild(child, c);
+			}
+			xmlUnlinkNode(other);
+			xmlFreeNode(other);
+		}
+	}
+}
+
+void xml_cleanup_tf_text(xmlNodePtr node) {
+	Profile::Timer timer("xml.cleanup_tf_text");
+	std::string buf;
+	cleanup_text_nodes(node, buf);
+	merge_tf_text(node);
+}
+
+}
@@ -0,0 +1,139 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+#ifndef e5bd51be_FORMAT_ZIP_HPP_
+#define e5bd51be_FORMAT_ZIP_HPP_
+
+#include "string_view.hpp"
+#include "filesystem.hpp"
+#include "xml.hpp"
+#include <libxml/tree.h>
+#include <zip.h>
+#include <initializer_list>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <vector>
+
+// Helpers shared by the zip based formats (DOCX, PPTX, ODT)
+
+namespace Transfuse {
+
+// An attribute that is dropped while parsing, before it ever becomes part of the tree
+struct ChaffAttr {
+	std::string_view prefix; // Empty for unprefixed attributes
+	std::string_view name;
+	std::string_view value; // If empty, any value matches
+};
+using ChaffAttrs = std::vector<ChaffAttr>;
+
+// Inflates a zip member in chunks straight into a libxml2 push parser, so the whole member never exists as one string
+xmlDocPtr zip_read_xml(zip_t* zip, zip_uint64_t index, const char* name, const ChaffAttrs& chaff = {});
+
+// Opens a zip file that is already in memory, such as State::original(), without reading it again; the data must outlive the handle
+zip_t* zip_open_buffer(std::string_view data, std::string_view what);
+
+// Writes a copy of the zip file original to target, with the named members replaced by the given contents
+// Untouched members are carried over still compressed, so only the replaced parts are ever deflated
+// If target is empty, the copy is built in memory and returned instead; otherwise an empty string is returned
+std::string zip_write_replaced(std::string_view original, const fs::path& target, const std::map<std::string, std::string>& replace);
+
+inline bool xml_is(xmlNodePtr node, const char* prefix, const char* name) {
+	if (node->type != XML_ELEMENT_NODE || xmlStrcmp(node->name, XC(name)) != 0) {
+		return false;
+	}
+	if (node->ns == nullptr || node->ns->prefix == nullptr) {
+		return prefix == nullptr;
+	}
+	return prefix && xmlStrcmp(node->ns->prefix, XC(prefix)) == 0;
+}
+
+// Whether the element is exactly <prefix:name/>, with neither attributes nor children
+inline bool xml_is_bare(xmlNodePtr node, const char* prefix, const char* name) {
+	return xml_is(node, prefix, name) && node->properties == nullptr && node->children == nullptr;
+}
+
+// Removes all elements for which the predicate returns true, visiting children before their parent
+template<typename Pred>
+inline void xml_remove_if(xmlNodePtr node, Pred& pred) {
+	for (auto child = node->children; child; ) {
+		auto next = child->next;
+		if (child->type == XML_ELEMENT_NODE) {
+			xml_remove_if(child, pred);
+			if (pred(child)) {
+				xmlUnlinkNode(child);
+				xmlFreeNode(child);
+			}
+		}
+		child = next;
+	}
+}
+
+// Merges <t>a</t>text<t>b</t> siblings into <t>ab</t>, dropping whatever text sat between them
+void xml_merge_text_siblings(xmlNodePtr node, const char* prefix, const char* name);
+
+// Hashes a subtree from its node types, names, namespaces, attributes, and text, so identical subtrees can be recognized without serializing them
+// Everything xmlNodeDump() would output is part of the hash; buf is only scratch space
+uint64_t xml_hash_tree(xmlNodePtr node, std::string& buf);
+
+// Puts the encoding that xml_hash_tree() hashes in buf, leaving out one attribute of the node itself if given
+void xml_encode_tree(std::string& buf, xmlNodePtr node, xmlAttrPtr skip = nullptr);
+
+// What a run's serialized form was reduced to the first time its properties were seen
+// The encoding is kept to tell a genuine repeat from a hash collision
+struct RunStyle {
+	std::string encoded;
+	xmlChar_view type;
+	xmlString hash;
+};
+using RunStyles = std::unordered_map<uint64_t, RunStyle>;
+
+// Whether the node serializes as a run of character data, i.e. what a [^<>]+ in a regex over the serialized form would match
+inline bool xml_is_chars(xmlNodePtr node) {
+	return node->type == XML_TEXT_NODE || node->type == XML_ENTITY_REF_NODE;
+}
+
+// Whether the element serializes with a start tag of its own, i.e. is not <prefix:name/>, as matched by <prefix:name(?=[ >])
+inline bool xml_has_start_tag(xmlNodePtr node) {
+	return node->properties || node->nsDef || node->children;
+}
+
+// Collects the character data siblings directly before or after the node, in document order, and returns whether they serialize to anything
+// Collecting backwards stops short of stop, if given
+bool xml_chars_before(xmlNodePtr node, std::vector<xmlNodePtr>& chars, xmlNodePtr stop = nullptr);
+bool xml_chars_after(xmlNodePtr node, std::vector<xmlNodePtr>& chars);
+
+// Moves text that sits directly before each <prefix:lead> within root to the start of the element found by following path in document order
+// The search gives up at the first line break, just as .*? did in the regexes this replaces
+// Does in the tree what ([^<>]+)(<lead(?=[ >])[^>]*>.*?<path...(?=[ >])[^>]*>) -> $2$1 did for the serialized form, including that matches never overlap
+void xml_move_leading_chars(xmlNodePtr root, const char* prefix, const char* lead, std::initializer_list<const char*> path);
+
+// Removes each <prefix:r><prefix:t/></prefix:r>, but not runs that only become empty by that, as a single regex pass would not have
+void xml_remove_empty_runs(xmlNodePtr node, const char* prefix);
+
+// Replaces each <tf-text> helper element with its children
+void xml_unwrap_tf_text(xmlNodePtr node);
+
+// Runs cleanup_styles() on every text node that has inline markers, then joins directly adjacent <tf-text> siblings
+// Does in the tree what used to be done on the serialized document before parsing it again
+void xml_cleanup_tf_text(xmlNodePtr node);
+
+}
+
+#endif
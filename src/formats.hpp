@@ -24,17 +24,19 @@
 namespace Transfuse {
 
 std::unique_ptr<DOM> extract_docx(State& state);
-std::unique_ptr<DOM> extract_html(State& state, std::unique_ptr<icu::UnicodeString> data = {});
+std::unique_ptr<DOM> extract_html(State& state, std::string data = {});
 std::unique_ptr<DOM> extract_html_fragment(State& state);
 std::unique_ptr<DOM> extract_odt(State& state);
 std::unique_ptr<DOM> extract_pptx(State& state);
 std::unique_ptr<DOM> extract_text(State& state, bool by_line=false);
 
-std::string inject_docx(DOM&);
+// Each returns the finished document, without touching the filesystem
+// The zip based formats instead write straight to the final output file if one is given, and return an empty string, saving a copy of potentially large files
+std::string inject_docx(DOM&, const fs::path& out = {});
 std::string inject_html(DOM&);
 std::string inject_html_fragment(DOM&);
-std::string inject_odt(DOM&);
-std::string inject_pptx(DOM&);
+std::string inject_odt(DOM&, const fs::path& out = {});
+std::string inject_pptx(DOM&, const fs::path& out = {});
 std::string inject_text(DOM&, bool by_line=false);
 
 }
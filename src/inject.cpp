@@ -20,249 +20,589 @@
 #include "stream.hpp"
 #include "dom.hpp"
 #include "formats.hpp"
-#include <unicode/regex.h>
-#include <unicode/utext.h>
+#include "cache.hpp"
+#include "profile.hpp"
 #include <iostream>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 #include <array>
 #include <stdexcept>
-using namespace icu;
+#include <cstdlib>
 
 namespace Transfuse {
 
-std::pair<fs::path,std::string> inject(fs::path tmpdir, std::istream& in, Stream stream) {
-	std::ios::sync_with_stdio(false);
-	in.tie(nullptr);
-
-	std::array<char, 4096> inbuf{};
-	in.rdbuf()->pubsetbuf(inbuf.data(), inbuf.size());
-	in.exceptions(std::ios::badbit);
+// Hands out translated blocks in the order the document needs them, reading further from the stream only when a block hasn't arrived yet.
+// Blocks that arrive early are kept until used, so for in-order streams only a single block is held in memory at a time.
+// Block IDs are numbered in document order, so once an in-order stream has gone past a block that it doesn't have, reading stops there instead of buffering the rest of the stream while looking for it.
+struct BlockReader {
+	StreamBase& sformat;
+	std::istream& in;
+	std::string buffer;
+	std::string bid;
 
-	std::unique_ptr<StreamBase> sformat;
+	struct Pending {
+		size_t seq = 0;
+		std::string body;
+	};
+	std::unordered_map<std::string, Pending> pending;
+	size_t seq = 0;
+	// Whether the last get() gave up because the stream had already gone past the wanted block
+	bool passed = false;
+
+	// The N of an N-hash block ID, or 0 if it has none
+	static size_t number(const std::string& id) {
+		return SZ(std::strtoull(id.c_str(), nullptr, 10));
+	}
 
-	std::string buffer;
-	std::getline(in, buffer);
+	bool get(const std::string& want, std::string& body) {
+		passed = false;
+		auto it = pending.find(want);
+		if (it != pending.end()) {
+			body.swap(it->second.body);
+			pending.erase(it);
+			return true;
+		}
 
-	if (stream == Streams::detect) {
-		if (buffer.find("[transfuse:") != std::string::npos) {
-			sformat.reset(new ApertiumStream);
+		auto wn = number(want);
+		while (sformat.get_block(in, buffer, bid)) {
+			Profile::count(Profile::bytes_read, buffer.size());
+			if (bid.empty()) {
+				continue;
+			}
+			if (pending.count(bid)) {
+				// Only the first occurrence of a block is used
+				std::cerr << "Block " << bid << " did not exist in this document." << std::endl;
+				continue;
+			}
+			reduce_ws(buffer);
+			if (bid == want) {
+				assign_xml(body, buffer);
+				return true;
+			}
+			auto& p = pending[bid];
+			p.seq = seq++;
+			assign_xml(p.body, buffer);
+			if (wn && number(bid) > wn) {
+				passed = true;
+				return false;
+			}
 		}
-		else if (buffer.find("<STREAMCMD:TRANSFUSE:") != std::string::npos) {
-			sformat.reset(new VISLStream);
+		return false;
+	}
+
+	// Reads the rest of the stream, so that later calls to get() only need to look at what is pending
+	void fill() {
+		std::string body;
+		get({}, body);
+	}
+
+	// Reads the rest of the stream and reports all blocks that were never used, in stream order
+	void drain() {
+		fill();
+
+		std::vector<std::pair<size_t, const std::string*>> unused;
+		for (auto& p : pending) {
+			unused.emplace_back(p.second.seq, &p.first);
 		}
-		else {
-			throw std::runtime_error("Could not detect input stream format");
+		std::sort(unused.begin(), unused.end());
+		for (auto& u : unused) {
+			std::cerr << "Block " << *u.second << " did not exist in this document." << std::endl;
 		}
+		pending.clear();
 	}
-	else if (stream == Streams::apertium) {
-		sformat.reset(new ApertiumStream);
+};
+
+// Source and translation pairs of an earlier injection, each in the XML-escaped form they have in content.xml and followed by a NUL
+// Saved as "translated" in state folders that are kept, so that an extraction made with --since can leave out the blocks that it already has translations for
+struct Translations {
+	std::string data;
+	std::unordered_map<std::string_view, std::string_view> bodies;
+
+	void load(const fs::path& fn) {
+		data = file_load(fn);
+		std::string_view view{ data };
+		for (size_t b = 0; b < view.size(); ) {
+			auto m = view.find('\0', b);
+			auto e = m == std::string_view::npos ? m : view.find('\0', m + 1);
+			if (e == std::string_view::npos) {
+				break;
+			}
+			bodies.emplace(view.substr(b, m - b), view.substr(m + 1, e - m - 1));
+			b = e + 1;
+		}
 	}
-	else {
-		sformat.reset(new VISLStream);
+
+	bool get(std::string_view source, std::string& body) {
+		auto it = bodies.find(source);
+		if (it == bodies.end()) {
+			return false;
+		}
+		body.assign(it->second.begin(), it->second.end());
+		return true;
 	}
 
-	if (tmpdir.empty()) {
-		tmpdir = sformat->get_tmpdir(buffer);
+	static void append(std::string& out, std::string_view source, std::string_view body) {
+		out.append(source.begin(), source.end());
+		out += '\0';
+		out.append(body.begin(), body.end());
+		out += '\0';
 	}
+};
+
+// Makes the inline markers of a translated block pair up within the block, so that a close lost or added in translation can't pair with markers in other blocks
+// Closes with nothing open and opens that lost their end are dropped, and inlines still open at the end of the block are closed there
+static void balance_inlines(std::string& body, std::string& tmp) {
+	tmp.clear();
+	size_t depth = 0;
+	size_t l = 0;
+	for (auto p = body.find(TFI_OPEN_B, 0, 2); p != std::string::npos && p + 2 < body.size(); p = body.find(TFI_OPEN_B, p, 2)) {
+		auto c = body[p + 2];
+		auto e = p + 3;
+		bool keep = true;
+		if (c == TFI_OPEN_B[2]) {
+			// Same rule as MarkerResolver::scan(), so both agree on what is an open
+			auto q = body.find(TFI_OPEN_B, p + 3, 2);
+			while (q != std::string::npos && q + 2 < body.size() && body[q + 2] != TFI_OPEN_B[2] && body[q + 2] != TFI_OPEN_E[2] && body[q + 2] != TFI_CLOSE[2]) {
+				q = body.find(TFI_OPEN_B, q + 1, 2);
+			}
+			if (q != std::string::npos && q + 2 < body.size() && body[q + 2] == TFI_OPEN_E[2] && q > p + 3) {
+				++depth;
+				e = q + 3;
+			}
+			else {
+				keep = false;
+			}
+		}
+		else if (c == TFI_CLOSE[2]) {
+			if (depth) {
+				--depth;
+			}
+			else {
+				keep = false;
+			}
+		}
+		else if (c != TFI_OPEN_E[2]) {
+			p += 1;
+			continue;
+		}
+		else {
+			keep = false;
+		}
 
-	if (tmpdir.empty()) {
-		throw std::runtime_error("Could not read state folder path from Transfuse stream header");
+		if (!keep) {
+			tmp.append(body, l, p - l);
+			l = p + 3;
+		}
+		p = e;
 	}
-	if (!fs::exists(tmpdir)) {
-		throw std::runtime_error(concat("State folder did not exist: ", tmpdir.string()));
+	if (l == 0 && depth == 0) {
+		return;
 	}
-
-	fs::current_path(tmpdir);
-
-	if (!fs::exists("original") || !fs::exists("content.xml") || !fs::exists("state.sqlite3")) {
-		throw std::runtime_error(concat("Given folder did not have expected state files: ", tmpdir.string()));
+	tmp.append(body, l, std::string::npos);
+	for (; depth; --depth) {
+		tmp += TFI_CLOSE;
 	}
+	body.swap(tmp);
+}
 
-	auto content = file_load("content.xml");
-	std::string tmp_b;
-	std::string tmp_e;
+// Turns inline markers \uE011tags\uE012body\uE013 and protected markers \uE020tag:hash\uE021 back into what they stood for, in a single pass
+// Nested inlines are matched with a stack, so each one's opening tags are written where it starts and its closing tags where it ends
+// Style bodies may themselves contain markers, which are expanded recursively as they are written
+// Markers that are not properly paired are left as they were
+struct MarkerResolver {
+	State& state;
+
+	// Markers deeper than this are left as-is, so a style that somehow contains itself can't recurse forever
+	static constexpr size_t max_depth = 100;
+
+	enum Kind : uint8_t {
+		literal,
+		inline_open,
+		inline_close,
+		prot,
+	};
+
+	struct Marker {
+		Kind kind = literal;
+		size_t b = 0; // Where the marker starts
+		size_t e = 0; // Where the marker ends
+		std::string_view data; // Tag list for inline opens, tag:hash for protected
+		bool paired = false;
+	};
+
+	void scan(std::string_view in, std::vector<Marker>& marks) {
+		std::vector<size_t> opens;
+		for (auto p = in.find(TFI_OPEN_B, 0, 2); p != std::string_view::npos && p + 2 < in.size(); p = in.find(TFI_OPEN_B, p, 2)) {
+			Marker m;
+			m.b = p;
+			auto c = in[p + 2];
+			if (c == TFI_OPEN_B[2]) {
+				// The tag list runs up to the next marker, which must be the one that starts the body
+				auto q = in.find(TFI_OPEN_B, p + 3, 2);
+				while (q != std::string_view::npos && q + 2 < in.size() && in[q + 2] != TFI_OPEN_B[2] && in[q + 2] != TFI_OPEN_E[2] && in[q + 2] != TFI_CLOSE[2]) {
+					q = in.find(TFI_OPEN_B, q + 1, 2);
+				}
+				if (q != std::string_view::npos && q + 2 < in.size() && in[q + 2] == TFI_OPEN_E[2] && q > p + 3) {
+					m.kind = inline_open;
+					m.data = in.substr(p + 3, q - p - 3);
+					m.e = q + 3;
+					opens.push_back(marks.size());
+				}
+			}
+			else if (c == TFI_CLOSE[2]) {
+				m.kind = inline_close;
+				m.e = p + 3;
+				if (!opens.empty()) {
+					marks[opens.back()].paired = true;
+					m.paired = true;
+					opens.pop_back();
+				}
+			}
+			else if (c == TFP_OPEN[2]) {
+				auto q = in.find(TFP_CLOSE, p + 3);
+				if (q != std::string_view::npos) {
+					auto data = in.substr(p + 3, q - p - 3);
+					auto colon = data.rfind(':');
+					if (colon != std::string_view::npos && colon > 0 && colon + 1 < data.size()) {
+						m.kind = prot;
+						m.data = data;
+						m.e = q + 3;
+						m.paired = true;
+					}
+				}
+			}
 
-	// Read all blocks from the input stream and put them back in the document
-	std::string tmp;
-	std::string bid;
-	while (sformat->get_block(in, buffer, bid)) {
-		if (bid.empty()) {
-			continue;
+			if (m.kind == literal) {
+				p += 1;
+				continue;
+			}
+			marks.push_back(m);
+			p = m.e;
 		}
-		reduce_ws(buffer);
-		assign_xml(tmp_b, buffer);
-		buffer.swap(tmp_b);
+	}
 
-		tmp_b = TFB_OPEN_B;
-		tmp_b += bid;
-		tmp_b += TFB_OPEN_E;
+	void resolve(std::string_view in, std::string& out, size_t depth = 0) {
+		if (depth > max_depth) {
+			out += in;
+			return;
+		}
 
-		tmp_e = TFB_CLOSE_B;
-		tmp_e += bid;
-		tmp_e += TFB_CLOSE_E;
+		std::vector<Marker> marks;
+		scan(in, marks);
+
+		// Closing tags of the inlines that are open at this point, innermost last
+		std::vector<std::vector<std::string_view>> closes;
+		std::string item;
+		size_t last = 0;
+		for (auto& m : marks) {
+			out.append(in.begin() + PD(last), in.begin() + PD(m.b));
+			last = m.e;
+			if (!m.paired) {
+				out.append(in.begin() + PD(m.b), in.begin() + PD(m.e));
+				continue;
+			}
 
-		tmp.clear();
-		size_t l = 0;
-		auto b = content.find(tmp_b);
-		auto e = content.find(tmp_e, b + tmp_b.size());
-		while (b != std::string::npos && e != std::string::npos) {
-			tmp.append(content.begin() + PD(l), content.begin() + PD(b));
-			tmp += buffer;
-			l = e + tmp_e.size();
-			b = content.find(tmp_b, l);
-			e = content.find(tmp_e, b + tmp_b.size());
-		}
-		if (l == 0) {
-			std::cerr << "Block " << bid << " did not exist in this document." << std::endl;
+			if (m.kind == inline_open) {
+				closes.emplace_back();
+				size_t b = 0;
+				while (b < m.data.size()) {
+					auto e = std::min(m.data.find(';', b), m.data.size());
+					item.assign(m.data, b, e - b);
+					trim_wb(item);
+					auto c = std::min(item.find(':'), item.size());
+					auto tag = std::string_view(item).substr(0, c);
+					auto hash = std::string_view(item).substr(std::min(c + 1, item.size()));
+
+					auto body = state.style(tag, hash);
+					if (body.first.empty() && body.second.empty()) {
+						std::cerr << "Inline tag " << m.data << ":" << item << " did not exist in this document." << std::endl;
+					}
+					resolve(body.first, out, depth + 1);
+					closes.back().push_back(body.second);
+					b = e + 1;
+				}
+			}
+			else if (m.kind == inline_close) {
+				auto& tags = closes.back();
+				for (auto it = tags.rbegin(); it != tags.rend(); ++it) {
+					resolve(*it, out, depth + 1);
+				}
+				closes.pop_back();
+			}
+			else {
+				auto c = m.data.rfind(':');
+				auto tag = m.data.substr(0, c);
+				auto hash = m.data.substr(c + 1);
+				auto body = state.style(tag, hash);
+				if (body.first.empty() && body.second.empty()) {
+					std::cerr << "Protected inline tag " << tag << ":" << hash << " did not exist in this document." << std::endl;
+				}
+				resolve(body.first, out, depth + 1);
+				resolve(body.second, out, depth + 1);
+			}
 		}
-		tmp.append(content.begin() + PD(l), content.end());
-		content.swap(tmp);
+		out.append(in.begin() + PD(last), in.end());
 	}
-
-	// Remove remaining block open markers
-	auto b = content.find(TFB_OPEN_B);
-	while (b != std::string::npos) {
-		auto e = content.find(TFB_OPEN_E, b);
-		content.erase(content.begin() + PD(b), content.begin() + PD(e) + 3);
-		b = content.find(TFB_OPEN_B);
+};
+
+// Puts the blocks from the stream back into the document, restores its inline markup, and writes it out in the original format
+// Returns the state folder and the finished document, or an empty string if the document was written to out
+static std::pair<fs::path,std::string> inject(State& state, StreamBase& sformat, std::istream& in, std::string content, const fs::path& out, const fs::path& cache, bool keep) {
+	auto& tmpdir = state.tmpdir;
+
+	// Blocks missing from the stream can still be filled with what they were translated to last time, if the extraction used a cache
+	std::unique_ptr<Cache> bcache;
+	auto cdir = cache.empty() ? fs::path(state.info("cache")) : cache;
+	if (!cdir.empty()) {
+		bcache = std::make_unique<Cache>(cdir);
 	}
 
-	// Remove remaining block close markers
-	b = content.find(TFB_CLOSE_B);
-	while (b != std::string::npos) {
-		auto e = content.find(TFB_CLOSE_E, b);
-		content.erase(content.begin() + PD(b), content.begin() + PD(e) + 3);
-		b = content.find(TFB_CLOSE_B);
+	// Blocks that an extraction with --since left out of the stream take their translations from the state folder it pointed at
+	Translations prior;
+	auto since = state.info("since");
+	if (!since.empty()) {
+		if (fs::exists(fs::path(since) / "translated")) {
+			prior.load(fs::path(since) / "translated");
+		}
+		else {
+			std::cerr << "State folder " << since << " had no translations to reuse for unchanged blocks." << std::endl;
+		}
 	}
+	std::string translated;
 
-	cleanup_styles(content);
-
-	State state(fs::current_path(), true);
-
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-	std::string tag_close;
+	std::string tmp_e;
+	std::string tmp_b;
 
-	RegexMatcher rx_inlines(R"X(\ue011([^\ue012]+)\ue012([^\ue011-\ue013]*)\ue013)X", 0, status);
-	RegexMatcher rx_prots(R"X(\ue020([^\ue021]+?):([^\ue021:]+)\ue021)X", 0, status);
+	Profile::Timer t_blocks("inject.blocks");
+	// Blocks that the extraction left out of the stream, which must not make the reader look for them there
+	auto skipped_ids = state.info("skipped");
+	std::unordered_set<std::string_view> skipped;
+	for (size_t b = 0, e = 0; b < skipped_ids.size(); b = e + 1) {
+		e = std::min(skipped_ids.find(' ', b), skipped_ids.size());
+		if (e > b) {
+			skipped.insert(std::string_view(skipped_ids).substr(b, e - b));
+		}
+	}
 
-	bool did = true;
-	while (did) {
-		did = false;
+	BlockReader blocks{ sformat, in };
+	std::string tmp;
+	std::string bid;
+	std::string body;
+	bool deferred = false;
 
-		// Turn inline tags back into original forms
-		tmp.resize(0);
+	// Puts the blocks back in the document in a single pass, and removes block markers that had no replacement
+	// Until the stream has been read to the end, blocks it has already gone past are left as they are, for a second pass to fill in from what was read after them
+	auto put_blocks = [&](bool last) {
+		tmp.clear();
 		tmp.reserve(content.size());
-		utext_openUTF8(tmp_ut, content);
-
-		rx_inlines.reset(&tmp_ut);
-		int32_t last = 0;
-		while (rx_inlines.find()) {
-			auto mb = rx_inlines.start(0, status);
-			auto me = rx_inlines.end(0, status);
-			tmp.append(content.begin() + last, content.begin() + mb);
-			last = me;
-			did = true;
-
-			auto tb = rx_inlines.start(1, status);
-			auto te = rx_inlines.end(1, status);
-			tmp_b.assign(content.begin() + tb, content.begin() + te);
-
-			tag_close.clear();
-			b = 0;
-			while (b < tmp_b.size()) {
-				auto e = tmp_b.find(';', b);
-				tmp_e.assign(tmp_b, b, e - b);
-				trim_wb(tmp_e);
-				auto c = tmp_e.find(':');
-				auto tag = std::string_view(&tmp_e[0], c);
-				auto hash = std::string_view(&tmp_e[c + 1]);
+		size_t l = 0;
+		for (auto b = find_block_marker(content, l); b != std::string::npos; b = find_block_marker(content, l)) {
+			tmp.append(content.begin() + PD(l), content.begin() + PD(b));
 
-				auto body = state.style(tag, hash);
-				if (body.first.empty() && body.second.empty()) {
-					std::cerr << "Inline tag " << tmp_b << ":" << tmp_e << " did not exist in this document." << std::endl;
+			bool is_open = (content[b + 2] == TFB_OPEN_B[2]);
+			auto e = content.find(is_open ? TFB_OPEN_E : TFB_CLOSE_E, b + 3);
+			if (e == std::string::npos) {
+				l = b;
+				break;
+			}
+			l = e + 3;
+			if (!is_open) {
+				continue;
+			}
+
+			bid.assign(content.begin() + PD(b) + 3, content.begin() + PD(e));
+			tmp_e = TFB_CLOSE_B;
+			tmp_e += bid;
+			tmp_e += TFB_CLOSE_E;
+			auto c = content.find(tmp_e, l);
+			if (c == std::string::npos) {
+				continue;
+			}
+			auto source = std::string_view(content).substr(l, c - l);
+			bool found = skipped.count(bid) && (prior.get(source, body) || (bcache && bcache->load_block(source, body)));
+			if (!found && blocks.get(bid, body)) {
+				found = true;
+				if (bcache) {
+					bcache->save_block(source, body);
 				}
-				tmp += body.first;
-				tag_close.insert(tag_close.begin(), body.second.begin(), body.second.end());
-				b = std::max(e, e + 1);
 			}
+			if (!found && !last && blocks.passed) {
+				tmp.append(content.begin() + PD(b), content.begin() + PD(c + tmp_e.size()));
+				l = c + tmp_e.size();
+				deferred = true;
+				continue;
+			}
+			if (!found && !prior.get(source, body) && (!bcache || !bcache->load_block(source, body))) {
+				std::cerr << "Block " << bid << " was neither in the stream nor among earlier translations, so it was left untranslated." << std::endl;
+				continue;
+			}
+			balance_inlines(body, tmp_b);
+			Translations::append(translated, source, body);
+			Profile::count(Profile::blocks_injected);
 
-			auto bb = rx_inlines.start(2, status);
-			auto be = rx_inlines.end(2, status);
-			tmp.append(content.begin() + bb, content.begin() + be);
-			tmp += tag_close;
+			tmp += body;
+			l = c + tmp_e.size();
 		}
-		tmp.append(content.begin() + last, content.end());
+		tmp.append(content.begin() + PD(l), content.end());
 		content.swap(tmp);
+	};
 
-		// Turn protected-inlines back into original form
-		tmp.resize(0);
-		tmp.reserve(content.size());
-		utext_openUTF8(tmp_ut, content);
-
-		rx_prots.reset(&tmp_ut);
-		last = 0;
-		while (rx_prots.find()) {
-			auto mb = rx_prots.start(0, status);
-			auto me = rx_prots.end(0, status);
-			tmp.append(content.begin() + last, content.begin() + mb);
-			last = me;
-			did = true;
-
-			auto tb = rx_prots.start(1, status);
-			auto te = rx_prots.end(1, status);
-			tmp_b.assign(content.begin() + tb, content.begin() + te);
-
-			auto hb = rx_prots.start(2, status);
-			auto he = rx_prots.end(2, status);
-			tmp_e.assign(content.begin() + hb, content.begin() + he);
-
-			auto body = state.style(tmp_b, tmp_e);
-			if (body.first.empty() && body.second.empty()) {
-				std::cerr << "Protected inline tag " << tmp_b << ":" << tmp_e << " did not exist in this document." << std::endl;
-			}
-			tmp += body.first;
-			tmp += body.second;
-		}
-		tmp.append(content.begin() + last, content.end());
-		content.swap(tmp);
+	put_blocks(false);
+	if (deferred) {
+		blocks.fill();
+		put_blocks(true);
+	}
+	blocks.drain();
+	if (bcache) {
+		bcache->commit();
+	}
+	// Only a folder that is kept can later be given to --since
+	if (keep && !state.transient) {
+		file_save(tmpdir / "translated", translated);
 	}
-	utext_close(&tmp_ut);
+	t_blocks.stop();
+
+	Profile::Timer t_restore("inject.restore");
+	cleanup_styles(content);
+
+	// Turn inline tags and protected-inlines back into original forms
+	tmp.clear();
+	tmp.reserve(content.size());
+	MarkerResolver resolver{ state };
+	resolver.resolve(content, tmp);
+	content.swap(tmp);
+	t_restore.stop();
 
+	Profile::Timer t_parse("inject.parse");
 	auto xml = xmlReadMemory(reinterpret_cast<const char*>(content.data()), SI(content.size()), "content.xml", "UTF-8", XML_PARSE_RECOVER | XML_PARSE_NONET);
 	if (xml == nullptr) {
-		throw std::runtime_error(concat("Could not parse styled XML: ", xmlLastError.message));
+		throw std::runtime_error(concat("Could not parse styled XML: ", xml_error_message()));
 	}
 
+	t_parse.stop();
+
 	auto dom = std::make_unique<DOM>(state, xml);
 	dom->restore_spaces();
 
-	std::string fname;
+	Profile::Timer t_format("inject.format");
+
+	std::string data;
 	auto format = state.format();
 
 	if (format == "docx") {
-		fname = inject_docx(*dom);
+		return { tmpdir, inject_docx(*dom, out) };
 	}
 	else if (format == "pptx") {
-		fname = inject_pptx(*dom);
+		return { tmpdir, inject_pptx(*dom, out) };
 	}
 	else if (format == "odt" || format == "odp") {
-		fname = inject_odt(*dom);
+		return { tmpdir, inject_odt(*dom, out) };
 	}
 	else if (format == "html") {
-		fname = inject_html(*dom);
+		data = inject_html(*dom);
 	}
 	else if (format == "html-fragment") {
-		fname = inject_html_fragment(*dom);
+		data = inject_html_fragment(*dom);
 	}
 	else if (format == "text") {
-		fname = inject_text(*dom);
+		data = inject_text(*dom);
 	}
 	else if (format == "line") {
-		fname = inject_text(*dom, true);
+		data = inject_text(*dom, true);
+	}
+	else {
+		throw std::runtime_error(concat("Unknown format: ", format));
+	}
+
+	if (!out.empty()) {
+		file_save(out, data);
+		data.clear();
 	}
+	return { tmpdir, data };
+}
+
+std::pair<fs::path,std::string> inject(fs::path tmpdir, std::istream& in, Stream stream, const fs::path& out, const fs::path& cache, bool keep) {
+	in.tie(nullptr);
+
+	std::array<char, 4096> inbuf{};
+	in.rdbuf()->pubsetbuf(inbuf.data(), inbuf.size());
+	in.exceptions(std::ios::badbit);
+
+	std::unique_ptr<StreamBase> sformat;
+
+	std::string buffer;
+	std::getline(in, buffer);
+
+	if (stream == Streams::detect) {
+		if (buffer.find("[transfuse:") != std::string::npos) {
+			sformat.reset(new ApertiumStream);
+		}
+		else if (buffer.find("<STREAMCMD:TRANSFUSE:") != std::string::npos) {
+			sformat.reset(new VISLStream);
+		}
+		else if (!BinaryStream().get_tmpdir(buffer).empty()) {
+			sformat.reset(new BinaryStream);
+		}
+		else {
+			throw std::runtime_error("Could not detect input stream format");
+		}
+	}
+	else {
+		sformat = make_stream(stream);
+	}
+
+	if (tmpdir.empty()) {
+		tmpdir = sformat->get_tmpdir(buffer);
+	}
+
+	if (tmpdir.empty()) {
+		throw std::runtime_error("Could not read state folder path from Transfuse stream header");
+	}
+	if (!fs::exists(tmpdir)) {
+		throw std::runtime_error(concat("State folder did not exist: ", tmpdir.string()));
+	}
+
+	tmpdir = fs::absolute(tmpdir);
+
+	if (!fs::exists(tmpdir / "original") || !fs::exists(tmpdir / "content.xml") || !State::exists(tmpdir)) {
+		throw std::runtime_error(concat("Given folder did not have expected state files: ", tmpdir.string()));
+	}
+
+	State state(tmpdir, true);
+	return inject(state, *sformat, in, file_load(tmpdir / "content.xml"), out, cache, keep);
+}
+
+// Reads a buffer in place, without the copy std::istringstream would make
+struct MemoryBuf : std::streambuf {
+	MemoryBuf(const char* b, size_t n) {
+		auto p = const_cast<char*>(b);
+		setg(p, p, p + n);
+	}
+};
+
+std::pair<fs::path,std::string> inject(Extraction& x, std::string_view stream, std::string content, const fs::path& out, const fs::path& cache, bool keep) {
+	if (!x.state) {
+		x.state = std::make_unique<State>(x.tmpdir, true);
+	}
+
+	auto sformat = make_stream(x.state->stream());
+
+	MemoryBuf buf(stream.data(), stream.size());
+	std::istream in(&buf);
+	in.exceptions(std::ios::badbit);
+
+	// Skip the header, as the state folder is already known
+	std::string header;
+	std::getline(in, header);
+
+	return inject(*x.state, *sformat, in, std::move(content), out, cache, keep);
+}
 
-	return {tmpdir, fname};
+std::pair<fs::path,std::string> inject(Extraction& x, const fs::path& out, const fs::path& cache, bool keep) {
+	return inject(x, x2s(x.stream), std::move(x.content), out, cache, keep);
 }
 
 }
@@ -0,0 +1,101 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "libtransfuse.hpp"
+#include "filesystem.hpp"
+#include "string_view.hpp"
+#include "shared.hpp"
+#include "stream.hpp"
+#include "state.hpp"
+#include <unicode/uclean.h>
+#include <libxml/parser.h>
+#include <mutex>
+#include <stdexcept>
+
+namespace Transfuse {
+
+Extraction extract_buffer(fs::path tmpdir, std::shared_ptr<MappedFile> original, const fs::path& name, std::string_view format, Stream stream);
+std::pair<fs::path, std::string> inject(Extraction& x, std::string_view stream, std::string content, const fs::path& out = {}, const fs::path& cache = {}, bool keep = true);
+
+struct Document::impl {
+	Extraction x;
+};
+
+Document::Document()
+  : p(std::make_unique<impl>())
+{}
+
+Document::~Document() {
+}
+
+Document::Document(Document&&) noexcept = default;
+Document& Document::operator=(Document&&) noexcept = default;
+
+void init() {
+	static std::once_flag once;
+	std::call_once(once, []() {
+		UErrorCode status = U_ZERO_ERROR;
+		u_init(&status);
+		if (U_FAILURE(status) && status != U_FILE_ACCESS_ERROR) {
+			throw std::runtime_error(concat("Could not initialize ICU: ", u_errorName(status)));
+		}
+		xmlInitParser();
+	});
+}
+
+Extracted extract(std::string data, const ExtractOptions& options) {
+	Stream stream{ options.stream };
+	if (stream != Streams::apertium && stream != Streams::visl && stream != Streams::binary) {
+		throw std::runtime_error(concat("Unknown stream format: ", stream));
+	}
+
+	auto original = std::make_shared<MappedFile>(std::move(data));
+	auto x = extract_buffer(options.folder, std::move(original), options.name, options.format, stream);
+
+	Extracted rv;
+	auto sv = x2s(x.stream);
+	rv.stream.assign(sv.begin(), sv.end());
+	x.stream.clear();
+	x.stream.shrink_to_fit();
+	rv.document.p->x = std::move(x);
+	return rv;
+}
+
+Document load(const std::string& folder) {
+	fs::path tmpdir{ folder };
+	if (!fs::exists(tmpdir / "original") || !fs::exists(tmpdir / "content.xml") || !State::exists(tmpdir)) {
+		throw std::runtime_error(concat("Given folder did not have expected state files: ", folder));
+	}
+
+	Document rv;
+	auto& x = rv.p->x;
+	x.tmpdir = fs::canonical(tmpdir);
+	x.content = file_load(x.tmpdir / "content.xml");
+	x.state = std::make_unique<State>(x.tmpdir, true);
+	return rv;
+}
+
+std::string inject(Document& document, const std::string& stream) {
+	auto& x = document.p->x;
+	if (x.content.empty()) {
+		throw std::runtime_error("Document had no extraction to inject into");
+	}
+	// The content is copied rather than moved, so that the same document can be injected again
+	return inject(x, stream, x.content).second;
+}
+
+}
@@ -0,0 +1,76 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_LIBTRANSFUSE_HPP_
+#define e5bd51be_LIBTRANSFUSE_HPP_
+
+#include <memory>
+#include <string>
+
+// Embeddable interface, for programs that hold documents in memory and would rather not run the transfuse binary for each one
+// Nothing here touches the filesystem or the process-wide current folder, unless a folder is explicitly asked for
+// After init(), any number of threads may extract and inject at once, as long as each Document is used by one thread at a time
+// Errors are thrown as std::runtime_error, same as the command line tool reports them
+
+namespace Transfuse {
+
+// Sets up ICU and libxml2; must be called before anything else, and is safe to call more than once
+void init();
+
+struct ExtractOptions {
+	// One of docx, pptx, odt, odp, html, html-fragment, text, line, or auto to detect it from the name and contents
+	std::string format{ "auto" };
+	// One of apertium, visl, binary
+	std::string stream{ "apertium" };
+	// The document's file name, if it has one, which auto-detection looks at the extension of
+	std::string name;
+	// If not empty, the state is also saved in this folder, so that load() in another process or transfuse -m inject can pick it up
+	std::string folder;
+};
+
+// The state of one extracted document, which injection needs to rebuild it around the translated stream
+class Document {
+public:
+	Document();
+	~Document();
+	Document(Document&&) noexcept;
+	Document& operator=(Document&&) noexcept;
+
+	struct impl;
+	std::unique_ptr<impl> p;
+};
+
+struct Extracted {
+	// The stream to translate, header line included
+	std::string stream;
+	Document document;
+};
+
+Extracted extract(std::string data, const ExtractOptions& options = {});
+
+// Opens the state that extract() or the command line tool saved in a folder
+Document load(const std::string& folder);
+
+// Returns the finished document, with the translated stream put back in
+// The stream must start with the header line that extract() gave it
+// A Document can be injected any number of times, such as once for each target language
+std::string inject(Document& document, const std::string& stream);
+
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profile.hpp"
+#include "shared.hpp"
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Transfuse {
+namespace Profile {
+
+std::atomic<bool> enabled{ false };
+std::atomic<size_t> counters[NUM_COUNTERS]{};
+
+static const char* counter_names[NUM_COUNTERS] = {
+	"blocks_extracted",
+	"blocks_injected",
+	"styles_stored",
+	"cleanup_calls",
+	"cleanup_rounds",
+	"bytes_read",
+	"bytes_written",
+};
+
+struct Phase {
+	const char* name = nullptr;
+	size_t calls = 0;
+	std::chrono::steady_clock::duration time{};
+};
+
+// Only a handful of distinct phases exist, and they are coarse, so a locked linear scan is cheaper than anything fancier
+static std::mutex phases_mtx;
+static std::vector<Phase> phases;
+
+void add_time(const char* phase, std::chrono::steady_clock::duration time) {
+	std::lock_guard<std::mutex> lock(phases_mtx);
+	for (auto& p : phases) {
+		if (p.name == phase) {
+			++p.calls;
+			p.time += time;
+			return;
+		}
+	}
+	phases.push_back({ phase, 1, time });
+}
+
+void report(const fs::path& out) {
+	std::lock_guard<std::mutex> lock(phases_mtx);
+	auto secs = [](std::chrono::steady_clock::duration d) {
+		return std::chrono::duration<double>(d).count();
+	};
+	char buf[256]{};
+
+	if (out == "-") {
+		std::string rv{ "Profile:\n" };
+		for (auto& p : phases) {
+			snprintf(buf, sizeof(buf), "  %-24s %10.6f s %8zu x\n", p.name, secs(p.time), p.calls);
+			rv += buf;
+		}
+		for (size_t i = 0; i < NUM_COUNTERS; ++i) {
+			snprintf(buf, sizeof(buf), "  %-24s %12zu\n", counter_names[i], counters[i].load());
+			rv += buf;
+		}
+		std::cerr << rv << std::flush;
+		return;
+	}
+
+	std::string rv{ "{\n\t\"phases\": [" };
+	for (size_t i = 0; i < phases.size(); ++i) {
+		snprintf(buf, sizeof(buf), "%s\n\t\t{ \"name\": \"%s\", \"seconds\": %.6f, \"calls\": %zu }", i ? "," : "", phases[i].name, secs(phases[i].time), phases[i].calls);
+		rv += buf;
+	}
+	rv += "\n\t],\n\t\"counters\": {";
+	for (size_t i = 0; i < NUM_COUNTERS; ++i) {
+		snprintf(buf, sizeof(buf), "%s\n\t\t\"%s\": %zu", i ? "," : "", counter_names[i], counters[i].load());
+		rv += buf;
+	}
+	rv += "\n\t}\n}\n";
+
+	file_save(out, rv);
+}
+
+}
+}
@@ -0,0 +1,89 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_PROFILE_HPP_
+#define e5bd51be_PROFILE_HPP_
+
+#include "filesystem.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+namespace Transfuse {
+
+// Process-wide wall times and counters for --profile, summed over all documents and threads
+// While profiling is off, every hook costs a single relaxed load, so they can stay in place for production use
+namespace Profile {
+	enum Counter {
+		blocks_extracted,
+		blocks_injected,
+		styles_stored, // Distinct styles added to the state
+		cleanup_calls,
+		cleanup_rounds, // Rounds of cleanup_styles()'s loop, each running every rewrite pass once
+		bytes_read, // Input documents and streams
+		bytes_written, // Output streams and documents
+		NUM_COUNTERS,
+	};
+
+	extern std::atomic<bool> enabled;
+	extern std::atomic<size_t> counters[NUM_COUNTERS];
+
+	inline void count(Counter c, size_t n = 1) {
+		if (enabled.load(std::memory_order_relaxed)) {
+			counters[c].fetch_add(n, std::memory_order_relaxed);
+		}
+	}
+
+	// Phases are identified by their name's address, so pass string literals
+	void add_time(const char* phase, std::chrono::steady_clock::duration);
+
+	// Times from construction until stop() or destruction as the named phase
+	// Phases may nest and repeat; each reports its own total, so nested time counts towards both
+	struct Timer {
+		const char* phase = nullptr;
+		std::chrono::steady_clock::time_point start;
+
+		explicit Timer(const char* p) {
+			if (enabled.load(std::memory_order_relaxed)) {
+				phase = p;
+				start = std::chrono::steady_clock::now();
+			}
+		}
+
+		~Timer() {
+			stop();
+		}
+
+		void stop() {
+			if (phase) {
+				add_time(phase, std::chrono::steady_clock::now() - start);
+				phase = nullptr;
+			}
+		}
+
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+	};
+
+	// Writes the phases in the order they first finished, plus all counters, as JSON to the file, or as text to stderr if given -
+	void report(const fs::path& out);
+}
+
+}
+
+#endif
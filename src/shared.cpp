@@ -16,15 +16,112 @@
 */
 
 #include "shared.hpp"
+#include "simd.hpp"
 #include <unicode/ucsdet.h>
 #include <unicode/ucnv.h>
 #include <unicode/utf8.h>
 #include <libxml/tree.h>
 #include <stdexcept>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#ifndef _WIN32
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/ioctl.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+#ifdef __linux__
+	#include <linux/fs.h>
+#endif
 using namespace icu;
 
 namespace Transfuse {
 
+void file_clone(const fs::path& source, const fs::path& target) {
+#ifdef FICLONE
+	auto in = ::open(source.string().c_str(), O_RDONLY);
+	if (in >= 0) {
+		auto out = ::open(target.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out >= 0) {
+			auto ok = (::ioctl(out, FICLONE, in) == 0);
+			::close(out);
+			::close(in);
+			if (ok) {
+				return;
+			}
+		}
+		else {
+			::close(in);
+		}
+	}
+#endif
+	try {
+		fs::copy_file(source, target, fs::copy_options::overwrite_existing);
+	}
+	catch (...) {
+		std::ifstream in(source.string(), std::ios::binary);
+		if (!in) {
+			throw std::runtime_error(concat("Could not read ", source.string(), ": ", std::strerror(errno)));
+		}
+		in.exceptions(std::ios::badbit | std::ios::failbit);
+
+		std::ofstream out(target.string(), std::ios::binary);
+		out.exceptions(std::ios::badbit | std::ios::failbit);
+		out << in.rdbuf();
+		out.close();
+	}
+}
+
+MappedFile::MappedFile(const fs::path& fn) {
+#ifdef _WIN32
+	buffer = file_load(fn);
+	data = buffer.data();
+	size = buffer.size();
+#else
+	auto fd = ::open(fn.string().c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(concat("Could not open ", fn.string(), ": ", std::strerror(errno)));
+	}
+	struct stat st{};
+	if (::fstat(fd, &st) != 0) {
+		::close(fd);
+		throw std::runtime_error(concat("Could not stat ", fn.string()));
+	}
+	size = SZ(st.st_size);
+	if (size) {
+		auto m = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			::close(fd);
+			throw std::runtime_error(concat("Could not mmap ", fn.string()));
+		}
+		data = static_cast<const char*>(m);
+		mapped = true;
+	}
+	::close(fd);
+#endif
+}
+
+MappedFile::MappedFile(std::string&& buf)
+  : buffer(std::move(buf))
+{
+	data = buffer.data();
+	size = buffer.size();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+	if (mapped) {
+		::munmap(const_cast<char*>(data), size);
+	}
+#endif
+}
+
 // ToDo: C++17 constexpr these
 const std::string_view UTF8_BOM("\xef\xbb\xbf");
 const std::string_view UTF32LE_BOM("\xff\xfe\x00\x00", 4);
@@ -32,15 +129,19 @@ const std::string_view UTF32BE_BOM("\x00\x00\xfe\xff", 4);
 const std::string_view UTF16LE_BOM("\xff\xfe");
 const std::string_view UTF16BE_BOM("\xfe\xff");
 
+// Skips runs of ASCII 16 or 32 bytes at a time, and only decodes the multi-byte sequences in between
 inline bool is_utf8(std::string_view data) {
-	UChar32 c = 0;
 	auto raw = reinterpret_cast<const uint8_t*>(data.data());
-	int32_t i = 0;
 	auto sz = SI32(data.size());
-	while (c >= 0 && i<sz) {
-		U8_NEXT(raw, i, sz, c);
-		if (c < 0) {
-			return false;
+	int32_t i = 0;
+	while (i < sz) {
+		i = SI32(find_non_ascii(data.data() + i, data.data() + sz) - data.data());
+		while (i < sz && raw[i] >= 0x80) {
+			UChar32 c = 0;
+			U8_NEXT(raw, i, sz, c);
+			if (c < 0) {
+				return false;
+			}
 		}
 	}
 	return true;
@@ -74,7 +175,8 @@ std::string detect_encoding(std::string_view data) {
 			throw std::runtime_error(concat("Could not create charset detector: ", u_errorName(status)));
 		}
 
-		ucsdet_setText(det, data.data(), SI32(data.size()), &status);
+		// The detector's statistics settle long before the end of a large file, so only show it the start
+		ucsdet_setText(det, data.data(), SI32(std::min(data.size(), SZ(64 * 1024))), &status);
 		if (U_FAILURE(status)) {
 			throw std::runtime_error(concat("Could not fill charset detector: ", u_errorName(status)));
 		}
@@ -111,4 +213,69 @@ UnicodeString to_ustring(std::string_view data, std::string_view enc) {
 	return rv;
 }
 
+std::string to_utf8(std::string data) {
+	if (is_utf8(data)) {
+		return data;
+	}
+
+	std::string rv;
+	to_ustring(data, detect_encoding(data)).toUTF8String(rv);
+	return rv;
+}
+
+static std::atomic<size_t> max_doc_threads{ 1 };
+
+void set_doc_threads(size_t n) {
+	if (n == 0) {
+		n = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	max_doc_threads = n;
+}
+
+size_t doc_threads(size_t n) {
+	return std::max(std::min(n, max_doc_threads.load()), SZ(1));
+}
+
+void parallel_for(size_t n, const std::function<void(size_t, size_t)>& fn) {
+	auto threads = doc_threads(n);
+	if (threads <= 1) {
+		for (size_t i = 0; i < n; ++i) {
+			fn(0, i);
+		}
+		return;
+	}
+
+	std::atomic<size_t> next{ 0 };
+	std::mutex mtx;
+	std::exception_ptr error;
+
+	auto work = [&](size_t t) {
+		for (size_t i = next++; i < n; i = next++) {
+			try {
+				fn(t, i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mtx);
+				if (!error) {
+					error = std::current_exception();
+				}
+				next = n;
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (size_t t = 1; t < threads; ++t) {
+		pool.emplace_back(work, t);
+	}
+	work(0);
+	for (auto& th : pool) {
+		th.join();
+	}
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
 }
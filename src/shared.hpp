@@ -22,9 +22,16 @@
 #include "string_view.hpp"
 #include "filesystem.hpp"
 #include <unicode/unistr.h>
+#include <unicode/regex.h>
+#include <unicode/uchar.h>
+#include <unicode/utf8.h>
 #include <string>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include <algorithm>
+#include <functional>
 #include <cctype>
 
 namespace Transfuse {
@@ -133,6 +140,22 @@ inline std::string concat(const T& value, Args... args) {
 	return msg;
 }
 
+// Compiles each pattern only once per thread and hands out the same matcher every time, so that processing many documents in one process doesn't recompile constantly
+// Callers must reset() the matcher before each use, and the same pattern must not be in use twice at once
+inline icu::RegexMatcher& cached_rx(std::string_view pattern, uint32_t flags = 0) {
+	thread_local std::map<std::pair<std::string, uint32_t>, std::unique_ptr<icu::RegexMatcher>> cache;
+	auto& rx = cache[std::make_pair(std::string(pattern), flags)];
+	if (!rx) {
+		UErrorCode status = U_ZERO_ERROR;
+		rx = std::make_unique<icu::RegexMatcher>(icu::UnicodeString::fromUTF8(icu::StringPiece(pattern.data(), static_cast<int32_t>(pattern.size()))), flags, status);
+		if (U_FAILURE(status)) {
+			rx.reset();
+			throw std::runtime_error(concat("Could not create RegexMatcher: ", u_errorName(status)));
+		}
+	}
+	return *rx;
+}
+
 inline std::string& to_lower(std::string& str) {
 	std::transform(str.begin(), str.end(), str.begin(), [](char c) { return static_cast<char>(tolower(c)); });
 	return str;
@@ -222,6 +245,16 @@ inline void trim_wb(Str& wb) {
 	remove_prefix(wb, h);
 }
 
+// Finds the next block open or close marker, which all share the same first 2 bytes
+inline size_t find_block_marker(const std::string& str, size_t pos) {
+	for (pos = str.find(TFB_OPEN_B, pos, 2); pos != std::string::npos; pos = str.find(TFB_OPEN_B, pos + 1, 2)) {
+		if (pos + 2 < str.size() && (str[pos + 2] == TFB_OPEN_B[2] || str[pos + 2] == TFB_CLOSE_B[2])) {
+			break;
+		}
+	}
+	return pos;
+}
+
 inline std::string file_load(fs::path fn) {
 	std::ifstream file(fn.string(), std::ios::binary);
 	file.exceptions(std::ios::badbit | std::ios::failbit);
@@ -267,9 +300,181 @@ inline void file_save(fs::path fn, const icu::UnicodeString& data, bool bom = tr
 	}
 }
 
+// Makes target a copy of source, sharing the data blocks instead where the filesystem can (reflinks on Btrfs, XFS, and the like), so even huge files cost no I/O
+// Hard links would be cheaper still, but then the copy would change along with any in-place edit of the source
+void file_clone(const fs::path& source, const fs::path& target);
+
+// Read-only view of a whole file, memory-mapped where possible
+struct MappedFile {
+	const char* data = nullptr;
+	size_t size = 0;
+
+	explicit MappedFile(const fs::path& fn);
+	// Takes over data that never was a file, such as what was read from stdin
+	explicit MappedFile(std::string&& buf);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::string_view view() const {
+		return { data, size };
+	}
+
+private:
+	std::string buffer;
+	bool mapped = false;
+};
+
+// Character classes matching the ICU regex classes noted below, for the DOM, cleanup_styles(), and HTML pre-scrubbing, without the cost of setting up a regex for every tiny string
+// ASCII is looked up in a table, and only other code points ask ICU
+
+enum : uint8_t {
+	CC_SPACE = 1 << 0, // [\s\p{Z}], which is the same set as [\s\p{Zs}] because \s already has U+2028 and U+2029
+	CC_L = 1 << 1, // \p{L}
+	CC_M = 1 << 2, // \p{M}
+	CC_N = 1 << 3, // \p{N}
+	CC_WORD = 1 << 4, // [\w\p{L}\p{N}\p{M}], where ICU's \w is [\p{Alphabetic}\p{M}\p{Nd}\p{Pc}\u200c\u200d]
+};
+
+struct AsciiClasses {
+	uint8_t cc[128];
+
+	constexpr AsciiClasses() : cc{} {
+		for (int c = 0; c < 128; ++c) {
+			uint8_t v = 0;
+			if ((c >= '\t' && c <= '\r') || c == ' ') {
+				v |= CC_SPACE;
+			}
+			if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+				v |= CC_L | CC_WORD;
+			}
+			if (c >= '0' && c <= '9') {
+				v |= CC_N | CC_WORD;
+			}
+			if (c == '_') {
+				v |= CC_WORD;
+			}
+			cc[c] = v;
+		}
+	}
+};
+static constexpr AsciiClasses ascii_classes;
+
+inline bool is_space_cp(UChar32 c) {
+	if (c >= 0 && c < 128) {
+		return ascii_classes.cc[c] & CC_SPACE;
+	}
+	return c >= 0 && (u_isUWhiteSpace(c) || (U_GET_GC_MASK(c) & U_GC_Z_MASK));
+}
+
+inline bool is_l_cp(UChar32 c) {
+	if (c >= 0 && c < 128) {
+		return ascii_classes.cc[c] & CC_L;
+	}
+	return c >= 0 && (U_GET_GC_MASK(c) & U_GC_L_MASK);
+}
+
+inline bool is_lm_cp(UChar32 c) {
+	if (c >= 0 && c < 128) {
+		return ascii_classes.cc[c] & (CC_L | CC_M);
+	}
+	return c >= 0 && (U_GET_GC_MASK(c) & (U_GC_L_MASK | U_GC_M_MASK));
+}
+
+inline bool is_lnm_cp(UChar32 c) {
+	if (c >= 0 && c < 128) {
+		return ascii_classes.cc[c] & (CC_L | CC_N | CC_M);
+	}
+	return c >= 0 && (U_GET_GC_MASK(c) & (U_GC_L_MASK | U_GC_N_MASK | U_GC_M_MASK));
+}
+
+inline bool is_word_cp(UChar32 c) {
+	if (c >= 0 && c < 128) {
+		return ascii_classes.cc[c] & CC_WORD;
+	}
+	if (c < 0) {
+		return false;
+	}
+	if (U_GET_GC_MASK(c) & (U_GC_L_MASK | U_GC_N_MASK | U_GC_M_MASK | U_GC_PC_MASK)) {
+		return true;
+	}
+	return c == 0x200c || c == 0x200d || u_hasBinaryProperty(c, UCHAR_ALPHABETIC);
+}
+
+inline UChar32 next_cp(std::string_view str, int32_t& i) {
+	auto raw = reinterpret_cast<const uint8_t*>(str.data());
+	UChar32 c = 0;
+	U8_NEXT(raw, i, SI32(str.size()), c);
+	return c;
+}
+
+// Length of the longest prefix where all code points satisfy cls
+template<typename F>
+inline size_t prefix_len(std::string_view str, F cls) {
+	int32_t i = 0;
+	int32_t l = 0;
+	while (i < SI32(str.size()) && cls(next_cp(str, i))) {
+		l = i;
+	}
+	return SZ(l);
+}
+
+// Start of the longest suffix where all code points satisfy cls, or str.size() if there is no such suffix
+template<typename F>
+inline size_t suffix_start(std::string_view str, F cls) {
+	int32_t i = 0;
+	int32_t b = 0;
+	while (i < SI32(str.size())) {
+		if (!cls(next_cp(str, i))) {
+			b = i;
+		}
+	}
+	return SZ(b);
+}
+
+// Same as suffix_start(), but scans backwards from the end, so only the suffix itself is looked at
+template<typename F>
+inline size_t tail_start(std::string_view str, F cls) {
+	auto raw = reinterpret_cast<const uint8_t*>(str.data());
+	int32_t i = SI32(str.size());
+	while (i > 0) {
+		auto e = i;
+		UChar32 c = 0;
+		U8_PREV(raw, 0, i, c);
+		if (!cls(c)) {
+			return SZ(e);
+		}
+	}
+	return 0;
+}
+
+// Whether any code point satisfies cls
+template<typename F>
+inline bool any_cp(std::string_view str, F cls) {
+	int32_t i = 0;
+	while (i < SI32(str.size())) {
+		if (cls(next_cp(str, i))) {
+			return true;
+		}
+	}
+	return false;
+}
+
 std::string detect_encoding(std::string_view);
 
 icu::UnicodeString to_ustring(std::string_view, std::string_view);
+// Converts to UTF-8 from whatever encoding detect_encoding() finds
+// Data that already is valid UTF-8 is passed through untouched after a single validation pass
+std::string to_utf8(std::string);
+
+// How many threads a single document may use for its independent parts, such as PPTX slides; 0 means one per CPU core
+void set_doc_threads(size_t);
+// How many threads parallel_for() would use for n items, so callers can set up per-thread resources
+size_t doc_threads(size_t n);
+// Calls fn(thread, i) for each i in [0, n), where thread is in [0, doc_threads(n))
+// If any call throws, the remaining items are skipped and the first exception is rethrown
+void parallel_for(size_t n, const std::function<void(size_t, size_t)>& fn);
 
 }
 
@@ -0,0 +1,155 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#ifndef e5bd51be_SIMD_HPP_
+#define e5bd51be_SIMD_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define TF_SIMD_SSE2 1
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define TF_SIMD_NEON 1
+	#include <arm_neon.h>
+#endif
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+namespace Transfuse {
+
+namespace details {
+	inline unsigned ctz32(uint32_t v) {
+	#if defined(_MSC_VER)
+		unsigned long i = 0;
+		_BitScanForward(&i, v);
+		return static_cast<unsigned>(i);
+	#else
+		return static_cast<unsigned>(__builtin_ctz(v));
+	#endif
+	}
+
+	inline unsigned ctz64(uint64_t v) {
+	#if defined(_MSC_VER) && defined(_WIN64)
+		unsigned long i = 0;
+		_BitScanForward64(&i, v);
+		return static_cast<unsigned>(i);
+	#elif defined(_MSC_VER)
+		auto lo = static_cast<uint32_t>(v);
+		return lo ? ctz32(lo) : 32 + ctz32(static_cast<uint32_t>(v >> 32));
+	#else
+		return static_cast<unsigned>(__builtin_ctzll(v));
+	#endif
+	}
+
+	template<char... Cs>
+	struct any_of;
+
+	template<>
+	struct any_of<> {
+		static bool scalar(char) {
+			return false;
+		}
+	#if defined(TF_SIMD_SSE2)
+		static __m128i sse2(__m128i) {
+			return _mm_setzero_si128();
+		}
+	#elif defined(TF_SIMD_NEON)
+		static uint8x16_t neon(uint8x16_t) {
+			return vdupq_n_u8(0);
+		}
+	#endif
+	};
+
+	template<char C, char... Cs>
+	struct any_of<C, Cs...> {
+		static bool scalar(char c) {
+			return c == C || any_of<Cs...>::scalar(c);
+		}
+	#if defined(TF_SIMD_SSE2)
+		static __m128i sse2(__m128i v) {
+			return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(C)), any_of<Cs...>::sse2(v));
+		}
+	#elif defined(TF_SIMD_NEON)
+		static uint8x16_t neon(uint8x16_t v) {
+			return vorrq_u8(vceqq_u8(v, vdupq_n_u8(static_cast<uint8_t>(C))), any_of<Cs...>::neon(v));
+		}
+	#endif
+	};
+}
+
+// Finds the first byte in [b, e) that is any of Cs, or e if there is none
+// Compares 16 bytes at a time where SSE2 or NEON is available at compile time, so runs of bytes that need no attention can be skipped and copied in bulk
+template<char... Cs>
+inline const char* find_any(const char* b, const char* e) {
+	using set = details::any_of<Cs...>;
+#if defined(TF_SIMD_SSE2)
+	for (; e - b >= 16; b += 16) {
+		auto m = set::sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b)));
+		if (auto bits = static_cast<uint32_t>(_mm_movemask_epi8(m))) {
+			return b + details::ctz32(bits);
+		}
+	}
+#elif defined(TF_SIMD_NEON)
+	for (; e - b >= 16; b += 16) {
+		auto m = set::neon(vld1q_u8(reinterpret_cast<const uint8_t*>(b)));
+		// Narrow each byte's match to a nibble, so the 16 results fit in one 64 bit integer
+		auto bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (bits) {
+			return b + (details::ctz64(bits) >> 2);
+		}
+	}
+#endif
+	for (; b != e; ++b) {
+		if (set::scalar(*b)) {
+			return b;
+		}
+	}
+	return e;
+}
+
+// Finds the first byte in [b, e) that is not ASCII, or e if there is none
+inline const char* find_non_ascii(const char* b, const char* e) {
+#if defined(TF_SIMD_SSE2)
+	for (; e - b >= 16; b += 16) {
+		if (auto bits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b))))) {
+			return b + details::ctz32(bits);
+		}
+	}
+#elif defined(TF_SIMD_NEON)
+	for (; e - b >= 16; b += 16) {
+		auto m = vcgeq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(b)), vdupq_n_u8(0x80));
+		auto bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (bits) {
+			return b + (details::ctz64(bits) >> 2);
+		}
+	}
+#endif
+	for (; b != e; ++b) {
+		if (static_cast<uint8_t>(*b) >= 0x80) {
+			return b;
+		}
+	}
+	return e;
+}
+
+}
+
+#endif
@@ -18,17 +18,137 @@
 #include "state.hpp"
 #include "shared.hpp"
 #include "base64.hpp"
+#include "profile.hpp"
 #include <xxhash.h>
 #include <sqlite3.h>
 #include <array>
-#include <map>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <iostream>
 #include <stdexcept>
+#include <cstring>
 
-// SQLite use is completely contained in this file and hidden from the rest of the codebase
-// Only begin() and commit() hint at there being a database for storage, but they would also be useful for other storage backends
+// Storage backends are completely contained in this file and hidden from the rest of the codebase
+// Only begin() and commit() hint at there being a database for storage, but other backends are free to ignore them
 
 namespace Transfuse {
 
+using style_view = std::pair<std::string_view, std::string_view>;
+
+struct StateBackend {
+	virtual ~StateBackend() = default;
+
+	virtual void begin() {}
+	virtual void commit() {}
+
+	virtual void info(std::string_view key, std::string_view val) = 0;
+	virtual std::string info(std::string_view key) = 0;
+
+	virtual void style(std::string_view tag, std::string_view hash, std::string_view otag, std::string_view ctag) = 0;
+	// Returned views must remain valid for as long as the backend lives
+	virtual style_view style(std::string_view tag, std::string_view hash) = 0;
+};
+
+// Open-addressing hash table of styles keyed on (tag, hash), looked up directly by string_view so that finding a style never allocates
+// Entries are views, either into the table's own arena or into storage that the owner guarantees outlives the table
+struct StyleTable {
+	struct Entry {
+		uint64_t h = 0;
+		std::string_view tag;
+		std::string_view hash;
+		style_view oc;
+	};
+
+	std::vector<Entry> slots;
+	size_t count = 0;
+	std::deque<std::string> arena;
+
+	static uint64_t key(std::string_view tag, std::string_view hash) {
+		auto h = XXH64(hash.data(), hash.size(), XXH64(tag.data(), tag.size(), 0));
+		// 0 marks an empty slot
+		return h ? h : 1;
+	}
+
+	std::string_view own(std::string_view sv) {
+		arena.emplace_back(sv.begin(), sv.end());
+		return arena.back();
+	}
+
+	Entry* find(std::string_view tag, std::string_view hash, uint64_t h) {
+		if (slots.empty()) {
+			return nullptr;
+		}
+		auto mask = slots.size() - 1;
+		for (auto i = SZ(h) & mask; ; i = (i + 1) & mask) {
+			auto& e = slots[i];
+			if (e.h == 0) {
+				return &e;
+			}
+			if (e.h == h && e.hash == hash && e.tag == tag) {
+				return &e;
+			}
+		}
+	}
+
+	style_view find(std::string_view tag, std::string_view hash) {
+		auto e = find(tag, hash, key(tag, hash));
+		if (e == nullptr || e->h == 0) {
+			return {};
+		}
+		return e->oc;
+	}
+
+	void grow() {
+		std::vector<Entry> old(std::max(SZ(64), slots.size() * 2));
+		old.swap(slots);
+		auto mask = slots.size() - 1;
+		for (auto& e : old) {
+			if (e.h == 0) {
+				continue;
+			}
+			auto i = SZ(e.h) & mask;
+			while (slots[i].h != 0) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = e;
+		}
+	}
+
+	// Adds or replaces a style, and returns whether anything actually changed
+	bool insert(std::string_view tag, std::string_view hash, std::string_view otag, std::string_view ctag, bool copy = true) {
+		if ((count + 1) * 2 > slots.size()) {
+			grow();
+		}
+
+		auto h = key(tag, hash);
+		auto e = find(tag, hash, h);
+		if (e->h != 0) {
+			if (e->oc.first == otag && e->oc.second == ctag) {
+				return false;
+			}
+		}
+		else {
+			e->h = h;
+			e->tag = copy ? own(tag) : tag;
+			e->hash = copy ? own(hash) : hash;
+			++count;
+		}
+		e->oc = copy ? style_view{ own(otag), own(ctag) } : style_view{ otag, ctag };
+		return true;
+	}
+
+	template<typename F>
+	void each(F f) const {
+		for (auto& e : slots) {
+			if (e.h != 0) {
+				f(e);
+			}
+		}
+	}
+};
+
 inline auto sqlite3_exec(sqlite3* db, const char* sql) {
 	return ::sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
 }
@@ -71,13 +191,11 @@ enum Stmt {
 	num_stmts
 };
 
-struct State::impl {
-	std::string name;
-	std::string format;
-	std::string stream;
-	std::string tmp_s;
-
-	std::map<std::string, std::map<std::string, std::pair<std::string, std::string>>> styles;
+// Stores state in state.sqlite3, which is also easy to inspect and modify with external tools
+struct SQLiteBackend final : StateBackend {
+	// Holds everything written or read so far, so that re-inserting an identical style doesn't touch the database
+	StyleTable styles;
+	bool loaded = false;
 
 	sqlite3* db = nullptr;
 	std::array<sqlite3_stmt_h, num_stmts> stmts;
@@ -86,69 +204,363 @@ struct State::impl {
 		return stmts[s];
 	}
 
-	~impl() {
+	SQLiteBackend(const fs::path& tmpdir, bool ro) {
+		if (sqlite3_initialize() != SQLITE_OK) {
+			throw std::runtime_error("sqlite3_initialize() errored");
+		}
+
+		int flags = ro ? (SQLITE_OPEN_READONLY) : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+		if (sqlite3_open_v2((tmpdir / "state.sqlite3").string().c_str(), &db, flags, nullptr) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3_open_v2() error: ", sqlite3_errmsg(db)));
+		}
+
+		// All the write operations and writing prepared statements
+		if (!ro) {
+			if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS info (key TEXT PRIMARY KEY NOT NULL, value TEXT NOT NULL)") != SQLITE_OK) {
+				throw std::runtime_error(concat("sqlite3 error while creating info table: ", sqlite3_errmsg(db)));
+			}
+
+			if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS styles (tag TEXT NOT NULL, hash TEXT NOT NULL, otag TEXT NOT NULL, ctag TEXT NOT NULL, PRIMARY KEY (tag, hash))") != SQLITE_OK) {
+				throw std::runtime_error(concat("sqlite3 error while creating inlines table: ", sqlite3_errmsg(db)));
+			}
+
+			if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO info (key, value) VALUES (:key, :value)", -1, &stm(info_ins)(), nullptr) != SQLITE_OK) {
+				throw std::runtime_error(concat("sqlite3 error preparing insert into info table: ", sqlite3_errmsg(db)));
+			}
+
+			if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO styles (tag, hash, otag, ctag) VALUES (:tag, :hash, :otag, :ctag)", -1, &stm(style_ins)(), nullptr) != SQLITE_OK) {
+				throw std::runtime_error(concat("sqlite3 error preparing insert into styles table: ", sqlite3_errmsg(db)));
+			}
+		}
+
+		// All the reading prepared statements
+		if (sqlite3_prepare_v2(db, "SELECT value FROM info WHERE key = :key", -1, &stm(info_sel)(), nullptr) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error preparing select from info table: ", sqlite3_errmsg(db)));
+		}
+
+		if (sqlite3_prepare_v2(db, "SELECT tag, hash, otag, ctag FROM styles", -1, &stm(style_sel)(), nullptr) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error preparing select from styles table: ", sqlite3_errmsg(db)));
+		}
+	}
+
+	~SQLiteBackend() {
 		for (auto& stm : stmts) {
 			stm.clear();
 		}
 		sqlite3_close(db);
 	}
+
+	void begin() final {
+		if (sqlite3_exec(db, "BEGIN") != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error while beginning transaction: ", sqlite3_errmsg(db)));
+		}
+	}
+
+	void commit() final {
+		if (sqlite3_exec(db, "COMMIT") != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error while committing transaction: ", sqlite3_errmsg(db)));
+		}
+	}
+
+	void info(std::string_view key, std::string_view val) final {
+		stm(info_ins).reset();
+		if (sqlite3_bind_text(stm(info_ins), 1, key.data(), SI(key.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for key: ", sqlite3_errmsg(db)));
+		}
+		if (sqlite3_bind_text(stm(info_ins), 2, val.data(), SI(val.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for value: ", sqlite3_errmsg(db)));
+		}
+		if (sqlite3_step(stm(info_ins)) != SQLITE_DONE) {
+			throw std::runtime_error(concat("sqlite3 error inserting into info table: ", sqlite3_errmsg(db)));
+		}
+	}
+
+	std::string info(std::string_view key) final {
+		std::string rv;
+
+		stm(info_sel).reset();
+		if (sqlite3_bind_text(stm(info_sel), 1, key.data(), SI(key.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for key: ", sqlite3_errmsg(db)));
+		}
+
+		int r = 0;
+		while ((r = sqlite3_step(stm(info_sel))) == SQLITE_ROW) {
+			rv = reinterpret_cast<const char*>(sqlite3_column_text(stm(info_sel), 0));
+		}
+
+		return rv;
+	}
+
+	void style(std::string_view tag, std::string_view hash, std::string_view otag, std::string_view ctag) final {
+		if (!styles.insert(tag, hash, otag, ctag)) {
+			return;
+		}
+		Profile::count(Profile::styles_stored);
+
+		stm(style_ins).reset();
+		if (sqlite3_bind_text(stm(style_ins), 1, tag.data(), SI(tag.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for tag: ", sqlite3_errmsg(db)));
+		}
+		if (sqlite3_bind_text(stm(style_ins), 2, hash.data(), SI(hash.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for hash: ", sqlite3_errmsg(db)));
+		}
+		if (sqlite3_bind_text(stm(style_ins), 3, otag.data(), SI(otag.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for otag: ", sqlite3_errmsg(db)));
+		}
+		if (sqlite3_bind_text(stm(style_ins), 4, ctag.data(), SI(ctag.size()), SQLITE_STATIC) != SQLITE_OK) {
+			throw std::runtime_error(concat("sqlite3 error trying to bind text for ctag: ", sqlite3_errmsg(db)));
+		}
+		if (sqlite3_step(stm(style_ins)) != SQLITE_DONE) {
+			throw std::runtime_error(concat("sqlite3 error inserting into styles table: ", sqlite3_errmsg(db)));
+		}
+	}
+
+	style_view style(std::string_view tag, std::string_view hash) final {
+		if (!loaded) {
+			stm(style_sel).reset();
+			int r = 0;
+			while ((r = sqlite3_step(stm(style_sel))) == SQLITE_ROW) {
+				auto t = reinterpret_cast<const char*>(sqlite3_column_text(stm(style_sel), 0));
+				auto h = reinterpret_cast<const char*>(sqlite3_column_text(stm(style_sel), 1));
+				auto o = reinterpret_cast<const char*>(sqlite3_column_text(stm(style_sel), 2));
+				auto c = reinterpret_cast<const char*>(sqlite3_column_text(stm(style_sel), 3));
+				styles.insert(t, h, o, c);
+			}
+			loaded = true;
+		}
+
+		return styles.find(tag, hash);
+	}
 };
 
-State::State(fs::path tmpdir, bool ro)
-  : tmpdir(tmpdir)
-  , s(std::make_unique<impl>())
-{
-	if (sqlite3_initialize() != SQLITE_OK) {
-		throw std::runtime_error("sqlite3_initialize() errored");
+// Snapshot layout: magic, then the info count and key/value pairs, then the style count and tag/hash/otag/ctag quads
+// Every string is a little-endian uint32 length followed by that many bytes
+constexpr std::string_view snapshot_magic{ "TFSTATE1" };
+
+// Keeps all state in hash tables, saved as a compact binary snapshot in state.bin and memory-mapped when reading it back
+struct MemoryBackend final : StateBackend {
+	fs::path fn;
+	bool ro = false;
+	bool persist = true;
+	bool dirty = false;
+
+	std::unique_ptr<MappedFile> mapped;
+	std::deque<std::string> owned;
+	std::unordered_map<std::string_view, std::string_view> infos;
+	StyleTable styles;
+
+	MemoryBackend(const fs::path& tmpdir, bool ro, bool persist = true)
+	  : fn(tmpdir / "state.bin")
+	  , ro(ro)
+	  , persist(persist)
+	{
+		// Without persist, starts out empty, as whatever is in the folder belongs to someone else
+		if (persist && fs::exists(fn)) {
+			load();
+		}
+		else if (persist && ro) {
+			throw std::runtime_error(concat("State snapshot did not exist: ", fn.string()));
+		}
+	}
+
+	~MemoryBackend() {
+		if (dirty && persist) {
+			try {
+				save();
+			}
+			catch (std::exception& e) {
+				std::cerr << "Could not save state snapshot: " << e.what() << std::endl;
+			}
+		}
+	}
+
+	std::string_view own(std::string_view sv) {
+		owned.emplace_back(sv.begin(), sv.end());
+		return owned.back();
 	}
 
-	int flags = ro ? (SQLITE_OPEN_READONLY) : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
-	if (sqlite3_open_v2((tmpdir / "state.sqlite3").string().c_str(), &s->db, flags, nullptr) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3_open_v2() error: ", sqlite3_errmsg(s->db)));
+	void load() {
+		mapped = std::make_unique<MappedFile>(fn);
+		std::string_view data(mapped->data, mapped->size);
+
+		auto corrupt = [&]() {
+			return std::runtime_error(concat("State snapshot was corrupt: ", fn.string()));
+		};
+		auto get_u32 = [&]() {
+			uint32_t v = 0;
+			if (data.size() < sizeof(v)) {
+				throw corrupt();
+			}
+			memcpy(&v, data.data(), sizeof(v));
+			data.remove_prefix(sizeof(v));
+			return to_little_endian(v);
+		};
+		// When writable, entries may be replaced and the snapshot rewritten, so they can't point into the mapping
+		auto get_str = [&]() {
+			auto len = get_u32();
+			if (data.size() < len) {
+				throw corrupt();
+			}
+			auto rv = data.substr(0, len);
+			data.remove_prefix(len);
+			return ro ? rv : own(rv);
+		};
+
+		if (data.substr(0, snapshot_magic.size()) != snapshot_magic) {
+			throw corrupt();
+		}
+		data.remove_prefix(snapshot_magic.size());
+
+		for (auto n = get_u32(); n; --n) {
+			auto key = get_str();
+			infos[key] = get_str();
+		}
+		for (auto n = get_u32(); n; --n) {
+			auto tag = get_str();
+			auto hash = get_str();
+			auto otag = get_str();
+			auto ctag = get_str();
+			styles.insert(tag, hash, otag, ctag, false);
+		}
+
+		if (!ro) {
+			mapped.reset();
+		}
 	}
 
-	// All the write operations and writing prepared statements
-	if (!ro) {
-		if (sqlite3_exec(s->db, "CREATE TABLE IF NOT EXISTS info (key TEXT PRIMARY KEY NOT NULL, value TEXT NOT NULL)") != SQLITE_OK) {
-			throw std::runtime_error(concat("sqlite3 error while creating info table: ", sqlite3_errmsg(s->db)));
+	void save() {
+		std::string buf;
+		auto put_u32 = [&](size_t v) {
+			auto le = to_little_endian(static_cast<uint32_t>(v));
+			buf.append(reinterpret_cast<const char*>(&le), sizeof(le));
+		};
+		auto put_str = [&](std::string_view sv) {
+			put_u32(sv.size());
+			buf.append(sv.begin(), sv.end());
+		};
+
+		buf += snapshot_magic;
+		put_u32(infos.size());
+		for (auto& kv : infos) {
+			put_str(kv.first);
+			put_str(kv.second);
 		}
+		put_u32(styles.count);
+		styles.each([&](const StyleTable::Entry& e) {
+			put_str(e.tag);
+			put_str(e.hash);
+			put_str(e.oc.first);
+			put_str(e.oc.second);
+		});
+
+		// Write a new file and move it in place, so that a failed save doesn't leave a truncated snapshot
+		auto tmp = fn;
+		tmp += ".tmp";
+		file_save(tmp, buf);
+		fs::rename(tmp, fn);
+		dirty = false;
+	}
 
-		if (sqlite3_exec(s->db, "CREATE TABLE IF NOT EXISTS styles (tag TEXT NOT NULL, hash TEXT NOT NULL, otag TEXT NOT NULL, ctag TEXT NOT NULL, PRIMARY KEY (tag, hash))") != SQLITE_OK) {
-			throw std::runtime_error(concat("sqlite3 error while creating inlines table: ", sqlite3_errmsg(s->db)));
+	void commit() final {
+		if (dirty && persist) {
+			save();
 		}
+	}
 
-		if (sqlite3_prepare_v2(s->db, "INSERT OR REPLACE INTO info (key, value) VALUES (:key, :value)", -1, &s->stm(info_ins)(), nullptr) != SQLITE_OK) {
-			throw std::runtime_error(concat("sqlite3 error preparing insert into info table: ", sqlite3_errmsg(s->db)));
+	void info(std::string_view key, std::string_view val) final {
+		auto it = infos.find(key);
+		if (it == infos.end()) {
+			infos[own(key)] = own(val);
+		}
+		else {
+			it->second = own(val);
 		}
+		dirty = true;
+	}
 
-		if (sqlite3_prepare_v2(s->db, "INSERT OR REPLACE INTO styles (tag, hash, otag, ctag) VALUES (:tag, :hash, :otag, :ctag)", -1, &s->stm(style_ins)(), nullptr) != SQLITE_OK) {
-			throw std::runtime_error(concat("sqlite3 error preparing insert into styles table: ", sqlite3_errmsg(s->db)));
+	std::string info(std::string_view key) final {
+		auto it = infos.find(key);
+		if (it == infos.end()) {
+			return {};
 		}
+		return std::string(it->second.begin(), it->second.end());
 	}
 
-	// All the reading prepared statements
-	if (sqlite3_prepare_v2(s->db, "SELECT value FROM info WHERE key = :key", -1, &s->stm(info_sel)(), nullptr) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error preparing select from info table: ", sqlite3_errmsg(s->db)));
+	void style(std::string_view tag, std::string_view hash, std::string_view otag, std::string_view ctag) final {
+		if (styles.insert(tag, hash, otag, ctag)) {
+			Profile::count(Profile::styles_stored);
+			dirty = true;
+		}
 	}
 
-	if (sqlite3_prepare_v2(s->db, "SELECT tag, hash, otag, ctag FROM styles", -1, &s->stm(style_sel)(), nullptr) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error preparing select from styles table: ", sqlite3_errmsg(s->db)));
+	style_view style(std::string_view tag, std::string_view hash) final {
+		return styles.find(tag, hash);
+	}
+};
+
+struct State::impl {
+	std::string name;
+	std::string format;
+	std::string stream;
+	std::string tmp_s;
+	std::shared_ptr<MappedFile> original;
+
+	std::unique_ptr<StateBackend> backend;
+};
+
+bool State::exists(const fs::path& tmpdir) {
+	return fs::exists(tmpdir / "state.bin") || fs::exists(tmpdir / "state.sqlite3");
+}
+
+State::State(fs::path tmpdir, bool ro, Backend backend)
+  : tmpdir(tmpdir)
+  , s(std::make_unique<impl>())
+{
+	if (backend == Backends::detect) {
+		backend = fs::exists(tmpdir / "state.bin") ? Backends::memory : Backends::sqlite;
+	}
+
+	// Only one kind of state may exist in a folder, or detection would be ambiguous
+	if (!ro && backend != Backends::transient) {
+		fs::remove(tmpdir / (backend == Backends::memory ? "state.sqlite3" : "state.bin"));
+	}
+
+	if (backend == Backends::transient) {
+		transient = true;
+		s->backend = std::make_unique<MemoryBackend>(tmpdir, ro, false);
+	}
+	else if (backend == Backends::memory) {
+		s->backend = std::make_unique<MemoryBackend>(tmpdir, ro);
+	}
+	else if (backend == Backends::sqlite) {
+		s->backend = std::make_unique<SQLiteBackend>(tmpdir, ro);
+	}
+	else {
+		throw std::runtime_error(concat("Unknown state backend: ", backend));
 	}
 }
 
 State::~State() {
 }
 
-void State::begin() {
-	if (sqlite3_exec(s->db, "BEGIN") != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error while beginning transaction: ", sqlite3_errmsg(s->db)));
+std::string_view State::original() {
+	if (!s->original) {
+		s->original = std::make_shared<MappedFile>(tmpdir / "original");
 	}
+	return s->original->view();
+}
+
+void State::original(std::shared_ptr<MappedFile> mapped) {
+	s->original = std::move(mapped);
+}
+
+void State::begin() {
+	s->backend->begin();
 }
 
 void State::commit() {
-	if (sqlite3_exec(s->db, "COMMIT") != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error while committing transaction: ", sqlite3_errmsg(s->db)));
-	}
+	Profile::Timer timer("state.commit");
+	s->backend->commit();
 }
 
 void State::name(std::string_view val) {
@@ -188,31 +600,25 @@ std::string_view State::stream() {
 }
 
 void State::info(std::string_view key, std::string_view val) {
-	s->stm(info_ins).reset();
-	if (sqlite3_bind_text(s->stm(info_ins), 1, key.data(), SI(key.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for key: ", sqlite3_errmsg(s->db)));
-	}
-	if (sqlite3_bind_text(s->stm(info_ins), 2, val.data(), SI(val.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for value: ", sqlite3_errmsg(s->db)));
-	}
-	if (sqlite3_step(s->stm(info_ins)) != SQLITE_DONE) {
-		throw std::runtime_error(concat("sqlite3 error inserting into info table: ", sqlite3_errmsg(s->db)));
-	}
+	s->backend->info(key, val);
 }
 
 std::string State::info(std::string_view key) {
-	std::string rv;
-
-	s->stm(info_sel).reset();
-	if (sqlite3_bind_text(s->stm(info_sel), 1, key.data(), SI(key.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for key: ", sqlite3_errmsg(s->db)));
-	}
+	return s->backend->info(key);
+}
 
-	int r = 0;
-	while ((r = sqlite3_step(s->stm(info_sel))) == SQLITE_ROW) {
-		rv = reinterpret_cast<const char*>(sqlite3_column_text(s->stm(info_sel), 0));
-	}
+static void hash_style(std::string& rv, std::string_view otag, std::string_view ctag) {
+	// Make sure that empty opening or closing tag still causes a difference
+	rv.assign(otag.begin(), otag.end());
+	rv += TFI_HASH_SEP;
+	rv += ctag;
+	auto h32 = XXH32(rv.data(), rv.size(), 0);
+	base64_url(rv, h32);
+}
 
+std::string State::style_hash(std::string_view otag, std::string_view ctag) {
+	std::string rv;
+	hash_style(rv, otag, ctag);
 	return rv;
 }
 
@@ -221,62 +627,14 @@ xmlChar_view State::style(xmlChar_view _name, xmlChar_view _otag, xmlChar_view _
 	auto otag = x2s(_otag);
 	auto ctag = x2s(_ctag);
 
-	// Make sure that empty opening or closing tag still causes a difference
-	s->tmp_s.assign(otag.begin(), otag.end());
-	s->tmp_s += TFI_HASH_SEP;
-	s->tmp_s += ctag;
-	auto h32 = XXH32(s->tmp_s.data(), s->tmp_s.size(), 0);
-	base64_url(s->tmp_s, h32);
-
-	s->stm(style_ins).reset();
-	if (sqlite3_bind_text(s->stm(style_ins), 1, name.data(), SI(name.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for tag: ", sqlite3_errmsg(s->db)));
-	}
-	if (sqlite3_bind_text(s->stm(style_ins), 2, s->tmp_s.data(), SI(s->tmp_s.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for hash: ", sqlite3_errmsg(s->db)));
-	}
-	if (sqlite3_bind_text(s->stm(style_ins), 3, otag.data(), SI(otag.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for otag: ", sqlite3_errmsg(s->db)));
-	}
-	if (sqlite3_bind_text(s->stm(style_ins), 4, ctag.data(), SI(ctag.size()), SQLITE_STATIC) != SQLITE_OK) {
-		throw std::runtime_error(concat("sqlite3 error trying to bind text for ctag: ", sqlite3_errmsg(s->db)));
-	}
-	if (sqlite3_step(s->stm(style_ins)) != SQLITE_DONE) {
-		throw std::runtime_error(concat("sqlite3 error inserting into styles table: ", sqlite3_errmsg(s->db)));
-	}
+	hash_style(s->tmp_s, otag, ctag);
+	s->backend->style(name, s->tmp_s, otag, ctag);
 
 	return s2x(s->tmp_s);
 }
 
 std::pair<std::string_view, std::string_view> State::style(std::string_view tag, std::string_view hash) {
-	if (s->styles.empty()) {
-		std::string t;
-		std::string h;
-		std::string o;
-		std::string c;
-		s->stm(style_sel).reset();
-		int r = 0;
-		while ((r = sqlite3_step(s->stm(style_sel))) == SQLITE_ROW) {
-			t = reinterpret_cast<const char*>(sqlite3_column_text(s->stm(style_sel), 0));
-			h = reinterpret_cast<const char*>(sqlite3_column_text(s->stm(style_sel), 1));
-			o = reinterpret_cast<const char*>(sqlite3_column_text(s->stm(style_sel), 2));
-			c = reinterpret_cast<const char*>(sqlite3_column_text(s->stm(style_sel), 3));
-			s->styles[t][h] = std::make_pair(o, c);
-		}
-	}
-
-	s->tmp_s.assign(tag.begin(), tag.end());
-	auto t = s->styles.find(s->tmp_s);
-	if (t == s->styles.end()) {
-		return {};
-	}
-
-	s->tmp_s.assign(hash.begin(), hash.end());
-	auto oc = t->second.find(s->tmp_s);
-	if (oc == t->second.end()) {
-		return {};
-	}
-	return { oc->second.first, oc->second.second };
+	return s->backend->style(tag, hash);
 }
 
 }
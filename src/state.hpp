@@ -27,14 +27,35 @@
 
 namespace Transfuse {
 
+struct MappedFile;
+
+namespace Backends {
+	const std::string_view detect{ "detect" };
+	const std::string_view sqlite{ "sqlite" };
+	const std::string_view memory{ "memory" };
+	// Like memory, but never read from or saved to the folder, for when extraction and injection happen in the same process
+	const std::string_view transient{ "transient" };
+}
+using Backend = std::string_view;
+
 struct State {
 	fs::path tmpdir;
 	bool opt_verbose = false;
 	bool opt_debug = false;
+	// Nothing will read the folder after this process, so files that only later runs need can be skipped
+	bool transient = false;
 
-	State(fs::path, bool ro = false);
+	// Backends::detect picks whichever kind of state already exists in the folder, falling back to SQLite
+	State(fs::path, bool ro = false, Backend backend = Backends::detect);
 	~State();
 
+	// Whether the folder contains state from any backend
+	static bool exists(const fs::path&);
+
+	// The input document, memory-mapped from the folder's copy on first use, unless extract() already handed over the mapping it detected the format with
+	std::string_view original();
+	void original(std::shared_ptr<MappedFile>);
+
 	void begin();
 	void commit();
 
@@ -55,12 +76,23 @@ struct State {
 		return XV2SV(style(XCV(name), XCV(otag), XCV(ctag)));
 	}
 	std::pair<std::string_view, std::string_view> style(std::string_view, std::string_view);
+	// The hash style() would file a tag pair under, without touching any state, so it can be computed from any thread
+	static std::string style_hash(std::string_view otag, std::string_view ctag);
 
 protected:
 	struct impl;
 	std::unique_ptr<impl> s;
 };
 
+// What extract() produced, so that clean mode can hand it straight to inject() without a round trip through the folder
+struct Extraction {
+	fs::path tmpdir;
+	xmlString stream;
+	std::string content;
+	// Null if the state had to be closed, in which case injection reopens it from the folder
+	std::unique_ptr<State> state;
+};
+
 }
 
 #endif
@@ -19,24 +19,31 @@
 #include "xml.hpp"
 #include "shared.hpp"
 #include "stream.hpp"
-#include <unicode/utext.h>
-#include <unicode/regex.h>
+#include "simd.hpp"
+#include <algorithm>
+#include <array>
 #include <vector>
 #include <string>
 #include <memory>
-using namespace icu;
+#include <cstring>
 
 namespace Transfuse {
 
 // Output functions
 
 static void escape_meta(xmlString& s, std::string_view xc) {
-	for (auto c : xc) {
+	auto b = xc.data();
+	auto e = b + xc.size();
+	while (b != e) {
 		// ToDo: Should only need to escape []: https://github.com/apertium/apertium/issues/79
-		if (c == '^' || c == '$' || c == '[' || c == ']' || c == '{' || c == '}' || c == '/' || c == '\\') {
-			s += '\\';
+		auto n = find_any<'^', '$', '[', ']', '{', '}', '/', '\\'>(b, e);
+		s.append(reinterpret_cast<const xmlChar*>(b), SZ(n - b));
+		if (n == e) {
+			break;
 		}
-		s += static_cast<xmlChar>(c);
+		s += '\\';
+		s += static_cast<xmlChar>(*n);
+		b = n + 1;
 	}
 }
 static void escape_meta(xmlString& s, xmlChar_view xc) {
@@ -45,6 +52,14 @@ static void escape_meta(xmlString& s, xmlChar_view xc) {
 
 static void escape_body(xmlString& s, std::string_view xc) {
 	for (size_t i = 0; i < xc.size(); ++i) {
+		// Copy everything up to the next byte that needs escaping or is the start of a marker
+		auto n = SZ(find_any<'^', '$', '[', ']', '{', '}', '/', '\\', '@', '<', '>', '\xee'>(xc.data() + i, xc.data() + xc.size()) - xc.data());
+		s.append(reinterpret_cast<const xmlChar*>(xc.data()) + i, n - i);
+		i = n;
+		if (i == xc.size()) {
+			break;
+		}
+
 		if (xc[i] == '^' || xc[i] == '$' || xc[i] == '[' || xc[i] == ']' || xc[i] == '{' || xc[i] == '}' || xc[i] == '/' || xc[i] == '\\' || xc[i] == '@' || xc[i] == '<' || xc[i] == '>') {
 			s += '\\';
 		}
@@ -95,68 +110,61 @@ static void escape_body(xmlString& s, xmlChar_view xc) {
 
 // Stores the protected content as a style, but leaves the markers for later superblank treatment
 void ApertiumStream::protect_to_styles(xmlString& styled, State& state) {
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-
-	// Merge protected regions if they only have whitespace between them
-	auto rx_prots = std::make_unique<RegexMatcher>(R"X(\uE021([\s\r\n\p{Z}]*)\uE020)X", 0, status);
-
-	utext_openUTF8(tmp_ut, styled);
-	rx_prots->reset(&tmp_ut);
+	protect_to_markers(styled, state);
+}
 
+void merge_protected(xmlString& styled) {
 	xmlString ns;
 	ns.reserve(styled.size());
 
-	int32_t last = 0;
-	while (rx_prots->find()) {
-		auto b = rx_prots->start(status);
-		ns.append(styled.begin() + last, styled.begin() + b);
-		auto b1 = rx_prots->start(1, status);
-		auto e1 = rx_prots->end(1, status);
-		ns.append(styled.begin() + b1, styled.begin() + e1);
-		last = rx_prots->end(status);
+	auto sv = x2s(styled);
+	size_t last = 0;
+	for (auto b = sv.find(TFP_CLOSE); b != std::string_view::npos; b = sv.find(TFP_CLOSE, b + 1)) {
+		auto ws = b + 3 + prefix_len(sv.substr(b + 3), is_space_cp);
+		if (sv.compare(ws, 3, TFP_OPEN) != 0) {
+			continue;
+		}
+		ns.append(styled.begin() + PD(last), styled.begin() + PD(b));
+		ns.append(styled.begin() + PD(b + 3), styled.begin() + PD(ws));
+		last = ws + 3;
+		b = ws + 2;
 	}
-	ns.append(styled.begin() + last, styled.end());
+	ns.append(styled.begin() + PD(last), styled.end());
 
 	styled.swap(ns);
+}
 
-	// Find all protected regions and store their contents
-	rx_prots = std::make_unique<RegexMatcher>(R"X(\uE020(.*?)\uE021)X", UREGEX_DOTALL, status);
-	RegexMatcher rx_block_start(R"X(>[\s\p{Zs}]*$)X", UREGEX_DOTALL, status);
-	RegexMatcher rx_block_end(R"X(^[\s\p{Zs}]*<)X", UREGEX_DOTALL, status);
+bool at_block_start(xmlChar_view pfx) {
+	auto t = tail_start(x2s(pfx), is_space_cp);
+	return t > 0 && pfx[t - 1] == '>';
+}
+
+bool at_block_end(xmlChar_view sfx) {
+	auto h = prefix_len(x2s(sfx), is_space_cp);
+	return h < sfx.size() && sfx[h] == '<';
+}
 
-	utext_openUTF8(tmp_ut, styled);
-	rx_prots->reset(&tmp_ut);
+void protect_to_markers(xmlString& styled, State& state) {
+	merge_protected(styled);
 
-	ns.resize(0);
+	// Find all protected regions and store their contents
+	xmlString ns;
 	ns.reserve(styled.size());
 	xmlString tmp;
 
-	UText tmp_pfx = UTEXT_INITIALIZER;
-	UText tmp_sfx = UTEXT_INITIALIZER;
-	last = 0;
-	while (rx_prots->find(last, status)) {
-		auto b = rx_prots->start(status);
-		ns.append(styled.begin() + last, styled.begin() + b);
-
-		auto b1 = rx_prots->start(1, status);
-		auto e1 = rx_prots->end(1, status);
-		tmp.assign(styled.begin() + b1, styled.begin() + e1);
-		last = rx_prots->end(status);
-
-		utext_openUTF8(tmp_pfx, ns);
-		utext_openUTF8(tmp_sfx, xmlChar_view(styled).substr(SZ(last)));
-
-		rx_block_start.reset(&tmp_pfx);
-		if (rx_block_start.find()) {
-			// If we are at the beginning of a block tag, just leave the protected inline as-is
-			ns += tmp;
-			continue;
+	auto sv = x2s(styled);
+	size_t last = 0;
+	for (auto b = sv.find(TFP_OPEN); b != std::string_view::npos; b = sv.find(TFP_OPEN, last)) {
+		auto e = sv.find(TFP_CLOSE, b + 3);
+		if (e == std::string_view::npos) {
+			break;
 		}
+		ns.append(styled.begin() + PD(last), styled.begin() + PD(b));
+		tmp.assign(styled.begin() + PD(b + 3), styled.begin() + PD(e));
+		last = e + 3;
 
-		rx_block_end.reset(&tmp_sfx);
-		if (rx_block_end.find()) {
-			// If we are at the end of a block tag, just leave the protected inline as-is
+		if (at_block_start(ns) || at_block_end(xmlChar_view(styled).substr(last))) {
+			// If we are at the beginning or end of a block tag, just leave the protected inline as-is
 			ns += tmp;
 			continue;
 		}
@@ -168,7 +176,7 @@ void ApertiumStream::protect_to_styles(xmlString& styled, State& state) {
 		ns += TFP_CLOSE;
 	}
 
-	ns.append(styled.begin() + last, styled.end());
+	ns.append(styled.begin() + PD(last), styled.end());
 	styled.swap(ns);
 }
 
@@ -212,121 +220,177 @@ fs::path ApertiumStream::get_tmpdir(std::string& line) {
 	return {};
 }
 
-std::istream& ApertiumStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
-	str.clear();
-	block_id.clear();
-
-	if (!in || in.peek() == std::ios::traits_type::eof()) {
-		return in;
+// Tracks where the next of each delimiter is in a block, so each occurrence is found by a single memchr() rather than by looking at every byte
+struct DelimFinder {
+	std::string_view s;
+	std::array<char, 3> cs{ { '\\', '[', ']' } };
+	std::array<size_t, 3> at{};
+	std::array<bool, 3> known{};
+
+	size_t find(size_t k, size_t pos) {
+		if (!known[k] || at[k] < pos) {
+			auto p = pos < s.size() ? static_cast<const char*>(memchr(s.data() + pos, cs[k], s.size() - pos)) : nullptr;
+			at[k] = p ? SZ(p - s.data()) : s.size();
+			known[k] = true;
+		}
+		return at[k];
 	}
 
-	wbs.clear();
-	unesc.clear();
-
-	bool in_blank = false;
-	bool in_wblank = false;
+	// Position of the first of the first n delimiters at or after pos, or the end of the block
+	size_t first(size_t pos, size_t n) {
+		auto rv = find(0, pos);
+		for (size_t k = 1; k < n; ++k) {
+			rv = std::min(rv, find(k, pos));
+		}
+		return rv;
+	}
+};
 
-	char c = 0;
-	int p = 0;
-	while (in.get(c)) {
-		if (c == '\\' && (p = in.peek()) != 0 && p != std::ios::traits_type::eof()) {
-			auto n = static_cast<char>(in.get());
-			if (in_blank) {
-				unesc += n;
+// Handles a complete [...] blank, which is in unesc
+void ApertiumStream::parse_blank(std::string& str, std::string& block_id) {
+	if (unesc[0] == '[' && unesc[1] == '[' && unesc[2] == '/' && unesc[3] == ']' && unesc[4] == ']') {
+		if (!wbs.empty()) {
+			str += TFI_CLOSE;
+		}
+	}
+	else if (unesc[0] == '[' && unesc[1] == '[') {
+		wbs.clear();
+		wb.assign(unesc.begin() + 2, unesc.end() - 2);
+		size_t b = 0;
+		while (b < wb.size()) {
+			size_t e = wb.find(';', b);
+			unesc.assign(wb, b, e - b);
+			trim_wb(unesc);
+			// Deduplicate, and discard non-markup data
+			if (unesc[0] == 't' && unesc[1] == ':') {
+				unesc.erase(0, 2);
+				if (std::find(wbs.begin(), wbs.end(), unesc) == wbs.end()) {
+					wbs.push_back(unesc);
+				}
 			}
-			else {
-				str += n;
+			b = std::max(e, e + 1);
+		}
+		if (!wbs.empty()) {
+			str += TFI_OPEN_B;
+			for (auto& t : wbs) {
+				str += t;
+				str += ";";
 			}
-			continue;
+			str += TFI_OPEN_E;
 		}
-
-		if (c == '\0') {
-			break;
+	}
+	else {
+		auto bb = unesc.find("[tf-block:");
+		auto eb = unesc.find("]", bb);
+		auto bp = unesc.find("[tf:");
+		auto ep = unesc.find("]", bp);
+		if (bb != std::string::npos && eb != std::string::npos) {
+			block_id.assign(unesc.begin() + PD(bb) + 10, unesc.begin() + PD(eb));
 		}
-
-		if (c == '[') {
-			if (in_blank) {
-				in_wblank = true;
+		else if (bp != std::string::npos && ep != std::string::npos) {
+			str += TFP_OPEN;
+			str.append(unesc.begin() + 4, unesc.end() - 1);
+			str += TFP_CLOSE;
+		}
+		else if (unesc.compare("[]") == 0) {
+			if (!str.empty() && str.back() == '.') {
+				str.pop_back();
 			}
-			in_blank = true;
 		}
-		else if (in_wblank && c == ']') {
-			// Do nothing
+		else {
+			str.append(unesc.begin() + 1, unesc.end() - 1);
 		}
-		else if (in_blank && c == ']') {
-			// Do nothing
+	}
+	unesc.clear();
+}
+
+bool ApertiumStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
+	str.clear();
+	block_id.clear();
+
+	// Blocks end at the first \0, as escapes never apply to \0
+	// Only a block that was terminated counts, and trailing unterminated data is ignored
+	constexpr size_t chunk = 1 << 18;
+	size_t scanned = ipos;
+	const char* nul = nullptr;
+	while ((nul = static_cast<const char*>(memchr(ibuf.data() + scanned, 0, ibuf.size() - scanned))) == nullptr) {
+		if (!in) {
+			ibuf.clear();
+			ipos = 0;
+			return false;
 		}
+		ibuf.erase(0, ipos);
+		scanned = ibuf.size();
+		ipos = 0;
+		ibuf.resize(scanned + chunk);
+		in.read(&ibuf[scanned], SS(chunk));
+		ibuf.resize(scanned + SZ(in.gcount()));
+	}
 
-		if (in_blank) {
-			unesc += c;
+	std::string_view blk(ibuf.data() + ipos, SZ(nul - ibuf.data()) - ipos);
+	ipos += blk.size() + 1;
+
+	wbs.clear();
+	unesc.clear();
+
+	DelimFinder df{ blk };
+	size_t i = 0;
+	auto n = blk.size();
+	while (i < n) {
+		// Outside of blanks only \ and [ matter, so copy all text up to those in one go
+		auto d = df.first(i, 2);
+		str.append(blk.data() + i, d - i);
+		i = d;
+		if (i >= n) {
+			break;
 		}
-		else {
-			str += c;
+		if (blk[i] == '\\') {
+			// A trailing \ has nothing to escape, so it is kept
+			str += (i + 1 < n) ? blk[i + 1] : '\\';
+			i += 2;
+			continue;
 		}
 
-		if (in_wblank && c == ']') {
-			in_wblank = false;
-		}
-		else if (in_blank && c == ']') {
-			in_blank = false;
-			if (unesc[0] == '[' && unesc[1] == '[' && unesc[2] == '/' && unesc[3] == ']' && unesc[4] == ']') {
-				if (!wbs.empty()) {
-					str += TFI_CLOSE;
-				}
+		// A blank runs until the matching ], though it may contain a single level of nested [...]
+		unesc += '[';
+		++i;
+		bool in_wblank = false;
+		bool closed = false;
+		while (i < n) {
+			d = df.first(i, 3);
+			unesc.append(blk.data() + i, d - i);
+			i = d;
+			if (i >= n) {
+				break;
 			}
-			else if (unesc[0] == '[' && unesc[1] == '[') {
-				wbs.clear();
-				wb.assign(unesc.begin() + 2, unesc.end() - 2);
-				size_t b = 0;
-				while (b < wb.size()) {
-					size_t e = wb.find(';', b);
-					unesc.assign(wb, b, e - b);
-					trim_wb(unesc);
-					// Deduplicate, and discard non-markup data
-					if (unesc[0] == 't' && unesc[1] == ':') {
-						unesc.erase(0, 2);
-						if (std::find(wbs.begin(), wbs.end(), unesc) == wbs.end()) {
-							wbs.push_back(unesc);
-						}
-					}
-					b = std::max(e, e + 1);
-				}
-				if (!wbs.empty()) {
-					str += TFI_OPEN_B;
-					for (auto& t : wbs) {
-						str += t;
-						str += ";";
-					}
-					str += TFI_OPEN_E;
-				}
+			auto c = blk[i];
+			if (c == '\\') {
+				unesc += (i + 1 < n) ? blk[i + 1] : '\\';
+				i += 2;
+				continue;
+			}
+			unesc += c;
+			++i;
+			if (c == '[') {
+				in_wblank = true;
+			}
+			else if (in_wblank) {
+				in_wblank = false;
 			}
 			else {
-				auto bb = unesc.find("[tf-block:");
-				auto eb = unesc.find("]", bb);
-				auto bp = unesc.find("[tf:");
-				auto ep = unesc.find("]", bp);
-				if (bb != std::string::npos && eb != std::string::npos) {
-					block_id.assign(unesc.begin() + PD(bb) + 10, unesc.begin() + PD(eb));
-				}
-				else if (bp != std::string::npos && ep != std::string::npos) {
-					str += TFP_OPEN;
-					str.append(unesc.begin() + 4, unesc.end() - 1);
-					str += TFP_CLOSE;
-				}
-				else if (unesc.compare("[]") == 0) {
-					if (str.back() == '.') {
-						str.pop_back();
-					}
-				}
-				else {
-					str.append(unesc.begin() + 1, unesc.end() - 1);
-				}
+				closed = true;
+				break;
 			}
+		}
+		// An unterminated blank at the end of a block is dropped
+		if (!closed) {
 			unesc.clear();
+			break;
 		}
+		parse_blank(str, block_id);
 	}
 
-	return in;
+	return true;
 }
 
 }
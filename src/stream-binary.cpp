@@ -0,0 +1,252 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "filesystem.hpp"
+#include "xml.hpp"
+#include "shared.hpp"
+#include "stream.hpp"
+#include "simd.hpp"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <cstring>
+
+namespace Transfuse {
+
+constexpr std::string_view binary_magic{ "TRANSFUSE-BINARY-1:" };
+
+static void put_u32(xmlString& s, size_t v) {
+	if (v > UINT32_MAX) {
+		throw std::runtime_error("Block too large for the binary stream format");
+	}
+	auto le = to_little_endian(static_cast<uint32_t>(v));
+	s.append(reinterpret_cast<const xmlChar*>(&le), sizeof(le));
+}
+
+// Lengths come from whatever wrote the stream, so they are only trusted as far as the data actually goes
+// Strings are read in bounded chunks, so a bogus length runs into the end of the stream instead of allocating that much up front
+constexpr uint32_t max_id = 4096;
+constexpr uint32_t max_tag = 1u << 20;
+constexpr uint32_t max_spans = 1u << 24;
+constexpr size_t read_chunk = 1u << 16;
+
+[[noreturn]] static void cut_off(std::string_view what, std::string_view bid) {
+	if (bid.empty()) {
+		throw std::runtime_error(concat("Binary stream ended in the middle of a block, while reading its ", what));
+	}
+	throw std::runtime_error(concat("Binary stream ended in the middle of block ", bid, ", while reading its ", what));
+}
+
+static void get_u32(std::istream& in, uint32_t& v, std::string_view what, std::string_view bid) {
+	if (!in.read(reinterpret_cast<char*>(&v), sizeof(v))) {
+		cut_off(what, bid);
+	}
+	v = to_little_endian(v);
+}
+
+static void get_str(std::istream& in, std::string& s, uint32_t max, std::string_view what, std::string_view bid) {
+	uint32_t n = 0;
+	get_u32(in, n, what, bid);
+	if (n > max) {
+		throw std::runtime_error(concat("Binary stream had a block ", what, " of ", std::to_string(n), " bytes, more than the ", std::to_string(max), " allowed"));
+	}
+	s.clear();
+	while (s.size() < n) {
+		auto o = s.size();
+		auto c = std::min(SZ(n) - o, read_chunk);
+		s.resize(o + c);
+		if (!in.read(&s[o], SS(c))) {
+			cut_off(what, bid);
+		}
+	}
+}
+
+// Output functions
+
+// The text is sent as-is, so protected regions stay markers just like in the Apertium stream
+void BinaryStream::protect_to_styles(xmlString& styled, State& state) {
+	protect_to_markers(styled, state);
+}
+
+void BinaryStream::stream_header(xmlString& s, fs::path tmpdir) {
+	s += binary_magic;
+	s += tmpdir.string();
+	s += '\n';
+}
+
+void BinaryStream::block_open(xmlString& s, xmlChar_view xc) {
+	put_u32(s, xc.size());
+	s += xc;
+}
+
+// Splits the inline markers out of the body into spans, leaving only the text
+void BinaryStream::block_body(xmlString& s, xmlChar_view xc) {
+	spans.clear();
+	open.clear();
+	text.clear();
+
+	auto sv = x2s(xc);
+	for (size_t i = 0; i < sv.size(); ) {
+		auto n = SZ(find_any<'\xee'>(sv.data() + i, sv.data() + sv.size()) - sv.data());
+		text.append(sv.data() + i, n - i);
+		i = n;
+		if (i == sv.size()) {
+			break;
+		}
+
+		auto m = sv.substr(i, 3);
+		if (m == TFI_OPEN_B || m == TFP_OPEN) {
+			bool inl = (m == TFI_OPEN_B);
+			auto e = sv.find(inl ? TFI_OPEN_E : TFP_CLOSE, i + 3);
+			if (e != std::string_view::npos) {
+				spans.emplace_back();
+				auto& sp = spans.back();
+				sp.offset = static_cast<uint32_t>(text.size());
+				sp.kind = inl ? 'i' : 'p';
+				sp.tag.assign(sv.data() + i + 3, e - i - 3);
+				if (inl) {
+					open.push_back(spans.size() - 1);
+				}
+				else {
+					sp.length = static_cast<uint32_t>(open.size());
+				}
+				i = e + 3;
+				continue;
+			}
+		}
+		else if (m == TFI_CLOSE) {
+			// A close without an open has nothing to end, so is dropped
+			if (!open.empty()) {
+				auto& sp = spans[open.back()];
+				sp.length = static_cast<uint32_t>(text.size() - sp.offset);
+				open.pop_back();
+			}
+			i += 3;
+			continue;
+		}
+		text += sv[i];
+		++i;
+	}
+	// Unclosed spans run to the end of the text
+	for (auto o : open) {
+		spans[o].length = static_cast<uint32_t>(text.size() - spans[o].offset);
+	}
+
+	put_u32(s, spans.size());
+	for (auto& sp : spans) {
+		put_u32(s, sp.offset);
+		put_u32(s, sp.length);
+		s += static_cast<xmlChar>(sp.kind);
+		put_u32(s, sp.tag.size());
+		s.append(reinterpret_cast<const xmlChar*>(sp.tag.data()), sp.tag.size());
+	}
+	put_u32(s, text.size());
+	s.append(reinterpret_cast<const xmlChar*>(text.data()), text.size());
+}
+
+void BinaryStream::block_close(xmlString&, xmlChar_view) {
+	// The lengths already say where the block ends
+}
+
+// Input functions
+
+fs::path BinaryStream::get_tmpdir(std::string& line) {
+	if (line.compare(0, binary_magic.size(), binary_magic.data(), binary_magic.size()) == 0) {
+		return fs::path(line.substr(binary_magic.size()));
+	}
+	return {};
+}
+
+// Reads the lengths and their data, then puts the spans back into the text as inline markers
+// The stream may only end between blocks; anything else means it was cut off, and is an error rather than silently leaving the rest of the document untranslated
+bool BinaryStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
+	str.clear();
+	block_id.clear();
+
+	if (in.peek() == std::char_traits<char>::eof()) {
+		return false;
+	}
+	get_str(in, block_id, max_id, "ID", {});
+
+	uint32_t count = 0;
+	get_u32(in, count, "span count", block_id);
+	if (count > max_spans) {
+		throw std::runtime_error(concat("Binary stream block ", block_id, " had ", std::to_string(count), " spans, more than the ", std::to_string(max_spans), " allowed"));
+	}
+	// Grown one span at a time, so memory follows what was actually read rather than the count
+	spans.clear();
+	for (uint32_t i = 0; i < count; ++i) {
+		spans.emplace_back();
+		auto& sp = spans.back();
+		get_u32(in, sp.offset, "span offset", block_id);
+		get_u32(in, sp.length, "span length", block_id);
+		if (!in.get(sp.kind)) {
+			cut_off("span kind", block_id);
+		}
+		get_str(in, sp.tag, max_tag, "span tag", block_id);
+	}
+	get_str(in, text, UINT32_MAX, "text", block_id);
+
+	// The engine may have moved spans around, so order them by where they start, keeping the order of spans that start at the same offset
+	order.resize(spans.size());
+	std::iota(order.begin(), order.end(), 0);
+	auto tsz = text.size();
+	auto begin_of = [&](size_t s) { return std::min(SZ(spans[s].offset), tsz); };
+	auto end_of = [&](size_t s) { return spans[s].kind == 'p' ? begin_of(s) : std::min(SZ(spans[s].offset) + spans[s].length, tsz); };
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return begin_of(a) < begin_of(b);
+	});
+
+	// Spans are closed innermost first, so one that crosses the end of an enclosing span is extended to the end of that
+	// Of the spans that end right at a point, up to keep are left open
+	open.clear();
+	size_t t = 0;
+	auto close_until = [&](size_t at, size_t keep) {
+		while (!open.empty() && (end_of(open.back()) < at || (end_of(open.back()) == at && open.size() > keep))) {
+			auto e = std::max(t, end_of(open.back()));
+			str.append(text, t, e - t);
+			t = e;
+			str += TFI_CLOSE;
+			open.pop_back();
+		}
+	};
+
+	str.reserve(text.size() + spans.size() * 16);
+	for (auto s : order) {
+		auto b = begin_of(s);
+		close_until(b, spans[s].kind == 'p' ? spans[s].length : 0);
+		if (b > t) {
+			str.append(text, t, b - t);
+			t = b;
+		}
+		if (spans[s].kind == 'p') {
+			str += TFP_OPEN;
+			str += spans[s].tag;
+			str += TFP_CLOSE;
+			continue;
+		}
+		str += TFI_OPEN_B;
+		str += spans[s].tag;
+		str += TFI_OPEN_E;
+		open.push_back(s);
+	}
+	close_until(tsz, 0);
+	str.append(text, t, tsz - t);
+	return true;
+}
+
+}
@@ -19,10 +19,8 @@
 #include "xml.hpp"
 #include "shared.hpp"
 #include "stream.hpp"
-#include <unicode/utext.h>
-#include <unicode/regex.h>
+#include "simd.hpp"
 #include <memory>
-using namespace icu;
 
 namespace Transfuse {
 
@@ -30,6 +28,14 @@ namespace Transfuse {
 
 static void escape_body(xmlString& s, std::string_view xc) {
 	for (size_t i = 0; i < xc.size(); ++i) {
+		// Only markers need treatment, so copy everything up to the next one
+		auto n = SZ(find_any<'\xee'>(xc.data() + i, xc.data() + xc.size()) - xc.data());
+		s.append(reinterpret_cast<const xmlChar*>(xc.data()) + i, n - i);
+		i = n;
+		if (i == xc.size()) {
+			break;
+		}
+
 		if (xc[i] == '\xee' && xc[i + 1] == '\x80' && xc[i + 2] >= '\x91' && xc[i + 2] <= '\x93') {
 			if (xc[i + 2] == '\x91') {
 				s += "\n<STYLE:";
@@ -51,142 +57,137 @@ static void escape_body(xmlString& s, xmlChar_view xc) {
 }
 
 // Turns protected tags to inline tags on the surrounding tokens
-void VISLStream::protect_to_styles(xmlString& styled, State& state) {
-	UText tmp_ut = UTEXT_INITIALIZER;
-	UErrorCode status = U_ZERO_ERROR;
-
-	// Merge protected regions if they only have whitespace between them
-	auto rx_prots = std::make_unique<RegexMatcher>(R"X(\uE021([\s\r\n\p{Z}]*)\uE020)X", 0, status);
-
-	utext_openUTF8(tmp_ut, styled);
-	rx_prots->reset(&tmp_ut);
-
-	xmlString ns;
-	ns.reserve(styled.size());
-
-	int32_t last = 0;
-	while (rx_prots->find()) {
-		auto b = rx_prots->start(status);
-		ns.append(styled.begin() + last, styled.begin() + b);
-		auto b1 = rx_prots->start(1, status);
-		auto e1 = rx_prots->end(1, status);
-		ns.append(styled.begin() + b1, styled.begin() + e1);
-		last = rx_prots->end(status);
+// Whether the text ends with a style's opening marker, E011 tags E012, and then only whitespace, and if so where that marker ends
+static bool at_style_start(xmlChar_view pfx, size_t& end) {
+	auto t = tail_start(x2s(pfx), is_space_cp);
+	if (t < 3 || pfx.compare(t - 3, 3, XC(TFI_OPEN_E)) != 0) {
+		return false;
 	}
-	ns.append(styled.begin() + last, styled.end());
-
-	styled.swap(ns);
-
-	// Find all protected regions and convert them to styles on the surrounding tokens
-	rx_prots = std::make_unique<RegexMatcher>(R"X(\uE020(.*?)\uE021)X", UREGEX_DOTALL, status);
-	RegexMatcher rx_block_start(R"X(>[\s\p{Zs}]*$)X", 0, status);
-	RegexMatcher rx_block_end(R"X(^[\s\p{Zs}]*<)X", 0, status);
+	// There must be a non-empty tag list between the nearest earlier E011 and the E012, with no other E012 in it
+	for (auto i = t - 3; i >= 3; --i) {
+		auto m = x2s(pfx.substr(i - 3, 3));
+		if (m == TFI_OPEN_E) {
+			return false;
+		}
+		if (m == TFI_OPEN_B && i < t - 3) {
+			end = t;
+			return true;
+		}
+	}
+	return false;
+}
 
-	RegexMatcher rx_pfx_style(R"X(\ue013[\s\p{Zs}]*$)X", 0, status);
-	RegexMatcher rx_pfx_token(R"X([^>\s\p{Z}\ue012]+[\s\p{Zs}]*$)X", 0, status);
+// Whether the text ends with a style's closing marker E013 and then only whitespace, and if so where the matching E011 starts
+static bool at_style_end(xmlChar_view pfx, size_t& start) {
+	auto t = tail_start(x2s(pfx), is_space_cp);
+	if (t < 3 || pfx.compare(t - 3, 3, XC(TFI_CLOSE)) != 0) {
+		return false;
+	}
+	size_t depth = 0;
+	for (auto i = t; i >= 3; --i) {
+		auto m = x2s(pfx.substr(i - 3, 3));
+		if (m == TFI_CLOSE) {
+			++depth;
+		}
+		else if (m == TFI_OPEN_B && --depth == 0) {
+			start = i - 3;
+			return true;
+		}
+	}
+	return false;
+}
 
-	RegexMatcher rx_ifx_start(R"X((\ue011[^\ue012]+\ue012)[\s\p{Zs}]*$)X", 0, status);
+// Whether the text ends with a token and then only whitespace, and if so where that token starts
+static bool at_token_end(xmlChar_view pfx, size_t& start) {
+	auto t = tail_start(x2s(pfx), is_space_cp);
+	auto token = x2s(pfx.substr(0, t));
+	auto s = tail_start(token, [](UChar32 c) {
+		return c != '>' && c != 0xE012 && !is_space_cp(c);
+	});
+	if (s == t) {
+		return false;
+	}
+	start = s;
+	return true;
+}
 
-	utext_openUTF8(tmp_ut, styled);
-	rx_prots->reset(&tmp_ut);
+// Turns protected regions into styles on the surrounding tokens
+// This is done in a single pass, looking only at the end of what has been output so far, so it is linear in the size of the document
+void VISLStream::protect_to_styles(xmlString& styled, State& state) {
+	merge_protected(styled);
 
-	ns.resize(0);
+	xmlString ns;
 	ns.reserve(styled.size());
 	xmlString tmp_lxs[2];
 
-	UText tmp_pfx = UTEXT_INITIALIZER;
-	UText tmp_sfx = UTEXT_INITIALIZER;
-	for (size_t i = 0; i < 100; ++i) {
-		last = 0;
-		while (rx_prots->find(last, status)) {
-			auto b = rx_prots->start(status);
-			ns.append(styled.begin() + last, styled.begin() + b);
-
-			auto b1 = rx_prots->start(1, status);
-			auto e1 = rx_prots->end(1, status);
-			tmp_lxs[0].assign(styled.begin() + b1, styled.begin() + e1);
-			last = rx_prots->end(status);
-
-			utext_openUTF8(tmp_pfx, ns);
-			utext_openUTF8(tmp_sfx, xmlChar_view(styled).substr(SZ(last)));
-
-			rx_block_start.reset(&tmp_pfx);
-			if (rx_block_start.find()) {
-				// If we are at the beginning of a block tag, just leave the protected inline as-is
-				ns += tmp_lxs[0];
-				continue;
-			}
-
-			rx_block_end.reset(&tmp_sfx);
-			if (rx_block_end.find()) {
-				// If we are at the end of a block tag, just leave the protected inline as-is
-				ns += tmp_lxs[0];
-				continue;
-			}
-
-			rx_ifx_start.reset(&tmp_pfx);
-			if (rx_ifx_start.find()) {
-				// We're inside at the start of an existing style, so wrap whole inside
-				auto hash = state.style(XC("P"), tmp_lxs[0], XC(""));
-				auto last_s = rx_ifx_start.end(1, status);
-				tmp_lxs[1] = ns.substr(SZ(last_s));
-				ns.resize(SZ(last_s));
-				ns += TFI_OPEN_B "P:";
-				ns += hash;
-				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
-				auto first_c = styled.find(XC(TFI_CLOSE), SZ(last));
-				ns.append(styled, SZ(last), first_c - SZ(last));
+	// A region at the start of a style is wrapped up to the first style end after it, and the closing marker for that is owed until there
+	// Regions after it within the same style end at the same place, so a single position is enough
+	size_t owed_at = 0;
+	size_t owed = 0;
+
+	auto sv = x2s(styled);
+	size_t last = 0;
+	auto copy_until = [&](size_t pos) {
+		if (owed && owed_at < pos) {
+			auto at = std::max(owed_at, last);
+			ns.append(styled.begin() + PD(last), styled.begin() + PD(at));
+			for (; owed; --owed) {
 				ns += TFI_CLOSE;
-				last += SI32(first_c) - last;
-				continue;
 			}
+			last = at;
+		}
+		ns.append(styled.begin() + PD(last), styled.begin() + PD(pos));
+	};
 
-			rx_pfx_style.reset(&tmp_pfx);
-			if (rx_pfx_style.find()) {
-				// Create a new style around the immediately preceding style
-				auto hash = state.style(XC("P"), XC(""), tmp_lxs[0]);
-				auto last_s = ns.rfind(XC(TFI_OPEN_B));
-				tmp_lxs[1] = ns.substr(SZ(last_s));
-				ns.resize(SZ(last_s));
-				ns += TFI_OPEN_B "P:";
-				ns += hash;
-				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
-				ns += TFI_CLOSE;
-				continue;
-			}
+	size_t last_s = 0;
+	for (auto b = sv.find(TFP_OPEN); b != std::string_view::npos; b = sv.find(TFP_OPEN, last)) {
+		auto e = sv.find(TFP_CLOSE, b + 3);
+		if (e == std::string_view::npos) {
+			break;
+		}
+		copy_until(b);
+		tmp_lxs[0].assign(styled.begin() + PD(b + 3), styled.begin() + PD(e));
+		last = e + 3;
 
-			rx_pfx_token.reset(&tmp_pfx);
-			if (rx_pfx_token.find()) {
-				// Create a new style around the immediately preceding token
-				auto hash = state.style(XC("P"), XC(""), tmp_lxs[0]);
-				auto last_s = rx_pfx_token.start(status);
-				tmp_lxs[1] = ns.substr(SZ(last_s));
-				ns.resize(SZ(last_s));
-				ns += TFI_OPEN_B "P:";
-				ns += hash;
-				ns += TFI_OPEN_E;
-				ns += tmp_lxs[1];
-				ns += TFI_CLOSE;
-				continue;
-			}
+		if (at_block_start(ns) || at_block_end(xmlChar_view(styled).substr(last))) {
+			// If we are at the beginning or end of a block tag, just leave the protected inline as-is
+			ns += tmp_lxs[0];
+			continue;
 		}
 
-		if (last == 0) {
-			break;
+		if (at_style_start(ns, last_s)) {
+			// We're inside at the start of an existing style, so wrap whole inside
+			auto hash = state.style(XC("P"), tmp_lxs[0], XC(""));
+			tmp_lxs[1] = ns.substr(last_s);
+			ns.resize(last_s);
+			ns += TFI_OPEN_B "P:";
+			ns += hash;
+			ns += TFI_OPEN_E;
+			ns += tmp_lxs[1];
+			owed_at = std::min(sv.find(TFI_CLOSE, last), sv.size());
+			++owed;
+			continue;
 		}
 
-		ns.append(styled.begin() + last, styled.end());
-		styled.swap(ns);
-		utext_openUTF8(tmp_ut, styled);
-		rx_prots->reset(&tmp_ut);
-		ns.resize(0);
-		ns.reserve(styled.size());
+		if (!at_style_end(ns, last_s) && !at_token_end(ns, last_s)) {
+			continue;
+		}
+		// Create a new style around the immediately preceding style or token
+		auto hash = state.style(XC("P"), XC(""), tmp_lxs[0]);
+		tmp_lxs[1] = ns.substr(last_s);
+		ns.resize(last_s);
+		ns += TFI_OPEN_B "P:";
+		ns += hash;
+		ns += TFI_OPEN_E;
+		ns += tmp_lxs[1];
+		ns += TFI_CLOSE;
 	}
 
-	utext_close(&tmp_pfx);
-	utext_close(&tmp_sfx);
+	copy_until(styled.size());
+	for (; owed; --owed) {
+		ns += TFI_CLOSE;
+	}
+	styled.swap(ns);
 }
 
 void VISLStream::stream_header(xmlString& s, fs::path tmpdir) {
@@ -220,7 +221,7 @@ fs::path VISLStream::get_tmpdir(std::string& line) {
 	return {};
 }
 
-std::istream& VISLStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
+bool VISLStream::get_block(std::istream& in, std::string& str, std::string& block_id) {
 	str.clear();
 	block_id.clear();
 	while (std::getline(in, buffer)) {
@@ -247,7 +248,7 @@ std::istream& VISLStream::get_block(std::istream& in, std::string& str, std::str
 		}
 		str += buffer;
 	}
-	return in;
+	return static_cast<bool>(in);
 }
 
 }
@@ -27,6 +27,7 @@
 #include <unicode/utext.h>
 #include <vector>
 #include <string>
+#include <memory>
 #include <fstream>
 
 namespace Transfuse {
@@ -35,6 +36,7 @@ namespace Streams {
 	const std::string_view detect{ "detect" };
 	const std::string_view apertium{ "apertium" };
 	const std::string_view visl{ "visl" };
+	const std::string_view binary{ "binary" };
 }
 using Stream = std::string_view;
 
@@ -50,7 +52,8 @@ struct StreamBase {
 
 	// Input functions
 	virtual fs::path get_tmpdir(std::string&) = 0;
-	virtual std::istream& get_block(std::istream&, std::string&, std::string&) = 0;
+	// Reads the next block into the body and ID arguments, returning false once there are no more blocks
+	virtual bool get_block(std::istream&, std::string&, std::string&) = 0;
 };
 
 struct ApertiumStream final : StreamBase {
@@ -63,12 +66,18 @@ struct ApertiumStream final : StreamBase {
 
 	// Input functions
 	fs::path get_tmpdir(std::string&) final;
-	std::istream& get_block(std::istream&, std::string&, std::string&) final;
+	bool get_block(std::istream&, std::string&, std::string&) final;
 
 private:
+	void parse_blank(std::string&, std::string&);
+
 	std::vector<std::string> wbs;
 	std::string wb;
 	std::string unesc;
+
+	// Input is read in large chunks, which may hold several blocks
+	std::string ibuf;
+	size_t ipos = 0;
 };
 
 struct VISLStream final : StreamBase {
@@ -81,12 +90,64 @@ struct VISLStream final : StreamBase {
 
 	// Input functions
 	fs::path get_tmpdir(std::string&) final;
-	std::istream& get_block(std::istream&, std::string&, std::string&) final;
+	bool get_block(std::istream&, std::string&, std::string&) final;
 
 private:
 	std::string buffer;
 };
 
+// Length-prefixed blocks for pipelines that can take any framing, so nothing is escaped on output or unescaped on input
+// After a header line, each block is a sequence of little-endian uint32 lengths and counts followed by their data:
+//   block ID length, block ID
+//   span count, then per span: byte offset into the text, byte length, kind ('i' for inline, 'p' for protected), tag length, tag
+//   text length, raw UTF-8 text
+// Spans are in the order they open, inline span tags are ;-separated lists of styles, and protected spans mark the point they were cut from the text
+// A protected span has no extent, so its length is instead how many inline spans are open around it, which places it inside or after spans that end at the same offset
+struct BinaryStream final : StreamBase {
+	// Output functions
+	void protect_to_styles(xmlString&, State&) final;
+	void stream_header(xmlString&, fs::path) final;
+	void block_open(xmlString&, xmlChar_view) final;
+	void block_body(xmlString&, xmlChar_view) final;
+	void block_close(xmlString&, xmlChar_view) final;
+
+	// Input functions
+	fs::path get_tmpdir(std::string&) final;
+	bool get_block(std::istream&, std::string&, std::string&) final;
+
+private:
+	struct Span {
+		uint32_t offset = 0;
+		uint32_t length = 0;
+		char kind = 'i';
+		std::string tag;
+	};
+	std::vector<Span> spans;
+	std::vector<size_t> open;
+	std::vector<size_t> order;
+	std::string text;
+};
+
+// Stores protected regions as styles, but leaves markers in the text for streams that can carry them as-is
+void protect_to_markers(xmlString&, State&);
+
+// Merges protected regions that only have whitespace between them
+void merge_protected(xmlString&);
+// Whether a protected region right after pfx, or right before sfx, is at the beginning or end of a block tag, where it is left as-is
+// Only the end of pfx and the start of sfx are looked at, so these are cheap no matter how much text has been processed
+bool at_block_start(xmlChar_view pfx);
+bool at_block_end(xmlChar_view sfx);
+
+inline std::unique_ptr<StreamBase> make_stream(Stream stream) {
+	if (stream == Streams::visl) {
+		return std::make_unique<VISLStream>();
+	}
+	if (stream == Streams::binary) {
+		return std::make_unique<BinaryStream>();
+	}
+	return std::make_unique<ApertiumStream>();
+}
+
 inline void utext_openUTF8(UText& ut, xmlChar_view xc) {
 	UErrorCode status = U_ZERO_ERROR;
 	utext_openUTF8(&ut, reinterpret_cast<const char*>(xc.data()), SI64(xc.size()), &status);
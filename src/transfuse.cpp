@@ -17,24 +17,38 @@
 
 #include "config.hpp"
 #include "options.hpp"
+#include "arena.hpp"
 #include "base64.hpp"
 #include "filesystem.hpp"
 #include "shared.hpp"
 #include "stream.hpp"
+#include "state.hpp"
+#include "profile.hpp"
 #include <unicode/uclean.h>
+#include <libxml/parser.h>
 #include <xxhash.h>
 #include <iostream>
 #include <fstream>
 #include <random>
 #include <memory>
 #include <stdexcept>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 using namespace icu;
 
 namespace Transfuse {
 
-fs::path extract(fs::path tmpdir, fs::path infile, std::string_view format, Stream stream, bool wipe);
-std::pair<fs::path, std::string> inject(fs::path tmpdir, std::istream& in, Stream stream);
+Extraction extract(fs::path tmpdir, fs::path infile, std::string_view format, Stream stream, bool wipe, Backend backend, const fs::path& cache = {}, const fs::path& since = {});
+std::pair<fs::path, std::string> inject(fs::path tmpdir, std::istream& in, Stream stream, const fs::path& out = {}, const fs::path& cache = {}, bool keep = true);
+std::pair<fs::path, std::string> inject(Extraction& x, const fs::path& out = {}, const fs::path& cache = {}, bool keep = true);
 
 std::istream* read_or_stdin(const char* arg, std::unique_ptr<std::istream>& in) {
 	if (arg[0] == '-' && arg[1] == 0) {
@@ -42,9 +56,7 @@ std::istream* read_or_stdin(const char* arg, std::unique_ptr<std::istream>& in)
 	}
 	in.reset(new std::ifstream(arg, std::ios::binary));
 	if (!in->good()) {
-		std::string msg{"Could not read file "};
-		msg += arg;
-		throw std::runtime_error(msg);
+		throw std::runtime_error(concat("Could not read file ", arg, ": ", std::strerror(errno)));
 	}
 	in->exceptions(std::ios::badbit | std::ios::failbit);
 	return in.get();
@@ -60,32 +72,49 @@ std::ostream* write_or_stdout(const char* arg, std::unique_ptr<std::ostream>& ou
 	}
 	out.reset(new std::ofstream(arg, std::ios::binary));
 	if (!out->good()) {
-		std::string msg{"Could not write file "};
-		msg += arg;
-		throw std::runtime_error(msg);
+		throw std::runtime_error(concat("Could not write file ", arg, ": ", std::strerror(errno)));
 	}
 	out->exceptions(std::ios::badbit | std::ios::failbit);
 	return out.get();
 }
 
-}
+// Everything needed to process a single document
+struct Job {
+	std::string_view mode{ "clean" };
+	std::string_view format{ "auto" };
+	Stream stream{ Streams::detect };
+	Backend backend{ Backends::detect };
+	fs::path tmpdir;
+	fs::path infile;
+	fs::path outfile;
+	fs::path cache;
+	fs::path since;
+	bool keep = false;
+	bool no_keep = false;
+};
 
-int main(int argc, char* argv[]) {
-	using namespace Transfuse;
+inline auto make_tf_options() {
 	using namespace Options;
 
-	auto opts = make_options(
+	return make_options(
 		O('h', "help", "shows this help"),
 		O('?',     "", "shows this help"),
 		spacer(),
 		O('f',  "format", ARG_REQ, "input file format: text, html, html-fragment, line, odt, odp, docx, pptx; defaults to auto"),
-		O('s',  "stream", ARG_REQ, "stream format: apertium, visl; defaults to apertium"),
+		O('s',  "stream", ARG_REQ, "stream format: apertium, visl, binary; defaults to apertium"),
 		O('m',    "mode", ARG_REQ, "operating mode: extract, inject, clean; default depends on executable used"),
+		O(0,     "state", ARG_REQ, "state storage for extraction: sqlite, memory; defaults to memory for clean and --batch, otherwise sqlite"),
 		O('d',     "dir", ARG_REQ, "folder to store state in (implies -k); defaults to creating temporary"),
 		O('k',    "keep",  ARG_NO, "don't delete temporary folder after injection"),
 		O('K', "no-keep",  ARG_NO, "recreate state folder before extraction and delete it after injection"),
 		O('i',   "input", ARG_REQ, "input file, if not passed as arg; default and - is stdin"),
 		O('o',  "output", ARG_REQ, "output file, if not passed as arg; default and - is stdout"),
+		O(0,     "batch",  ARG_NO, "read one job per line from stdin, each line being tab-separated arguments as above; reports results on stdout"),
+		O(0,     "cache", ARG_REQ, "persistent folder for reusing extractions of identical files and translations of unchanged blocks; use one per language pair"),
+		O(0,     "since", ARG_REQ, "only stream blocks that the given state folder has no translations for; injection takes the rest from there, so that folder must have been injected into with --keep or --dir"),
+		O(0,   "profile", ARG_REQ, "write wall time per phase and work counters as JSON to the given file, or a summary to stderr for -"),
+		O('j',    "jobs", ARG_REQ, "number of --batch jobs, or else threads per document, to run in parallel; 0 means one per CPU core; defaults to 1 for --batch and 0 otherwise"),
+		O(0,     "arena",  ARG_NO, "allocate each document's XML from one arena that is released at once when the document is done; mainly for long --batch runs"),
 		O('V', "version",  ARG_NO, "output version information"),
 		// Options after final() are still usable, but not shown in --help
 		final(),
@@ -94,6 +123,313 @@ int main(int argc, char* argv[]) {
 		O(0, "hash64", ARG_REQ, "xxhash64 + base64-url encodes the passed value"),
 		final()
 	);
+}
+
+// Fills in the job from parsed options, and funnels remaining unparsed arguments into input and/or output files
+template<typename Opts>
+void job_options(Opts& opts, int argc, char* argv[], Job& job) {
+	while (auto o = opts.get()) {
+		switch (o->opt) {
+		case 'f':
+			job.format = o->value;
+			break;
+		case 's':
+			if (o->value == Streams::apertium) {
+				job.stream = Streams::apertium;
+			}
+			else if (o->value == Streams::visl) {
+				job.stream = Streams::visl;
+			}
+			else if (o->value == Streams::binary) {
+				job.stream = Streams::binary;
+			}
+			break;
+		case 'm':
+			job.mode = o->value;
+			break;
+		case 0:
+			if (o->longopt == "state") {
+				if (o->value == Backends::sqlite) {
+					job.backend = Backends::sqlite;
+				}
+				else if (o->value == Backends::memory) {
+					job.backend = Backends::memory;
+				}
+			}
+			else if (o->longopt == "cache") {
+				job.cache = path(o->value);
+			}
+			else if (o->longopt == "since") {
+				job.since = path(o->value);
+			}
+			break;
+		case 'd':
+			job.tmpdir = path(o->value);
+			job.keep = true;
+			break;
+		case 'k':
+			job.keep = true;
+			break;
+		case 'K':
+			job.keep = false;
+			job.no_keep = true;
+			break;
+		case 'i':
+			job.infile = path(o->value);
+			break;
+		case 'o':
+			job.outfile = path(o->value);
+			break;
+		}
+	}
+
+	if (argc > 2) {
+		if (job.infile.empty() && job.outfile.empty()) {
+			job.infile = argv[1];
+			job.outfile = argv[2];
+		}
+		else if (job.infile.empty()) {
+			job.infile = argv[1];
+		}
+		else if (job.outfile.empty()) {
+			job.outfile = argv[1];
+		}
+	}
+	else if (argc > 1) {
+		if (job.infile.empty()) {
+			job.infile = argv[1];
+		}
+		else if (job.outfile.empty()) {
+			job.outfile = argv[1];
+		}
+	}
+	if (job.infile.empty()) {
+		job.infile = "-";
+	}
+	if (job.outfile.empty()) {
+		job.outfile = "-";
+	}
+}
+
+void run_job(Job& job) {
+	Profile::Timer timer("job");
+	// Everything libxml2 allocated for this document is gone once this goes out of scope, so it must outlive all DOMs and states below
+	Arena::Scope arena;
+	std::istream* in = nullptr;
+	std::unique_ptr<std::istream> _in;
+	// The injected document, unless it was written straight to the output file
+	std::string result;
+	bool injected = false;
+
+	// Streams opened on a folder only fail once read from, with an error that names neither the file nor the cause
+	if (job.infile != "-" && fs::is_directory(job.infile)) {
+		throw std::runtime_error(concat("Could not read ", job.infile.string(), ": Is a directory"));
+	}
+
+	// Injection writes the final output itself when given the path, saving a copy of potentially large files
+	fs::path direct;
+	if (job.outfile != "-") {
+		direct = job.outfile;
+	}
+
+	if (job.mode == "clean") {
+		// Extracts and immediately injects again - useful for cleaning documents for other CAT tools, such as OmegaT
+		// The state never outlives this process, so default to the storage with the least overhead
+		if (job.backend == Backends::detect) {
+			job.backend = Backends::memory;
+		}
+		// Unless something will look at the folder afterwards, the state need not even be written to it
+		if (job.backend == Backends::memory && !job.keep && job.cache.empty()) {
+			job.backend = Backends::transient;
+		}
+		auto x = extract(job.tmpdir, job.infile, job.format, job.stream, job.no_keep, job.backend, job.cache, job.since);
+		job.tmpdir = x.tmpdir;
+		auto rv = inject(x, direct, job.cache, job.keep);
+		result = std::move(rv.second);
+		injected = true;
+		job.tmpdir = rv.first;
+	}
+	else if (job.mode == "extract") {
+		auto x = extract(job.tmpdir, job.infile, job.format, job.stream, job.no_keep, job.backend, job.cache, job.since);
+		job.tmpdir = x.tmpdir;
+		x.state.reset();
+
+		// The stream is still in memory, so write it from there rather than reading the folder's copy back
+		std::unique_ptr<std::ostream> _out;
+		auto out = write_or_stdout(job.outfile.string().c_str(), _out);
+		auto sv = x2s(x.stream);
+		out->write(sv.data(), static_cast<std::streamsize>(sv.size()));
+		out->flush();
+	}
+	else if (job.mode == "inject") {
+		in = read_or_stdin(job.infile, _in);
+		auto rv = inject(job.tmpdir, *in, job.stream, direct, job.cache, job.keep);
+		result = std::move(rv.second);
+		injected = true;
+		job.tmpdir = rv.first;
+	}
+
+	if (injected && !direct.empty()) {
+		Profile::count(Profile::bytes_written, fs::file_size(direct));
+	}
+	else if (injected) {
+		Profile::count(Profile::bytes_written, result.size());
+
+		// Only create the output once there is something to put in it
+		std::unique_ptr<std::ostream> _out;
+		auto out = write_or_stdout(job.outfile.string().c_str(), _out);
+		out->write(result.data(), static_cast<std::streamsize>(result.size()));
+		out->flush();
+	}
+
+	// If neither --dir nor --keep, wipe the temporary folder
+	if (!job.keep && (job.mode == "clean" || job.mode == "inject")) {
+		_in.reset();
+		fs::remove_all(job.tmpdir);
+	}
+}
+
+// Runs a single line from a batch job list, and returns the result line to report
+std::string run_batch_line(std::string& line, const Job& defaults, const char* exe) {
+	std::vector<std::string> fields;
+	size_t l = 0;
+	for (auto b = line.find('\t'); b != std::string::npos; b = line.find('\t', l)) {
+		fields.emplace_back(line, l, b - l);
+		l = b + 1;
+	}
+	fields.emplace_back(line, l);
+
+	std::vector<char*> args;
+	args.push_back(const_cast<char*>(exe));
+	for (auto& f : fields) {
+		if (!f.empty()) {
+			args.push_back(&f[0]);
+		}
+	}
+	args.push_back(nullptr);
+
+	Job job = defaults;
+	try {
+		auto opts = make_tf_options();
+		auto argc = opts.parse(SI(args.size() - 1), args.data());
+		if (argc < 0) {
+			throw std::runtime_error(concat("Invalid option ", args[SZ(-argc)]));
+		}
+		job_options(opts, argc, args.data(), job);
+		if (job.infile == "-" || job.outfile == "-") {
+			throw std::runtime_error("Batch jobs must have both input and output files, as stdin and stdout are in use");
+		}
+		run_job(job);
+		return concat("OK\t", job.infile.string(), "\t", job.outfile.string());
+	}
+	catch (std::exception& e) {
+		return concat("ERR\t", job.infile.string(), "\t", e.what());
+	}
+}
+
+// Runs jobs read from stdin in this one process, so that ICU, libxml2, SQLite, and compiled regexes are set up only once
+// Each line holds tab-separated arguments in the same form as the command line, with missing options taken from the command line
+// For each job, a line of either OK<tab>input<tab>output or ERR<tab>input<tab>message is written to stdout
+// With more than 1 worker, jobs run concurrently and results are reported in the order they finish
+void run_batch(const Job& defaults, const char* exe, size_t workers) {
+	auto next_line = [](std::string& line) {
+		while (std::getline(std::cin, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			if (!line.empty() && line[0] != '#') {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	std::string line;
+	if (workers <= 1) {
+		while (next_line(line)) {
+			std::cout << run_batch_line(line, defaults, exe) << std::endl;
+		}
+		return;
+	}
+
+	std::mutex mtx;
+	std::condition_variable cv_work;
+	std::condition_variable cv_room;
+	std::deque<std::string> queue;
+	bool done = false;
+
+	auto worker = [&]() {
+		std::string work;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cv_work.wait(lock, [&]() { return done || !queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				work.swap(queue.front());
+				queue.pop_front();
+			}
+			cv_room.notify_one();
+
+			auto rv = run_batch_line(work, defaults, exe);
+
+			std::lock_guard<std::mutex> lock(mtx);
+			std::cout << rv << std::endl;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < workers; ++i) {
+		threads.emplace_back(worker);
+	}
+
+	// Don't read the job list much further ahead than the workers can keep up with
+	while (next_line(line)) {
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_room.wait(lock, [&]() { return queue.size() < workers * 2; });
+		queue.push_back(std::move(line));
+		lock.unlock();
+		cv_work.notify_one();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		done = true;
+	}
+	cv_work.notify_all();
+
+	for (auto& t : threads) {
+		t.join();
+	}
+}
+
+// Parses the value of -j, which must be a whole number from 0, meaning one per CPU core, up to max_jobs; otherwise prints the usage error and returns false
+// std::stoul() would throw on garbage and quietly wrap negative numbers around, so the value is checked by hand
+constexpr size_t max_jobs = 1024;
+bool parse_jobs(const std::string& exe, const std::string& value, size_t& jobs) {
+	if (!value.empty() && std::isdigit(static_cast<unsigned char>(value[0]))) {
+		errno = 0;
+		char* end = nullptr;
+		auto n = std::strtoul(value.c_str(), &end, 10);
+		if (errno != ERANGE && *end == 0 && n <= max_jobs) {
+			jobs = n;
+			return true;
+		}
+	}
+	std::cerr << "Invalid number of jobs for -j: '" << value << "'; must be 0 to " << max_jobs << "\n";
+	std::cerr << "Usage: " << exe << " [options] [input-file] [output-file]; see --help" << std::endl;
+	return false;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+	using namespace Transfuse;
+
+	// Must happen before any I/O, as turning it off later loses whatever stdin had already buffered
+	std::ios::sync_with_stdio(false);
+
+	auto opts = make_tf_options();
 	argc = opts.parse(argc, argv);
 
 	std::string exe = fs::path(argv[0]).stem().string();
@@ -125,88 +461,18 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
-	std::string_view mode{ "clean" };
+	Job job;
 	if (exe == "tf-extract") {
-		mode = "extract";
+		job.mode = "extract";
 	}
 	else if (exe == "tf-inject") {
-		mode = "inject";
+		job.mode = "inject";
 	}
 	else if (exe == "tf-clean") {
-		mode = "clean";
+		job.mode = "clean";
 	}
 
-	std::string_view format{"auto"};
-	Stream stream{ Streams::detect };
-	fs::path tmpdir;
-
-	fs::path infile;
-	std::ostream* out = nullptr;
-	std::unique_ptr<std::ostream> _out;
-
-	// Handle cmdline arguments
-	while (auto o = opts.get()) {
-		switch (o->opt) {
-		case 'f':
-			format = o->value;
-			break;
-		case 's':
-			if (o->value == Streams::apertium) {
-				stream = Streams::apertium;
-			}
-			else if (o->value == Streams::visl) {
-				stream = Streams::visl;
-			}
-			break;
-		case 'm':
-			mode = o->value;
-			break;
-		case 'd':
-			tmpdir = path(o->value);
-			opts.set("keep");
-			break;
-		case 'K':
-			opts.unset("keep");
-			break;
-		case 'i':
-			infile = path(o->value);
-			break;
-		case 'o':
-			out = write_or_stdout(o->value.data(), _out);
-			break;
-		case 'D':
-			opts.set("verbose");
-			break;
-		}
-	}
-
-	// Funnel remaining unparsed arguments into input and/or output files
-	if (argc > 2) {
-		if (infile.empty() && !out) {
-			infile = argv[1];
-			out = write_or_stdout(argv[2], _out);
-		}
-		else if (infile.empty()) {
-			infile = argv[1];
-		}
-		else if (!out) {
-			out = write_or_stdout(argv[1], _out);
-		}
-	}
-	else if (argc > 1) {
-		if (infile.empty()) {
-			infile = argv[1];
-		}
-		else if (!out) {
-			out = write_or_stdout(argv[2], _out);
-		}
-	}
-	if (infile.empty()) {
-		infile = "-";
-	}
-	if (!out) {
-		out = &std::cout;
-	}
+	job_options(opts, argc, argv, job);
 
 	UErrorCode status = U_ZERO_ERROR;
 	u_init(&status);
@@ -214,41 +480,57 @@ int main(int argc, char* argv[]) {
 		throw std::runtime_error(concat("Could not initialize ICU: ", u_errorName(status)));
 	}
 
-	auto curdir = fs::current_path();
-	std::istream* in = nullptr;
-	std::unique_ptr<std::istream> _in;
+	// libxml2's allocator can only be replaced before it has allocated anything
+	if (opts["arena"]) {
+		Arena::install();
+	}
+	xmlInitParser();
 
-	if (mode == "clean") {
-		// Extracts and immediately injects again - useful for cleaning documents for other CAT tools, such as OmegaT
-		tmpdir = extract(tmpdir, infile, format, stream, opts["no-keep"] != nullptr);
-		in = read_or_stdin("extracted", _in);
-		auto rv = inject(tmpdir, *in, stream);
-		std::ifstream data(rv.second, std::ios::binary);
-		data.exceptions(std::ios::badbit | std::ios::failbit);
-		(*out) << data.rdbuf();
-		out->flush();
-		tmpdir = rv.first;
+	fs::path profile;
+	if (auto o = opts["profile"]) {
+		profile = path(o->value);
+		Profile::enabled = true;
 	}
-	else if (mode == "extract") {
-		tmpdir = extract(tmpdir, infile, format, stream, opts["no-keep"] != nullptr);
-		std::ifstream data("extracted", std::ios::binary);
-		data.exceptions(std::ios::badbit | std::ios::failbit);
-		(*out) << data.rdbuf();
-		out->flush();
+
+	if (opts["batch"]) {
+		size_t workers = 1;
+		if (auto o = opts['j']) {
+			if (!parse_jobs(exe, std::string(o->value), workers)) {
+				return 1;
+			}
+			if (workers == 0) {
+				workers = std::max(std::thread::hardware_concurrency(), 1u);
+			}
+		}
+		// Concurrent jobs already keep the cores busy, so only a lone worker splits up its documents
+		set_doc_threads(workers > 1 ? 1 : 0);
+
+		if (job.backend == Backends::detect) {
+			job.backend = Backends::memory;
+		}
+
+		// Only settings carry over to the jobs, not files or folders
+		job.tmpdir.clear();
+		job.infile.clear();
+		job.outfile.clear();
+		job.since.clear();
+		run_batch(job, argv[0], workers);
+		if (!profile.empty()) {
+			Profile::report(profile);
+		}
+		return 0;
 	}
-	else if (mode == "inject") {
-		in = read_or_stdin(infile, _in);
-		auto rv = inject(tmpdir, *in, stream);
-		std::ifstream data(rv.second, std::ios::binary);
-		data.exceptions(std::ios::badbit | std::ios::failbit);
-		(*out) << data.rdbuf();
-		out->flush();
-		tmpdir = rv.first;
+
+	size_t threads = 0;
+	if (auto o = opts['j']) {
+		if (!parse_jobs(exe, std::string(o->value), threads)) {
+			return 1;
+		}
 	}
+	set_doc_threads(threads);
 
-	// If neither --dir nor --keep, wipe the temporary folder
-	if (!opts["keep"] && (mode == "clean" || mode == "inject")) {
-		fs::current_path(curdir);
-		fs::remove_all(tmpdir);
+	run_job(job);
+	if (!profile.empty()) {
+		Profile::report(profile);
 	}
 }
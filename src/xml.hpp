@@ -22,6 +22,7 @@
 #include "string_view.hpp"
 #include <libxml/tree.h>
 #include <libxml/xmlstring.h>
+#include <libxml/xmlerror.h>
 #include <string>
 #include <set>
 #include <algorithm>
@@ -48,6 +49,15 @@ inline xmlString& operator+=(xmlString& str, xmlChar_view xv) {
 	return str;
 }
 
+// Message of the most recent libxml2 error in the calling thread
+inline const char* xml_error_message() {
+	auto err = xmlGetLastError();
+	if (err && err->message) {
+		return err->message;
+	}
+	return "unknown error";
+}
+
 inline const xmlChar* XC(const char* c) {
 	return reinterpret_cast<const xmlChar*>(c);
 }
@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+# Runs a few jobs through --batch, one at a time and on a pool, and checks the OK/ERR lines and that the output matches one-off runs
+set -e
+set -o pipefail
+d="$PWD/batch"
+rm -rf "$d"
+mkdir -p "$d"
+
+"$1" -m clean "$2/test.html" "$d/expect.html"
+"$1" -m clean "$2/test.txt" "$d/expect.txt"
+"$1" -m extract -s visl "$2/test.html-fragment" "$d/expect.visl"
+
+for j in 1 3; do
+	# Fields are tab-separated arguments; a missing input file must fail that line alone
+	printf '%s\t%s\n' "$2/test.html" "$d/$j.html" > "$d/jobs"
+	printf '%s\t%s\t%s\t%s\n' -m clean "$2/test.txt" "$d/$j.txt" >> "$d/jobs"
+	printf '%s\t%s\t%s\n' "$d/nonexistent.html" "$d/$j.missing.html" >> "$d/jobs"
+	printf '%s\t%s\t%s\t%s\t%s\t%s\t%s\n' -m extract -s visl -K "$2/test.html-fragment" "$d/$j.visl" >> "$d/jobs"
+	"$1" --batch -j $j < "$d/jobs" | sort > "$d/$j.results"
+
+	{
+		printf 'ERR\t%s\tCould not read %s: No such file or directory\n' "$d/nonexistent.html" "$d/nonexistent.html"
+		printf 'OK\t%s\t%s\n' "$2/test.html-fragment" "$d/$j.visl"
+		printf 'OK\t%s\t%s\n' "$2/test.html" "$d/$j.html"
+		printf 'OK\t%s\t%s\n' "$2/test.txt" "$d/$j.txt"
+	} | sort > "$d/$j.expect"
+	diff "$d/$j.expect" "$d/$j.results"
+
+	diff "$d/expect.html" "$d/$j.html"
+	diff "$d/expect.txt" "$d/$j.txt"
+	# The stream header names the state folder, which differs between runs
+	diff <(tail -n +2 "$d/expect.visl") <(tail -n +2 "$d/$j.visl")
+	if [[ -e "$d/$j.missing.html" ]]; then
+		echo "Failed job left an output file behind"
+		exit 1
+	fi
+done
+
+rm -rf "$d"
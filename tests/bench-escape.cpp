@@ -0,0 +1,135 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Micro-benchmark for the escaping kernels, comparing them to plain byte-by-byte loops
+// Usage: bench-escape [MiB of input, default 64] [percent of bytes that need escaping, default 2]
+
+#include "simd.hpp"
+#include "dom.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+using namespace Transfuse;
+
+// The loops that were used before find_any(), kept as the reference
+static void append_xml_scalar(xmlString& str, xmlChar_view xc) {
+	for (auto c : xc) {
+		if (c == '&') {
+			str += "&amp;";
+		}
+		else if (c == '"') {
+			str += "&quot;";
+		}
+		else if (c == '\'') {
+			str += "&apos;";
+		}
+		else if (c == '<') {
+			str += "&lt;";
+		}
+		else if (c == '>') {
+			str += "&gt;";
+		}
+		else {
+			str += c;
+		}
+	}
+}
+
+static void escape_apertium_scalar(xmlString& s, std::string_view xc) {
+	for (auto c : xc) {
+		if (c == '^' || c == '$' || c == '[' || c == ']' || c == '{' || c == '}' || c == '/' || c == '\\' || c == '@' || c == '<' || c == '>') {
+			s += '\\';
+		}
+		s += static_cast<xmlChar>(c);
+	}
+}
+
+static void escape_apertium_simd(xmlString& s, std::string_view xc) {
+	auto b = xc.data();
+	auto e = b + xc.size();
+	while (b != e) {
+		auto n = find_any<'^', '$', '[', ']', '{', '}', '/', '\\', '@', '<', '>', '\xee'>(b, e);
+		s.append(reinterpret_cast<const xmlChar*>(b), SZ(n - b));
+		if (n == e) {
+			break;
+		}
+		s += '\\';
+		s += static_cast<xmlChar>(*n);
+		b = n + 1;
+	}
+}
+
+// Reports the best of a few runs, so that the first run's page faults for the output don't count
+template<typename F>
+static double run(const char* name, size_t bytes, xmlString& out, F f) {
+	double best = 0.0;
+	for (int i = 0; i < 3; ++i) {
+		out.clear();
+		auto start = std::chrono::steady_clock::now();
+		f(out);
+		std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+		best = std::max(best, static_cast<double>(bytes) / (1024.0 * 1024.0) / secs.count());
+	}
+	printf("%-24s %10.1f MiB/s\n", name, best);
+	return best;
+}
+
+int main(int argc, char* argv[]) {
+	size_t mib = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64;
+	double pct = argc > 2 ? std::atof(argv[2]) : 2.0;
+
+	// Mostly text, with the given share of characters that both escapers must handle
+	const std::string plain{ "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,;:!?-" };
+	const std::string special{ "&\"'<>[]{}^$/\\@" };
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> dist(0.0, 100.0);
+	std::string input(mib * 1024 * 1024, ' ');
+	for (auto& c : input) {
+		c = (dist(rng) < pct) ? special[rng() % special.size()] : plain[rng() % plain.size()];
+	}
+	auto xin = s2x(input);
+
+	xmlString a;
+	xmlString b;
+	printf("%zu MiB, %.1f%% special\n", mib, pct);
+#if defined(__AVX2__)
+	printf("kernel: AVX2\n");
+#elif defined(TF_SIMD_SSE2)
+	printf("kernel: SSE2\n");
+#elif defined(TF_SIMD_NEON)
+	printf("kernel: NEON\n");
+#else
+	printf("kernel: scalar\n");
+#endif
+
+	run("append_xml scalar", input.size(), a, [&](xmlString& o) { append_xml_scalar(o, xin); });
+	run("append_xml", input.size(), b, [&](xmlString& o) { append_xml(o, xin); });
+	if (a != b) {
+		fprintf(stderr, "append_xml output differs\n");
+		return 1;
+	}
+
+	run("apertium escape scalar", input.size(), a, [&](xmlString& o) { escape_apertium_scalar(o, input); });
+	run("apertium escape simd", input.size(), b, [&](xmlString& o) { escape_apertium_simd(o, input); });
+	if (a != b) {
+		fprintf(stderr, "Apertium escape output differs\n");
+		return 1;
+	}
+}
@@ -0,0 +1,35 @@
+#!/usr/bin/env bash
+# Checks that injection refuses damaged binary streams with an error, rather than running out of memory or quietly leaving blocks untranslated
+set -e
+set -o pipefail
+d="binary-stream"
+rm -rf "$d"
+mkdir -p "$d"
+"$1" -m extract -k -d "$d/state" -s binary "$2/test.html" "$d/good.bin"
+"$1" -m inject -k "$d/good.bin" "$d/good.html"
+
+# A stream cut off inside its last block
+head -c $(( $(wc -c < "$d/good.bin") - 7 )) "$d/good.bin" > "$d/cut.bin"
+if "$1" -m inject -k "$d/cut.bin" "$d/cut.html" 2>"$d/cut.err"; then
+	echo "Truncated stream was accepted"
+	exit 1
+fi
+grep -q "ended in the middle of block" "$d/cut.err"
+
+# A block claiming 0x7fffffff spans
+{ head -n 1 "$d/good.bin"; printf '\x01\x00\x00\x00X\xff\xff\xff\x7f'; } > "$d/huge.bin"
+if "$1" -m inject -k "$d/huge.bin" "$d/huge.html" 2>"$d/huge.err"; then
+	echo "Stream with a bogus span count was accepted"
+	exit 1
+fi
+grep -q "spans, more than" "$d/huge.err"
+
+# A block claiming a text far longer than the stream
+{ head -n 1 "$d/good.bin"; printf '\x01\x00\x00\x00X\x00\x00\x00\x00\xf0\xff\xff\xffabc'; } > "$d/long.bin"
+if "$1" -m inject -k "$d/long.bin" "$d/long.html" 2>"$d/long.err"; then
+	echo "Stream with a bogus text length was accepted"
+	exit 1
+fi
+grep -q "ended in the middle of block X, while reading its text" "$d/long.err"
+
+rm -rf "$d"
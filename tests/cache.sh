@@ -0,0 +1,23 @@
+#!/usr/bin/env bash
+# Checks that blocks missing from a stream are filled in from what the cache saved when an earlier stream was injected
+set -e
+set -o pipefail
+d="cache"
+rm -rf "$d"
+mkdir -p "$d"
+"$1" -m extract --cache "$d/cache" -d "$d/a" "$2/test.html" "$d/a.stream"
+sed 's/legal/LEGAL/g' "$d/a.stream" > "$d/a.translated"
+"$1" -m inject -d "$d/a" "$d/a.translated" "$d/a.html"
+grep -q LEGAL "$d/a.html"
+
+# Same document again, but with nothing in the stream, so every block must come from the cache
+"$1" -m extract --cache "$d/cache" -d "$d/b" "$2/test.html" "$d/b.stream"
+head -n 1 "$d/b.stream" > "$d/b.translated"
+"$1" -m inject -d "$d/b" "$d/b.translated" "$d/b.html" 2>"$d/b.err"
+if [[ -s "$d/b.err" ]]; then
+	cat "$d/b.err"
+	exit 1
+fi
+diff "$d/a.html" "$d/b.html"
+
+rm -rf "$d"
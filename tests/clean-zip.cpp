@@ -0,0 +1,137 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Checks the XML in a zip based test document that transfuse -m clean has been run on, for tree rewrites that extract tests can't see
+// Usage: clean-zip check path/to/original path/to/cleaned
+//   docx-tabs: splitting tabs into their own runs must not declare the w: namespace again
+//   odt-styles: deduplicated styles must be gone, and every style reference in content.xml and styles.xml must still resolve
+
+#include <zip.h>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+static std::string read_file(const std::string& fn) {
+	std::ifstream in(fn, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Could not read " + fn);
+	}
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+static std::string read_member(const std::string& data, const char* name) {
+	zip_error_t ze;
+	zip_error_init(&ze);
+	auto zs = zip_source_buffer_create(data.data(), data.size(), 0, &ze);
+	auto zip = zs ? zip_open_from_source(zs, ZIP_RDONLY, &ze) : nullptr;
+	zip_error_fini(&ze);
+	if (zip == nullptr) {
+		zip_source_free(zs);
+		throw std::runtime_error("Could not open cleaned document as zip");
+	}
+
+	zip_stat_t stat{};
+	zip_file_t* file = nullptr;
+	if (zip_stat(zip, name, 0, &stat) != 0 || (file = zip_fopen_index(zip, stat.index, 0)) == nullptr) {
+		zip_discard(zip);
+		throw std::runtime_error(std::string("Cleaned document did not have ") + name);
+	}
+	std::string rv(stat.size, 0);
+	auto n = zip_fread(file, &rv[0], stat.size);
+	zip_fclose(file);
+	zip_discard(zip);
+	if (n != static_cast<zip_int64_t>(stat.size)) {
+		throw std::runtime_error(std::string("Could not read ") + name);
+	}
+	return rv;
+}
+
+static size_t count(const std::string& haystack, const std::string& needle) {
+	size_t n = 0;
+	for (auto p = haystack.find(needle); p != std::string::npos; p = haystack.find(needle, p + 1)) {
+		++n;
+	}
+	return n;
+}
+
+static void check_docx_tabs(const std::string& original, const std::string& cleaned) {
+	auto before = read_member(original, "word/document.xml");
+	auto after = read_member(cleaned, "word/document.xml");
+	if (count(after, "xmlns:w=") != count(before, "xmlns:w=")) {
+		throw std::runtime_error("Split runs declared the w: namespace again");
+	}
+	if (count(after, "<w:tab/>") != count(before, "<w:tab/>")) {
+		throw std::runtime_error("Tabs were lost");
+	}
+}
+
+static void check_odt_styles(const std::string& cleaned) {
+	auto xml = read_member(cleaned, "content.xml") + read_member(cleaned, "styles.xml");
+
+	std::set<std::string> names;
+	std::regex rx_name{ R"X(\bstyle:name="([^"]*)")X" };
+	for (std::sregex_iterator it(xml.begin(), xml.end(), rx_name), end; it != end; ++it) {
+		names.insert((*it)[1]);
+	}
+	for (auto gone : { "P2", "MP2" }) {
+		if (names.count(gone)) {
+			throw std::runtime_error(std::string("Duplicate style ") + gone + " was not removed");
+		}
+	}
+
+	std::regex rx_ref{ R"X(\b[a-z]+:[a-z-]*style-name="([^"]*)")X" };
+	for (std::sregex_iterator it(xml.begin(), xml.end(), rx_ref), end; it != end; ++it) {
+		if (!names.count((*it)[1])) {
+			throw std::runtime_error("Dangling style reference: " + it->str());
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 4) {
+		std::cerr << "Usage: clean-zip check path/to/original path/to/cleaned" << std::endl;
+		return 1;
+	}
+	std::string check{ argv[1] };
+
+	try {
+		auto data = read_file(argv[2]);
+		auto cleaned = read_file(argv[3]);
+
+		if (check == "docx-tabs") {
+			check_docx_tabs(data, cleaned);
+		}
+		else if (check == "odt-styles") {
+			check_odt_styles(cleaned);
+		}
+		else {
+			throw std::runtime_error("Unknown check " + check);
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,9 @@
+#!/usr/bin/env bash
+# Usage: clean-zip.sh path/to/transfuse path/to/clean-zip check path/to/document
+set -e
+set -o pipefail
+out="clean-$3.out.${4##*.}"
+rm -f "$out"
+"$1" -m clean "$4" "$out"
+"$2" "$3" "$4" "$out"
+rm -f "$out"
@@ -0,0 +1,122 @@
+#!/usr/bin/env bash
+# Injects an edited translation of test.html and compares the result, to check how injection copes with streams that came back from translation in worse shape than they went out
+set -e
+set -o pipefail
+d="inject-$3"
+rm -rf "$d"
+mkdir -p "$d"
+"$1" -m extract -d "$d/state" "$2/test.html" "$d/in.stream"
+
+# The stream is a header and then blocks, each ending with a \0
+blocks=()
+while IFS= read -r -d '' b; do
+	blocks+=("$b")
+done < "$d/in.stream"
+n=$((${#blocks[@]} - 1))
+# Prefixes a block's text with its number, so the output shows which translation ended up where
+tag() {
+	printf '%s\0' "${blocks[$1]/$'\n\n'/$'\n\n'"T$1 "}"
+}
+
+{
+	printf '%s\0' "${blocks[0]}"
+	case "$3" in
+	reordered)
+		for ((i = n; i > 0; --i)); do
+			tag $i
+		done
+		;;
+	dropped)
+		for ((i = 1; i <= n; ++i)); do
+			if ((i != 3 && i != 14 && i != 53)); then
+				tag $i
+			fi
+		done
+		;;
+	duplicated)
+		for ((i = 1; i <= n; ++i)); do
+			tag $i
+			if ((i == 5)); then
+				printf '%s\0' "${blocks[$i]/I am/We are}"
+			fi
+		done
+		printf '%s\0' "${blocks[3]/legal/lawful}"
+		;;
+	*)
+		for ((i = 1; i <= n; ++i)); do
+			printf '%s\0' "${blocks[$i]}"
+		done
+		;;
+	esac
+} > "$d/cases.stream"
+
+# Inline markers as raw bytes, as a translation might echo them in plain text
+open_b=$'\xee\x80\x91'
+open_e=$'\xee\x80\x92'
+close=$'\xee\x80\x93'
+
+case "$3" in
+inlines)
+	# An unknown style, a lost close, a stray close, an open missing its brackets, a style moved onto other words, and raw markers in the text
+	sed \
+		-e 's/\[\[t:b:aNiiLA\]\]I\[\[\/\]\] am /[[t:b:AAAAAA]]I[[\/]] am /' \
+		-e 's/^I \[\[t:b:QjZnxQ\]\]am David\[\[\/\]\]\./I [[t:b:QjZnxQ]]am David./' \
+		-e 's/^Bees \[\[t:i:HatKkQ\]\]cannot\[\[\/\]\] swim\./Bees [[t:i:HatKkQ]]cannot[[\/]] swim[[\/]]./' \
+		-e 's/"\[\[t:i:wSM6RQ\]\]understand /"[[t:i:wSM6RQ understand /' \
+		-e 's/^Bees \[\[t:i:Z1Z-ew\]\]cannot swim\[\[\/\]\]\./[[t:i:Z1Z-ew]]Bees[[\/]] cannot swim./' \
+		-e "s/^Bees cannot swim\./Bees ${close}cannot${open_e} swim${open_b}./" \
+		"$d/cases.stream" > "$d/out.stream"
+	;;
+protected)
+	# A protected inline moved to the start, out of its inline, duplicated, dropped, and one that does not exist
+	sed \
+		-e 's/^Text with protected \[tf:P:iqz-BQ\] inline tag\./[tf:P:iqz-BQ] Text with protected inline tag./' \
+		-e 's/\[\[t:a:GVbw3w\]\]embedded \[tf:P:iqz-BQ\] protected\[\[\/\]\]/[[t:a:GVbw3w]]embedded protected[[\/]] [tf:P:iqz-BQ]/' \
+		-e 's/multiple protected \[tf:P:6Uyp6Q\] inline/multiple protected [tf:P:6Uyp6Q] inline [tf:P:6Uyp6Q]/' \
+		-e 's/^Text with protected \[tf:P:iqz-BQ\] \[\[t:a:2jDz4g\]\]/Text with protected [[t:a:2jDz4g]]/' \
+		-e 's/\[tf:P:VkcwCQ\]embedded protected/[tf:P:AAAAAA]embedded protected/' \
+		"$d/cases.stream" > "$d/out.stream"
+	;;
+*)
+	mv "$d/cases.stream" "$d/out.stream"
+	;;
+esac
+# Each edit must match exactly once, so a change in the fixture can't quietly turn a case into a no-op
+edits=$(diff <(tr '\0' '\n' < "$d/in.stream") <(tr '\0' '\n' < "$d/out.stream") | grep -c '^>' || true)
+if [[ "$3" == inlines && $edits != 6 ]] || [[ "$3" == protected && $edits != 5 ]]; then
+	echo "Expected every edit to change one block, but $edits did"
+	exit 1
+fi
+
+"$1" -m inject -d "$d/state" "$d/out.stream" "$d/out.html" 2>"$d/err"
+diff "$2/inject-$3.expect" "$d/out.html"
+
+# Dropped blocks stay untranslated, and for duplicated ones the first translation wins, but either way each is reported, as are styles that do not exist
+case "$3" in
+dropped)
+	report="was neither in the stream"
+	want=3
+	;;
+inlines)
+	report="did not exist in this document"
+	want=2
+	;;
+protected)
+	report="did not exist in this document"
+	want=1
+	;;
+duplicated)
+	report="did not exist in this document"
+	want=2
+	;;
+*)
+	report="."
+	want=0
+	;;
+esac
+if [[ $(grep -c "$report" "$d/err" || true) != $want ]]; then
+	cat "$d/err"
+	echo "Expected $want warnings"
+	exit 1
+fi
+rm -rf "$d"
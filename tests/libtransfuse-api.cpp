@@ -0,0 +1,115 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Exercises the embeddable API on one test document: the stream must match what the binary extracts, and injection must be repeatable and safe to run from several threads
+// Usage: libtransfuse-api path/to/tests format stream
+
+#include "libtransfuse.hpp"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Transfuse;
+
+static std::string read_file(const std::string& fn) {
+	std::ifstream in(fn, std::ios::binary);
+	if (!in) {
+		throw std::runtime_error("Could not read " + fn);
+	}
+	std::ostringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+// Same as extract.sh, leave out the header, as it is the only part that differs between runs
+static std::string strip_header(const std::string& stream) {
+	std::string rv;
+	std::istringstream in(stream);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.compare(0, 11, "[transfuse:") == 0 || line.compare(0, 21, "<STREAMCMD:TRANSFUSE:") == 0) {
+			continue;
+		}
+		rv += line;
+		rv += '\n';
+	}
+	return rv;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 4) {
+		std::cerr << "Usage: libtransfuse-api path/to/tests format stream" << std::endl;
+		return 1;
+	}
+	std::string dir{ argv[1] };
+	std::string format{ argv[2] };
+	std::string stream{ argv[3] };
+
+	try {
+		init();
+
+		auto data = read_file(dir + "/test." + format);
+		ExtractOptions opts;
+		opts.stream = stream;
+		opts.name = "test." + format;
+
+		auto x = extract(data, opts);
+		if (strip_header(x.stream) != read_file(dir + "/extract-" + format + "-" + stream + ".expect")) {
+			throw std::runtime_error("Extracted stream differed from the expected output");
+		}
+
+		auto first = inject(x.document, x.stream);
+		if (first.empty()) {
+			throw std::runtime_error("Injection gave an empty document");
+		}
+		if (inject(x.document, x.stream) != first) {
+			throw std::runtime_error("Injecting the same document twice gave different results");
+		}
+
+		std::vector<std::string> results(4);
+		std::vector<std::thread> threads;
+		for (auto& result : results) {
+			threads.emplace_back([&]() {
+				try {
+					auto tx = extract(data, opts);
+					result = inject(tx.document, tx.stream);
+				}
+				catch (std::exception& e) {
+					result = e.what();
+				}
+			});
+		}
+		for (auto& t : threads) {
+			t.join();
+		}
+		for (auto& result : results) {
+			if (result != first) {
+				throw std::runtime_error("Concurrent extraction and injection gave a different result");
+			}
+		}
+	}
+	catch (std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
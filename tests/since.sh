@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Checks that --since only streams blocks the earlier folder has no translations for, and that injection still fills in all the others
+set -e
+set -o pipefail
+d="since"
+rm -rf "$d"
+mkdir -p "$d"
+"$1" -m extract -d "$d/a" "$2/test.html" "$d/a.stream"
+"$1" -m inject -d "$d/a" "$d/a.stream" "$d/a.html"
+
+sed '0,/<p>/s//<p>A sentence that was not there before. /' "$2/test.html" > "$d/b.html"
+"$1" -m extract -d "$d/b" --since "$d/a" "$d/b.html" "$d/b.stream"
+if [[ $(grep -ac '^\[tf-block:' "$d/b.stream") != 1 ]]; then
+	echo "Expected exactly the one changed block in the stream"
+	exit 1
+fi
+"$1" -m inject -d "$d/b" "$d/b.stream" "$d/b.out.html" 2>"$d/b.err"
+if [[ -s "$d/b.err" ]]; then
+	cat "$d/b.err"
+	exit 1
+fi
+"$1" -m clean "$d/b.html" "$d/b.clean.html"
+diff "$d/b.clean.html" "$d/b.out.html"
+
+# A folder that was never injected into has no translations to take blocks from
+"$1" -m extract -d "$d/c" "$2/test.html" "$d/c.stream"
+if "$1" -m extract -d "$d/e" --since "$d/c" "$d/b.html" "$d/e.stream" 2>"$d/e.err"; then
+	echo "--since accepted a folder without translations"
+	exit 1
+fi
+grep -q "had no translations" "$d/e.err"
+
+# Blocks that are neither in the stream nor among the earlier translations are reported
+head -n 1 "$d/b.stream" > "$d/f.stream"
+"$1" -m inject -d "$d/b" "$d/f.stream" "$d/f.html" 2>"$d/f.err"
+grep -q "was neither in the stream nor among earlier translations" "$d/f.err"
+
+rm -rf "$d"
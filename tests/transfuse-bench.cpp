@@ -0,0 +1,445 @@
+/*
+* Copyright (C) 2020 Tino Didriksen <mail@tinodidriksen.com>
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Corpus-scale benchmark: synthesizes large documents of each format and times transfuse extracting, injecting, and cleaning them
+// Each measurement is a separate run of the given transfuse binary, so peak RSS is that of the child process alone
+// Results are written as JSON, so they can be tracked over time
+// Usage: transfuse-bench [options] path/to/transfuse
+
+#include "filesystem.hpp"
+#include "options.hpp"
+#include <zip.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern char** environ;
+
+struct Params {
+	size_t blocks = 5000;
+	size_t styles = 20; // Percent of runs that have a style of their own
+	size_t slides = 50;
+	size_t runs = 3;
+	uint32_t seed = 42;
+};
+
+// A paragraph is a list of runs, each with a style: 0 is plain, 1 bold, 2 italic, 3 bold+italic
+struct Run {
+	std::string text;
+	int style = 0;
+};
+using Para = std::vector<Run>;
+
+struct Gen {
+	std::mt19937 rng;
+	size_t styles;
+
+	Gen(const Params& p)
+	  : rng(p.seed)
+	  , styles(p.styles)
+	{}
+
+	size_t pick(size_t n) {
+		return std::uniform_int_distribution<size_t>(0, n - 1)(rng);
+	}
+
+	// Words are random enough that the blocks get distinct hashes, and include some that need escaping
+	std::string word() {
+		static const char* words[] = {
+			"the", "translation", "of", "documents", "is", "a", "process", "which", "keeps", "formatting",
+			"intact", "while", "text", "flows", "through", "machine", "pipelines", "and", "comes", "back",
+			"Æbleskiver", "naïve", "señor", "straße", "R&D", "<tag>", "\"quoted\"", "don't", "50%", "e.g.",
+		};
+		std::string rv = words[pick(sizeof(words) / sizeof(*words))];
+		if (pick(8) == 0) {
+			rv += std::to_string(pick(1000));
+		}
+		return rv;
+	}
+
+	Para para() {
+		Para rv;
+		auto nr = 2 + pick(6);
+		for (size_t r = 0; r < nr; ++r) {
+			Run run;
+			auto nw = 1 + pick(5);
+			for (size_t w = 0; w < nw; ++w) {
+				run.text += word();
+				run.text += ' ';
+			}
+			if (r + 1 == nr) {
+				run.text.back() = '.';
+			}
+			if (pick(100) < styles) {
+				run.style = 1 + static_cast<int>(pick(3));
+			}
+			rv.push_back(std::move(run));
+		}
+		return rv;
+	}
+};
+
+static std::string xml_escape(const std::string& str) {
+	std::string rv;
+	for (auto c : str) {
+		switch (c) {
+		case '&':
+			rv += "&amp;";
+			break;
+		case '<':
+			rv += "&lt;";
+			break;
+		case '>':
+			rv += "&gt;";
+			break;
+		case '"':
+			rv += "&quot;";
+			break;
+		default:
+			rv += c;
+			break;
+		}
+	}
+	return rv;
+}
+
+static std::string make_html(Gen& gen, const Params& p) {
+	static const char* tags[][2] = { { "", "" }, { "<b>", "</b>" }, { "<i>", "</i>" }, { "<b><i>", "</i></b>" } };
+	std::string rv = "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Benchmark</title></head><body>\n";
+	for (size_t b = 0; b < p.blocks; ++b) {
+		rv += (b % 10 == 0) ? "<h2>" : "<p>";
+		for (auto& run : gen.para()) {
+			rv += tags[run.style][0];
+			rv += xml_escape(run.text);
+			rv += tags[run.style][1];
+		}
+		rv += (b % 10 == 0) ? "</h2>\n" : "</p>\n";
+	}
+	rv += "</body></html>\n";
+	return rv;
+}
+
+static std::string make_text(Gen& gen, const Params& p) {
+	std::string rv;
+	for (size_t b = 0; b < p.blocks; ++b) {
+		for (auto& run : gen.para()) {
+			rv += run.text;
+		}
+		rv += "\n\n";
+	}
+	return rv;
+}
+
+static std::string make_docx_document(Gen& gen, const Params& p) {
+	static const char* props[] = { "", "<w:b/>", "<w:i/>", "<w:b/><w:i/>" };
+	std::string rv = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n<w:document xmlns:w=\"http://schemas.openxmlformats.org/wordprocessingml/2006/main\"><w:body>";
+	for (size_t b = 0; b < p.blocks; ++b) {
+		rv += "<w:p w:rsidR=\"00A1B2C3\" w:rsidRDefault=\"00A1B2C3\">";
+		for (auto& run : gen.para()) {
+			// Word sprinkles language tags and revision IDs on nearly every run, which extraction has to scrub
+			rv += "<w:r w:rsidRPr=\"00D4E5F6\"><w:rPr>";
+			rv += props[run.style];
+			rv += "<w:lang w:val=\"en-US\"/></w:rPr><w:t xml:space=\"preserve\">";
+			rv += xml_escape(run.text);
+			rv += "</w:t></w:r>";
+		}
+		rv += "</w:p>";
+	}
+	rv += "<w:sectPr/></w:body></w:document>";
+	return rv;
+}
+
+static std::string make_pptx_slide(Gen& gen, size_t paras) {
+	static const char* attrs[] = { "", " b=\"1\"", " i=\"1\"", " b=\"1\" i=\"1\"" };
+	std::string rv = "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n<p:sld xmlns:a=\"http://schemas.openxmlformats.org/drawingml/2006/main\" xmlns:r=\"http://schemas.openxmlformats.org/officeDocument/2006/relationships\" xmlns:p=\"http://schemas.openxmlformats.org/presentationml/2006/main\"><p:cSld><p:spTree><p:sp><p:txBody><a:bodyPr/>";
+	for (size_t b = 0; b < paras; ++b) {
+		rv += "<a:p>";
+		for (auto& run : gen.para()) {
+			rv += "<a:r><a:rPr lang=\"en-US\"";
+			rv += attrs[run.style];
+			rv += "/><a:t>";
+			rv += xml_escape(run.text);
+			rv += "</a:t></a:r>";
+		}
+		rv += "</a:p>";
+	}
+	rv += "</p:txBody></p:sp></p:spTree></p:cSld></p:sld>";
+	return rv;
+}
+
+static std::string make_odt_content(Gen& gen, const Params& p) {
+	static const char* names[] = { "", "T1", "T2", "T3" };
+	std::string rv = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<office:document-content xmlns:office=\"urn:oasis:names:tc:opendocument:xmlns:office:1.0\" xmlns:style=\"urn:oasis:names:tc:opendocument:xmlns:style:1.0\" xmlns:text=\"urn:oasis:names:tc:opendocument:xmlns:text:1.0\" xmlns:fo=\"urn:oasis:names:tc:opendocument:xmlns:xsl-fo-compatible:1.0\" office:version=\"1.2\"><office:automatic-styles>"
+		"<style:style style:name=\"T1\" style:family=\"text\"><style:text-properties fo:font-weight=\"bold\"/></style:style>"
+		"<style:style style:name=\"T2\" style:family=\"text\"><style:text-properties fo:font-style=\"italic\"/></style:style>"
+		"<style:style style:name=\"T3\" style:family=\"text\"><style:text-properties fo:font-weight=\"bold\" fo:font-style=\"italic\"/></style:style>"
+		"</office:automatic-styles><office:body><office:text>";
+	for (size_t b = 0; b < p.blocks; ++b) {
+		rv += "<text:p>";
+		for (auto& run : gen.para()) {
+			if (run.style) {
+				rv += "<text:span text:style-name=\"";
+				rv += names[run.style];
+				rv += "\">";
+				rv += xml_escape(run.text);
+				rv += "</text:span>";
+			}
+			else {
+				rv += xml_escape(run.text);
+			}
+		}
+		rv += "</text:p>";
+	}
+	rv += "</office:text></office:body></office:document-content>";
+	return rv;
+}
+
+static void write_zip(const fs::path& fn, const std::vector<std::pair<std::string, std::string>>& members) {
+	int e = 0;
+	auto zip = zip_open(fn.string().c_str(), ZIP_CREATE | ZIP_TRUNCATE, &e);
+	if (zip == nullptr) {
+		throw std::runtime_error("Could not create " + fn.string());
+	}
+	for (auto& m : members) {
+		auto src = zip_source_buffer(zip, m.second.data(), m.second.size(), 0);
+		if (src == nullptr || zip_file_add(zip, m.first.c_str(), src, ZIP_FL_ENC_UTF_8) < 0) {
+			zip_source_free(src);
+			zip_discard(zip);
+			throw std::runtime_error("Could not add " + m.first + " to " + fn.string());
+		}
+	}
+	// The buffers are only read here, so they must outlive this call
+	if (zip_close(zip) != 0) {
+		zip_discard(zip);
+		throw std::runtime_error("Could not write " + fn.string());
+	}
+}
+
+static void write_file(const fs::path& fn, const std::string& data) {
+	std::ofstream out(fn.string(), std::ios::binary);
+	out.exceptions(std::ios::badbit | std::ios::failbit);
+	out.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+// Writes the synthesized document for a format, and returns its path
+static fs::path make_document(const fs::path& dir, const std::string& format, const Params& p) {
+	Gen gen(p);
+	auto fn = dir / ("bench." + format);
+	if (format == "html") {
+		write_file(fn, make_html(gen, p));
+	}
+	else if (format == "txt") {
+		write_file(fn, make_text(gen, p));
+	}
+	else if (format == "docx") {
+		write_zip(fn, {
+			{ "[Content_Types].xml", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\"><Override PartName=\"/word/document.xml\" ContentType=\"application/vnd.openxmlformats-officedocument.wordprocessingml.document.main+xml\"/></Types>" },
+			{ "word/document.xml", make_docx_document(gen, p) },
+		});
+	}
+	else if (format == "pptx") {
+		std::vector<std::pair<std::string, std::string>> members{
+			{ "[Content_Types].xml", "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\"/>" },
+		};
+		auto slides = std::max<size_t>(p.slides, 1);
+		for (size_t s = 0; s < slides; ++s) {
+			auto paras = p.blocks / slides + (s < p.blocks % slides ? 1 : 0);
+			members.emplace_back("ppt/slides/slide" + std::to_string(s + 1) + ".xml", make_pptx_slide(gen, std::max<size_t>(paras, 1)));
+		}
+		write_zip(fn, members);
+	}
+	else if (format == "odt") {
+		write_zip(fn, {
+			{ "mimetype", "application/vnd.oasis.opendocument.text" },
+			{ "content.xml", make_odt_content(gen, p) },
+		});
+	}
+	else {
+		throw std::runtime_error("Unknown format " + format);
+	}
+	return fn;
+}
+
+struct Measure {
+	double seconds = 0;
+	long peak_rss_kb = 0;
+};
+
+// Runs the command with output discarded, and measures its wall time and peak RSS
+static Measure run(const std::vector<std::string>& args) {
+	std::vector<char*> argv;
+	for (auto& a : args) {
+		argv.push_back(const_cast<char*>(a.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, 2, "/dev/null", O_WRONLY, 0);
+
+	auto start = std::chrono::steady_clock::now();
+	pid_t pid = 0;
+	auto err = posix_spawn(&pid, argv[0], &fa, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (err != 0) {
+		throw std::runtime_error("Could not run " + args[0]);
+	}
+
+	int status = 0;
+	rusage ru{};
+	if (wait4(pid, &status, 0, &ru) != pid) {
+		throw std::runtime_error("Could not wait for " + args[0]);
+	}
+	Measure rv;
+	rv.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	rv.peak_rss_kb = ru.ru_maxrss;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		std::string cmd;
+		for (auto& a : args) {
+			cmd += ' ';
+			cmd += a;
+		}
+		throw std::runtime_error("Failed:" + cmd);
+	}
+	return rv;
+}
+
+// Fastest of several runs, as the slower ones only measure noise from elsewhere in the system
+static Measure best_of(size_t runs, const std::vector<std::string>& args) {
+	Measure rv;
+	for (size_t i = 0; i < runs; ++i) {
+		auto m = run(args);
+		if (i == 0 || m.seconds < rv.seconds) {
+			rv.seconds = m.seconds;
+		}
+		rv.peak_rss_kb = std::max(rv.peak_rss_kb, m.peak_rss_kb);
+	}
+	return rv;
+}
+
+static std::vector<std::string> split(std::string_view str) {
+	std::vector<std::string> rv;
+	size_t l = 0;
+	for (auto b = str.find(','); b != std::string_view::npos; b = str.find(',', l)) {
+		rv.emplace_back(str.substr(l, b - l));
+		l = b + 1;
+	}
+	rv.emplace_back(str.substr(l));
+	return rv;
+}
+
+int main(int argc, char* argv[]) {
+	using namespace Options;
+	auto opts = make_options(
+		O('h',    "help", "shows this help"),
+		O('b',  "blocks", ARG_REQ, "paragraphs per document; defaults to 5000"),
+		O('s',  "styles", ARG_REQ, "percent of runs that are bold and/or italic; defaults to 20"),
+		O('S',  "slides", ARG_REQ, "slides to spread the PPTX paragraphs over; defaults to 50"),
+		O('f', "formats", ARG_REQ, "comma-separated formats to test: html, txt, docx, pptx, odt; defaults to all"),
+		O('t', "streams", ARG_REQ, "comma-separated stream formats to test: apertium, visl, binary; defaults to apertium"),
+		O('r',    "runs", ARG_REQ, "runs of each measurement, of which the fastest is reported; defaults to 3"),
+		O('o',  "output", ARG_REQ, "write the JSON to this file instead of stdout"),
+		O('k',    "keep",  ARG_NO, "keep the folder with the generated documents and their state")
+	);
+	argc = opts.parse(argc, argv);
+	if (argc < 0) {
+		std::fprintf(stderr, "Invalid option %s\n", argv[-argc]);
+		return 1;
+	}
+	if (opts['h'] || argc < 2) {
+		std::fprintf(stderr, "transfuse-bench [options] path/to/transfuse\n\nOptions:\n%s", opts.explain().c_str());
+		return opts['h'] ? 0 : 1;
+	}
+
+	Params p;
+	if (auto o = opts['b']) {
+		p.blocks = std::stoul(std::string(o->value));
+	}
+	if (auto o = opts['s']) {
+		p.styles = std::stoul(std::string(o->value));
+	}
+	if (auto o = opts['S']) {
+		p.slides = std::stoul(std::string(o->value));
+	}
+	if (auto o = opts['r']) {
+		p.runs = std::max<size_t>(std::stoul(std::string(o->value)), 1);
+	}
+	auto formats = split(opts['f'] ? opts['f']->value : std::string_view("html,txt,docx,pptx,odt"));
+	auto streams = split(opts['t'] ? opts['t']->value : std::string_view("apertium"));
+	std::string tf = fs::absolute(argv[1]).string();
+
+	auto dir = fs::temp_directory_path() / ("transfuse-bench-" + std::to_string(getpid()));
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+
+	std::string json = "{\n\t\"blocks\": " + std::to_string(p.blocks) + ",\n\t\"styles\": " + std::to_string(p.styles) + ",\n\t\"slides\": " + std::to_string(p.slides) + ",\n\t\"runs\": " + std::to_string(p.runs) + ",\n\t\"results\": [";
+	bool first = true;
+	int rv = 0;
+	try {
+		for (auto& format : formats) {
+			auto doc = make_document(dir, format, p).string();
+			auto bytes = fs::file_size(doc);
+			for (auto& stream : streams) {
+				auto base = (dir / (format + "-" + stream)).string();
+				std::pair<const char*, std::vector<std::string>> modes[] = {
+					{ "extract", { tf, "-m", "extract", "-s", stream, "-K", "-d", base + ".state", doc, base + ".stream" } },
+					// Injects the untranslated stream, which exercises the same work as a translated one
+					{ "inject", { tf, "-m", "inject", "-s", stream, "-d", base + ".state", base + ".stream", base + ".out" } },
+					{ "clean", { tf, "-m", "clean", "-s", stream, doc, base + ".clean" } },
+				};
+				for (auto& mode : modes) {
+					auto m = best_of(p.runs, mode.second);
+					char buf[512]{};
+					std::snprintf(buf, sizeof(buf), "%s\n\t\t{ \"format\": \"%s\", \"stream\": \"%s\", \"mode\": \"%s\", \"bytes\": %zu, \"seconds\": %.4f, \"mb_per_s\": %.2f, \"peak_rss_kb\": %ld }",
+						first ? "" : ",", format.c_str(), stream.c_str(), mode.first, static_cast<size_t>(bytes), m.seconds, static_cast<double>(bytes) / (1024.0 * 1024.0) / m.seconds, m.peak_rss_kb);
+					json += buf;
+					first = false;
+				}
+			}
+		}
+	}
+	catch (std::exception& e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		rv = 1;
+	}
+	json += "\n\t]\n}\n";
+
+	if (auto o = opts['o']) {
+		write_file(fs::path(std::string(o->value)), json);
+	}
+	else {
+		std::fputs(json.c_str(), stdout);
+	}
+
+	if (!opts['k']) {
+		fs::remove_all(dir);
+	}
+	return rv;
+}